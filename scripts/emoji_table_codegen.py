@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+# Generates the two level lookup table used by emoji::isEmoji() from emoji-test.txt.
+# usage: emoji_table_codegen.py /path/to/emoji-test.txt > src/emoji/EmojiTable.cpp
+
+import sys
+
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+WORDS_PER_BLOCK = BLOCK_SIZE // 64
+MAX_CODEPOINT = 0x110000
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('usage: emoji_table_codegen.py /path/to/emoji-test.txt')
+        sys.exit(1)
+
+    codepoints = set()
+    for line in open(sys.argv[1], 'r', encoding="utf8"):
+        line = line.strip()
+        if not line or line.startswith('#'):
+            continue
+
+        code = line.split(';', 1)[0].strip()
+        for c in code.split(' '):
+            cp = int(c, 16)
+            # ASCII digits, '#' and '*' only form keycap sequences, they are not emoji by themselves
+            if cp >= 0x80:
+                codepoints.add(cp)
+
+    blocks = [tuple([0] * WORDS_PER_BLOCK)]
+    block_ids = {blocks[0]: 0}
+    index = []
+    for block in range(MAX_CODEPOINT // BLOCK_SIZE):
+        words = [0] * WORDS_PER_BLOCK
+        for cp in range(block * BLOCK_SIZE, (block + 1) * BLOCK_SIZE):
+            if cp in codepoints:
+                offset = cp - block * BLOCK_SIZE
+                words[offset // 64] |= 1 << (offset % 64)
+        words = tuple(words)
+        if words not in block_ids:
+            block_ids[words] = len(blocks)
+            blocks.append(words)
+        index.append(block_ids[words])
+
+    assert len(blocks) <= 256
+
+    print('''\
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// DO NOT EDIT EmojiTable.cpp DIRECTLY! EDIT IT IN scripts/emoji_table_codegen.py AND RUN
+// scripts/codegen.sh!
+
+#include "emoji/Emoji.h"
+
+#include <array>
+#include <cstdint>
+
+namespace {{
+// Maps every block of {block_size} codepoints to its bitmap in blockBitmaps.
+constexpr std::array<std::uint8_t, {index_size}> blockIndex = {{'''.format(
+        block_size=BLOCK_SIZE, index_size=len(index)))
+    for i in range(0, len(index), 16):
+        print('  ' + ' '.join('{},'.format(x) for x in index[i:i + 16]))
+    print('''}};
+
+// Deduplicated bitmaps of {block_size} codepoints each.
+constexpr std::array<std::array<std::uint64_t, {words}>, {block_count}> blockBitmaps = {{{{'''.format(
+        block_size=BLOCK_SIZE, words=WORDS_PER_BLOCK, block_count=len(blocks)))
+    for b in blocks:
+        print('  {' + ', '.join('0x{:016x}'.format(w) for w in b) + '},')
+    print('''}}}};
+}}
+
+bool
+emoji::isEmoji(char32_t code)
+{{
+    if (code >= {max_codepoint:#x})
+        return false;
+
+    const auto &block = blockBitmaps[blockIndex[code >> {block_bits}]];
+    const auto offset = code & {block_mask:#x};
+    return (block[offset >> 6] >> (offset & 63)) & 1;
+}}'''.format(max_codepoint=MAX_CODEPOINT, block_bits=BLOCK_BITS, block_mask=BLOCK_SIZE - 1))
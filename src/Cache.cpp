@@ -5,18 +5,31 @@
 #include "Cache.h"
 #include "Cache_p.h"
 
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <variant>
 
+#include <QCache>
 #include <QCoreApplication>
 #include <QCryptographicHash>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
 #include <QHash>
 #include <QMap>
 #include <QMessageBox>
 #include <QStandardPaths>
+#include <QTimer>
 
 #if __has_include(<lmdbxx/lmdb++.h>)
 #include <lmdbxx/lmdb++.h>
@@ -37,15 +50,17 @@
 
 #include "ChatPage.h"
 #include "EventAccessors.h"
+#include "InternedId.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "MemberIndex.h"
 #include "UserSettingsPage.h"
 #include "Utils.h"
 #include "encryption/Olm.h"
 
 //! Should be changed when a breaking change occurs in the cache format.
 //! This will reset client's data.
-static constexpr std::string_view CURRENT_CACHE_FORMAT_VERSION{"2023.10.22"};
+static constexpr std::string_view CURRENT_CACHE_FORMAT_VERSION{"2024.04.01"};
 static constexpr std::string_view MAX_DBS_SETTINGS_KEY{"database/maxdbs"};
 static constexpr std::string_view MAX_DB_SIZE_SETTINGS_KEY{"database/maxsize"};
 
@@ -54,6 +69,14 @@ static const std::string_view NEXT_BATCH_KEY("next_batch");
 static const std::string_view OLM_ACCOUNT_KEY("olm_account");
 static const std::string_view CACHE_FORMAT_VERSION_KEY("cache_format_version");
 static const std::string_view CURRENT_ONLINE_BACKUP_VERSION("current_online_backup_version");
+static const std::string_view BACKUP_RESTORE_PROGRESS_KEY("backup_restore_progress");
+static const std::string_view NEXT_ROOM_NUMBER_KEY("next_room_number");
+//! Last room the retention policies were applied to.
+static const std::string_view RETENTION_POSITION_KEY("retention_position");
+//! Key of the default policy in the retention policies db.
+static const std::string_view DEFAULT_RETENTION_POLICY_KEY("default");
+//! Set in the sync state of a compacted copy, once it is complete.
+static const std::string_view COMPACTION_FINISHED_KEY("compaction_finished");
 
 static constexpr auto MAX_DBS_DEFAULT = 32384U;
 
@@ -82,6 +105,8 @@ static constexpr auto SYNC_STATE_DB("sync_state");
 //! Read receipts per room/event.
 static constexpr auto READ_RECEIPTS_DB("read_receipts");
 static constexpr auto NOTIFICATIONS_DB("sent_notifications");
+//! Queued updates of RoomInfo::approximate_last_modification_ts in CacheDb::pendingValues.
+static constexpr auto LAST_MESSAGE_TS_TABLE("last_message_ts");
 static constexpr auto PRESENCE_DB("presence");
 
 //! Encryption related databases.
@@ -91,14 +116,98 @@ static constexpr auto ENCRYPTED_ROOMS_DB("encrypted_rooms");
 //! Expiration progress for each room
 static constexpr auto EVENT_EXPIRATION_BG_JOB_DB("event_expiration_bg_job");
 
-//! room_id -> pickled OlmInboundGroupSession
+//! room number + session_id -> pickled OlmInboundGroupSession, see RoomTable.
 static constexpr auto INBOUND_MEGOLM_SESSIONS_DB("inbound_megolm_sessions");
 //! MegolmSessionIndex -> pickled OlmOutboundGroupSession
 static constexpr auto OUTBOUND_MEGOLM_SESSIONS_DB("outbound_megolm_sessions");
-//! MegolmSessionIndex -> session data about which devices have access to this
+//! room number + session_id -> session data about which devices have access to this
 static constexpr auto MEGOLM_SESSIONS_DATA_DB("megolm_sessions_data_db");
 //! Curve25519 key to session_id and json encoded olm session, separated by null. Dupsorted.
 static constexpr auto OLM_SESSIONS_DB("olm_sessions.v3");
+//! sha256 of signing key, signature and signed object -> nothing, for every valid signature of
+//! the keys in user_key, that was checked.
+static constexpr auto VERIFIED_SIGNATURES_DB("verified_signatures");
+
+//! room_id, space_id or the default key -> RetentionPolicy
+static constexpr auto RETENTION_POLICIES_DB("retention_policies");
+
+//! Tables shared by all rooms, see RoomTable.
+
+//! room_id -> 4 byte big endian number of the room, which prefixes its keys in the shared tables.
+static constexpr auto ROOM_NUMBERS_DB("room_numbers");
+//! room number + event_id -> order in event_order
+static constexpr auto EVENT_TO_ORDER_DB("event2order");
+//! room number + event_id -> order in order2msg
+static constexpr auto MESSAGE_TO_ORDER_DB("msg2order");
+//! room number + event_id -> ids of the events relating to it. Dupsorted.
+static constexpr auto RELATIONS_DB("related");
+//! room number + event_id -> json encoded event
+static constexpr auto ROOM_EVENTS_DB("room_events");
+//! room number + event type -> json encoded state event with an empty state key
+static constexpr auto ROOM_STATES_DB("room_state");
+//! room number + event type -> json encoded account data event of the room
+static constexpr auto ROOM_ACCOUNT_DATA_DB("room_account_data");
+//! room number + event type -> json encoded stripped state event of an invite
+static constexpr auto INVITE_STATES_DB("invite_state");
+//! Stands in for the room of the global account data in the room numbers.
+static constexpr std::string_view GLOBAL_ACCOUNT_DATA_ROOM("global");
+
+//! Number of members kept in the in memory member indexes of all rooms combined.
+static constexpr qsizetype MAX_INDEXED_MEMBERS = 250'000;
+
+//! Number of unpickled inbound megolm sessions kept in memory.
+static constexpr qsizetype MAX_CACHED_INBOUND_SESSIONS = 256;
+
+//! How long to collect users, before their keys are queried, so that bursts of out of date users
+//! end up in a few requests.
+static constexpr int KEY_QUERY_DELAY_MS = 200;
+//! Maximum number of users in one /keys/query request.
+static constexpr std::size_t KEY_QUERY_BATCH_SIZE = 100;
+
+//! Number of session keys exported or imported per transaction, which bounds how long the
+//! transaction is kept open and how often progress is reported.
+static constexpr std::size_t SESSION_KEYS_PER_CHUNK = 1000;
+
+//! Minimum number of users, whose verification status is calculated on each thread.
+static constexpr std::size_t VERIFICATIONS_PER_THREAD = 64;
+
+//! Number of resolved display names and avatars kept in memory for all rooms combined.
+static constexpr std::size_t MAX_RESOLVED_MEMBERS = 100'000;
+
+//! Databases, which can't be restored by syncing again. When switching to a compacted copy of the
+//! database, these are taken from the live database instead of the copy.
+static constexpr std::array LOCAL_ONLY_DBS{
+  INBOUND_MEGOLM_SESSIONS_DB,
+  OUTBOUND_MEGOLM_SESSIONS_DB,
+  MEGOLM_SESSIONS_DATA_DB,
+  OLM_SESSIONS_DB,
+  "verified",
+  "user_key",
+  // set with /retention
+  RETENTION_POLICIES_DB,
+  // the megolm sessions are keyed by room number
+  ROOM_NUMBERS_DB,
+};
+
+//! Tables shared by all rooms, which are copied room by room while compacting the database.
+static constexpr std::array ROOM_TABLES{
+  EVENT_TO_ORDER_DB,
+  MESSAGE_TO_ORDER_DB,
+  RELATIONS_DB,
+  ROOM_EVENTS_DB,
+  ROOM_STATES_DB,
+  ROOM_ACCOUNT_DATA_DB,
+  INVITE_STATES_DB,
+};
+
+//! Number of events deleted per write transaction by the retention policies.
+static constexpr std::size_t RETENTION_BATCH_SIZE = 500;
+
+//! How often a batch of queued writes is tried to commit, before it is dropped.
+static constexpr int WRITE_ATTEMPTS = 3;
+
+//! Number of entries copied per write transaction while compacting the database.
+static constexpr std::size_t COMPACTION_CHUNK_SIZE = 10'000;
 
 //! flag to be set, when the db should be compacted on startup
 bool needsCompact = false;
@@ -106,6 +215,47 @@ bool needsCompact = false;
 using CachedReceipts = std::multimap<uint64_t, std::string, std::greater<uint64_t>>;
 using Receipts       = std::map<std::string, std::map<std::string, uint64_t>>;
 
+static bool
+isDisplaynameSafe(const std::string &s)
+{
+    const auto str = QString::fromStdString(s);
+
+    for (QChar c : str) {
+        if (c.isPrint() && !c.isSpace())
+            return false;
+    }
+
+    return true;
+}
+
+//! Display name and avatar of a room member, as shown in the UI.
+struct ResolvedMember
+{
+    std::string name;
+    QString qName;
+    QString avatarUrl;
+
+    ResolvedMember(const std::string &user_id, const MemberInfo *info)
+      : name(info && !isDisplaynameSafe(info->name) ? info->name : user_id)
+      , qName(QString::fromStdString(name))
+      , avatarUrl(info ? QString::fromStdString(info->avatar_url) : QString())
+    {
+    }
+};
+
+//! A membership change stored in a write transaction. The member indexes and the room trust are
+//! only updated after the transaction committed, so that nobody sees changes, which might still be
+//! rolled back, and trust calculated from the old members is invalidated after they changed.
+struct MemberChange
+{
+    std::string room_id;
+    std::string user_id;
+    //! empty, if the user left
+    std::optional<MemberInfo> info;
+};
+//! The member changes of the write transaction of this thread.
+thread_local std::vector<MemberChange> pendingMemberChanges;
+
 struct CacheDb
 {
     lmdb::env env_ = nullptr;
@@ -121,13 +271,696 @@ struct CacheDb
     lmdb::dbi outboundMegolmSessions;
     lmdb::dbi megolmSessionsData;
     lmdb::dbi olmSessions;
+    lmdb::dbi verifiedSignatures;
 
     lmdb::dbi encryptedRooms_;
 
     lmdb::dbi eventExpiryBgJob_;
+    lmdb::dbi retentionPolicies;
+
+    lmdb::dbi roomNumbers;
+    lmdb::dbi eventToOrder;
+    lmdb::dbi messageToOrder;
+    lmdb::dbi relations;
+    lmdb::dbi events;
+    lmdb::dbi states;
+    lmdb::dbi accountData;
+    lmdb::dbi inviteStates;
+
+    //! An unpickled inbound megolm session. Decrypting advances the ratchet of the session, so
+    //! it needs to be locked while in use.
+    struct CachedInboundSession
+    {
+        std::mutex mtx;
+        mtx::crypto::InboundGroupSessionPtr session;
+    };
+    //! LRU of unpickled inbound megolm sessions, see inboundSessionCacheKey.
+    QCache<QByteArray, std::shared_ptr<CachedInboundSession>> inboundSessionCache{
+      MAX_CACHED_INBOUND_SESSIONS};
+    //! incremented, whenever a session is stored or evicted, see withInboundMegolmSession
+    uint64_t inboundSessionGeneration = 0;
+    std::mutex inboundSessionCacheMtx;
+
+    //! Room id and session id separated by a null byte. Unlike the key in the db, this doesn't
+    //! need a transaction to look up the number of the room.
+    static QByteArray inboundSessionCacheKey(const MegolmSessionIndex &index)
+    {
+        QByteArray key;
+        key.reserve(static_cast<qsizetype>(index.room_id.size() + 1 + index.session_id.size()));
+        key.append(index.room_id.data(), static_cast<qsizetype>(index.room_id.size()));
+        key.append('\0');
+        key.append(index.session_id.data(), static_cast<qsizetype>(index.session_id.size()));
+        return key;
+    }
+    void cacheInboundSession(const MegolmSessionIndex &index,
+                             mtx::crypto::InboundGroupSessionPtr session)
+    {
+        auto entry     = std::make_shared<CachedInboundSession>();
+        entry->session = std::move(session);
+
+        std::lock_guard lock(inboundSessionCacheMtx);
+        inboundSessionCache.insert(inboundSessionCacheKey(index),
+                                   new std::shared_ptr<CachedInboundSession>(std::move(entry)));
+        inboundSessionGeneration++;
+    }
+    void evictInboundSession(const MegolmSessionIndex &index)
+    {
+        std::lock_guard lock(inboundSessionCacheMtx);
+        inboundSessionCache.remove(inboundSessionCacheKey(index));
+        inboundSessionGeneration++;
+    }
+
+    //! In memory copy of verifiedSignatures, loaded on first use.
+    std::unordered_set<std::string> knownSignatures;
+    bool knownSignaturesLoaded = false;
+    std::mutex knownSignaturesMtx;
+
+    void loadKnownSignatures(lmdb::txn &txn)
+    {
+        std::lock_guard lock(knownSignaturesMtx);
+        if (knownSignaturesLoaded)
+            return;
+
+        auto cursor = lmdb::cursor::open(txn, verifiedSignatures);
+        std::string_view hash, val;
+        while (cursor.get(hash, val, MDB_NEXT))
+            knownSignatures.emplace(hash);
+        knownSignaturesLoaded = true;
+    }
+
+    //! Member indexes of recently used rooms, the cost is the member count of the room.
+    QCache<InternedId, std::shared_ptr<MemberIndex>> memberIndexes{MAX_INDEXED_MEMBERS};
+    //! Incremented before committed member changes are applied, so that an index built from an
+    //! older snapshot isn't cached.
+    uint64_t memberIndexGeneration = 0;
+    std::mutex memberIndexesMtx;
+
+    //! The member index of a room, if it is loaded.
+    std::shared_ptr<MemberIndex> loadedMemberIndex(const std::string &room_id)
+    {
+        std::lock_guard lock(memberIndexesMtx);
+        if (auto cached = memberIndexes.object(InternedId(room_id)))
+            return *cached;
+        return nullptr;
+    }
+    //! Apply a membership change to the member index of a room, if it is loaded.
+    void updateMemberIndex(const std::string &room_id,
+                           const std::string &user_id,
+                           const MemberInfo *info)
+    {
+        auto index = loadedMemberIndex(room_id);
+        if (!index)
+            return;
+
+        if (info)
+            index->upsert(user_id, *info);
+        else
+            index->remove(user_id);
+    }
+    void dropMemberIndexes()
+    {
+        std::lock_guard lock(memberIndexesMtx);
+        memberIndexGeneration++;
+        memberIndexes.clear();
+    }
+    //! Remember a member change of the write transaction of this thread.
+    void queueMemberChange(const std::string &room_id,
+                           const std::string &user_id,
+                           const MemberInfo *info)
+    {
+        pendingMemberChanges.push_back(
+          {room_id, user_id, info ? std::optional(*info) : std::nullopt});
+    }
+    //! Apply the member changes of the transaction, which this thread just committed.
+    void applyMemberChanges()
+    {
+        auto changes = std::exchange(pendingMemberChanges, {});
+        if (changes.empty())
+            return;
+
+        {
+            std::lock_guard lock(memberIndexesMtx);
+            memberIndexGeneration++;
+        }
+        for (const auto &change : changes) {
+            updateMemberIndex(
+              change.room_id, change.user_id, change.info ? &*change.info : nullptr);
+            invalidateTrust(change.room_id, change.user_id);
+        }
+    }
+    //! Forget the member changes of a transaction, which wasn't committed.
+    void discardMemberChanges() { pendingMemberChanges.clear(); }
+
+    //! room_id -> user_id -> resolved member, for the members looked up recently, and their
+    //! position in resolvedMembersLru. Member events overwrite the entries when they are stored, so
+    //! they are never stale.
+    std::unordered_map<
+      std::string,
+      std::unordered_map<std::string,
+                         std::pair<ResolvedMember,
+                                   std::list<std::pair<std::string, std::string>>::iterator>>>
+      resolvedMembers;
+    //! (room_id, user_id) of the resolved members, most recently used first
+    std::list<std::pair<std::string, std::string>> resolvedMembersLru;
+    //! incremented when entries are dropped, see storeResolvedMember
+    uint64_t resolvedMembersGeneration = 0;
+    std::mutex resolvedMembersMtx;
+
+    std::optional<ResolvedMember>
+    cachedResolvedMember(const std::string &room_id, const std::string &user_id, uint64_t &gen)
+    {
+        std::lock_guard lock(resolvedMembersMtx);
+        gen = resolvedMembersGeneration;
+        if (auto room = resolvedMembers.find(room_id); room != resolvedMembers.end()) {
+            if (auto member = room->second.find(user_id); member != room->second.end()) {
+                resolvedMembersLru.splice(
+                  resolvedMembersLru.begin(), resolvedMembersLru, member->second.second);
+                return member->second.first;
+            }
+        }
+        return std::nullopt;
+    }
+    //! Store a member resolved from the members db. This doesn't replace existing entries and is
+    //! skipped if entries were dropped since gen, as a member event may have been stored while the
+    //! old state was read. Evicts the least recently used member, when the cache is full.
+    void storeResolvedMember(const std::string &room_id,
+                             const std::string &user_id,
+                             ResolvedMember member,
+                             uint64_t gen)
+    {
+        std::lock_guard lock(resolvedMembersMtx);
+        if (gen != resolvedMembersGeneration)
+            return;
+
+        auto [entry, inserted] = resolvedMembers[room_id].try_emplace(
+          user_id, std::move(member), resolvedMembersLru.end());
+        if (!inserted)
+            return;
+        resolvedMembersLru.emplace_front(room_id, user_id);
+        entry->second.second = resolvedMembersLru.begin();
+
+        if (resolvedMembersLru.size() > MAX_RESOLVED_MEMBERS) {
+            const auto &[oldRoom, oldUser] = resolvedMembersLru.back();
+            auto room                      = resolvedMembers.find(oldRoom);
+            room->second.erase(oldUser);
+            if (room->second.empty())
+                resolvedMembers.erase(room);
+            resolvedMembersLru.pop_back();
+        }
+    }
+    //! Apply a member event to the resolved members. Only members, which are already cached, are
+    //! updated. Otherwise a lookup, which may have read the old member, is kept from storing it.
+    void updateResolvedMember(const std::string &room_id,
+                              const std::string &user_id,
+                              const MemberInfo *info)
+    {
+        std::lock_guard lock(resolvedMembersMtx);
+        if (auto room = resolvedMembers.find(room_id); room != resolvedMembers.end()) {
+            if (auto member = room->second.find(user_id); member != room->second.end()) {
+                member->second.first = ResolvedMember(user_id, info);
+                return;
+            }
+        }
+        resolvedMembersGeneration++;
+    }
+    void dropResolvedMembers(const std::string &room_id)
+    {
+        std::lock_guard lock(resolvedMembersMtx);
+        if (auto room = resolvedMembers.find(room_id); room != resolvedMembers.end()) {
+            for (const auto &member : room->second)
+                resolvedMembersLru.erase(member.second.second);
+            resolvedMembers.erase(room);
+        }
+        resolvedMembersGeneration++;
+    }
+    void dropResolvedMembers()
+    {
+        std::lock_guard lock(resolvedMembersMtx);
+        resolvedMembers.clear();
+        resolvedMembersLru.clear();
+        resolvedMembersGeneration++;
+    }
+
+    //! Trust level of the members of a room. It is kept up to date, so that the shield of a room
+    //! doesn't need to look at every member each time.
+    struct RoomTrust
+    {
+        //! member -> trust it contributes to the room
+        std::unordered_map<std::string, crypto::Trust> members;
+        //! number of members per trust level
+        std::array<std::size_t, 4> counts{};
+        //! members, whose trust needs to be calculated again
+        std::unordered_set<std::string> dirty;
+
+        void add(const std::string &user_id, crypto::Trust trust)
+        {
+            remove(user_id);
+            members.emplace(user_id, trust);
+            counts[trust]++;
+        }
+        void remove(const std::string &user_id)
+        {
+            if (auto it = members.find(user_id); it != members.end()) {
+                counts[it->second]--;
+                members.erase(it);
+            }
+        }
+        crypto::Trust trust() const
+        {
+            if (counts[crypto::Unverified])
+                return crypto::Unverified;
+            if (counts[crypto::TOFU])
+                return crypto::TOFU;
+            return crypto::Verified;
+        }
+    };
+    std::unordered_map<std::string, RoomTrust> roomTrust;
+    //! Incremented, whenever the verification status of a user or the members of a room change,
+    //! so that calculations racing with that don't store outdated results.
+    uint64_t userTrustGeneration = 0;
+    std::unordered_map<std::string, uint64_t> roomTrustGenerations;
+    std::mutex roomTrustMtx;
+
+    //! The verification status of a user changed.
+    void invalidateTrust(const std::string &user_id)
+    {
+        std::lock_guard lock(roomTrustMtx);
+        userTrustGeneration++;
+        for (auto &[room_id, trust] : roomTrust) {
+            if (trust.members.count(user_id)) {
+                trust.remove(user_id);
+                trust.dirty.insert(user_id);
+            }
+        }
+    }
+    //! The membership of a user in a room changed.
+    void invalidateTrust(const std::string &room_id, const std::string &user_id)
+    {
+        std::lock_guard lock(roomTrustMtx);
+        roomTrustGenerations[room_id]++;
+        if (auto it = roomTrust.find(room_id); it != roomTrust.end()) {
+            it->second.remove(user_id);
+            it->second.dirty.insert(user_id);
+        }
+    }
+    void dropRoomTrust(const std::string &room_id)
+    {
+        std::lock_guard lock(roomTrustMtx);
+        roomTrustGenerations[room_id]++;
+        roomTrust.erase(room_id);
+    }
+    void dropRoomTrust()
+    {
+        std::lock_guard lock(roomTrustMtx);
+        userTrustGeneration++;
+        roomTrust.clear();
+    }
+    //! Changes, which invalidate calculations for the room.
+    std::pair<uint64_t, uint64_t> trustGeneration(const std::string &room_id)
+    {
+        auto room = roomTrustGenerations.find(room_id);
+        return {userTrustGeneration, room != roomTrustGenerations.end() ? room->second : 0};
+    }
+
+    using KeyQueryCallback = Cache::KeyQueryCallback;
+    //! Users, whose keys will be queried in the next batch, and the sync token to query them for.
+    std::map<std::string, std::pair<std::string, std::vector<KeyQueryCallback>>> queuedKeyQueries;
+    //! Users, whose keys are currently being queried, and who waits for them.
+    std::map<std::string, std::pair<std::string, std::vector<KeyQueryCallback>>> runningKeyQueries;
+    bool keyQueryScheduled = false;
+    std::mutex keyQueriesMtx;
+
+    //! Last read status emitted for each joined room, so that only changes need to be emitted.
+    std::unordered_map<std::string, bool> readStatus;
+    std::mutex readStatusMtx;
+
+    std::atomic_bool retentionRunning{false};
+    //! what the retention policies deleted since startup
+    RetentionStats retentionTotals;
+    std::mutex retentionTotalsMtx;
+
+    //! Thread writing a compacted copy of the database.
+    std::thread compaction;
+    std::atomic_bool compactionRunning{false};
+    std::atomic_bool cancelCompaction{false};
+
+    void stopCompaction()
+    {
+        cancelCompaction = true;
+        if (compaction.joinable())
+            compaction.join();
+        cancelCompaction = false;
+    }
+
+    //! Small writes, that callers don't need to wait for. They are committed together in one
+    //! transaction on the writer thread, so that they don't each wait for the write lock, which
+    //! is held by the sync for long stretches.
+    std::thread writer;
+    std::mutex pendingWritesMtx;
+    std::condition_variable pendingWritesCv;
+    std::vector<std::function<void(lmdb::txn &)>> pendingWrites;
+    bool stoppingWriter = false;
+    //! Writes are finished, when they are committed or dropped after failing repeatedly.
+    uint64_t queuedWrites = 0, finishedWrites = 0;
+    std::atomic<uint64_t> committedWrites{0}, failedWrites{0};
+    std::atomic<uint64_t> writeBatches{0};
+    //! time the writer thread spent waiting for the write lock
+    std::atomic<uint64_t> writeLockWaitUs{0};
+
+    //! What a queued write stores under key in table, or nothing for a delete. table is only a
+    //! name to tell the values apart, usually the name of the database.
+    struct PendingValue
+    {
+        std::string table;
+        std::string key;
+        std::optional<std::string> value;
+    };
+    //! The values of the queued writes, that aren't finished yet, and the number of the write,
+    //! that stored them. Readers look here first, so they see their own writes without waiting
+    //! for the writer thread.
+    std::map<std::pair<std::string, std::string>, std::pair<uint64_t, std::optional<std::string>>>
+      pendingValues;
+
+    void queueWrite(std::function<void(lmdb::txn &)> write,
+                    std::optional<PendingValue> pending = std::nullopt)
+    {
+        {
+            std::lock_guard lock(pendingWritesMtx);
+            pendingWrites.push_back(std::move(write));
+            ++queuedWrites;
+            if (pending)
+                pendingValues[{std::move(pending->table), std::move(pending->key)}] = {
+                  queuedWrites, std::move(pending->value)};
+            if (!writer.joinable())
+                writer = std::thread([this] { writeLoop(); });
+        }
+        pendingWritesCv.notify_all();
+    }
+    //! Returns true, if a write of key in table is queued, and sets value to what it stores.
+    bool pendingValue(std::string table, std::string key, std::optional<std::string> &value)
+    {
+        std::lock_guard lock(pendingWritesMtx);
+        auto it = pendingValues.find({std::move(table), std::move(key)});
+        if (it == pendingValues.end())
+            return false;
+        value = it->second.second;
+        return true;
+    }
+    //! Apply a queued update of the last message timestamp to the stored info of a room. The sync
+    //! may have stored a newer one in the meantime, so the newest one wins.
+    void applyPendingTimestamp(const std::string &room_id, RoomInfo &info)
+    {
+        std::optional<std::string> ts;
+        if (pendingValue(LAST_MESSAGE_TS_TABLE, room_id, ts) && ts)
+            info.approximate_last_modification_ts =
+              std::max(info.approximate_last_modification_ts, std::stoull(*ts));
+    }
+    //! Commit the remaining writes and stop the writer thread.
+    void stopWriter()
+    {
+        {
+            std::lock_guard lock(pendingWritesMtx);
+            stoppingWriter = true;
+        }
+        pendingWritesCv.notify_all();
+        if (writer.joinable())
+            writer.join();
+        stoppingWriter = false;
+    }
+    void writeLoop()
+    {
+        std::unique_lock lock(pendingWritesMtx);
+        while (true) {
+            pendingWritesCv.wait(lock, [this] { return stoppingWriter || !pendingWrites.empty(); });
+            if (pendingWrites.empty())
+                return;
+
+            auto batch = std::move(pendingWrites);
+            pendingWrites.clear();
+            lock.unlock();
+
+            bool committed = false;
+            for (int attempt = 1; !committed && attempt <= WRITE_ATTEMPTS; attempt++) {
+                try {
+                    auto start = std::chrono::steady_clock::now();
+                    auto txn   = lmdb::txn::begin(env_);
+                    uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(
+                                        std::chrono::steady_clock::now() - start)
+                                        .count();
+                    writeLockWaitUs += waited;
+                    if (waited > 500'000)
+                        nhlog::db()->debug("Queued writes waited {}ms for the write lock",
+                                           waited / 1000);
+
+                    for (auto &write : batch) {
+                        try {
+                            write(txn);
+                        } catch (const nlohmann::json::exception &e) {
+                            nhlog::db()->warn("Failed to prepare queued write: {}", e.what());
+                        }
+                    }
+                    txn.commit();
+                    committed = true;
+                } catch (const lmdb::error &e) {
+                    nhlog::db()->warn("Failed to commit {} queued writes (attempt {}): {}",
+                                      batch.size(),
+                                      attempt,
+                                      e.what());
+                    if (attempt < WRITE_ATTEMPTS)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100 * attempt));
+                }
+            }
+            if (committed) {
+                ++writeBatches;
+                committedWrites += batch.size();
+            } else {
+                nhlog::db()->error("Dropped {} queued writes, which failed {} times.",
+                                   batch.size(),
+                                   WRITE_ATTEMPTS);
+                failedWrites += batch.size();
+            }
+
+            lock.lock();
+            finishedWrites += batch.size();
+            std::erase_if(pendingValues,
+                          [this](const auto &e) { return e.second.first <= finishedWrites; });
+            pendingWritesCv.notify_all();
+        }
+    }
+
+    ~CacheDb()
+    {
+        stopCompaction();
+        stopWriter();
+    }
+};
+
+Cache::~Cache() noexcept
+{
+    // the compaction uses the cache directory
+    db->stopCompaction();
+}
+
+//! The entries of one room in a table shared by all rooms. Keys are prefixed with the number of the
+//! room, so that rooms don't need their own named databases. Rooms get a number, when something is
+//! first stored for them, so reading a room without one just finds nothing. Only the integer keyed
+//! timeline orders, the pending messages, the states_key db with its own comparator and the member
+//! dbs, whose size is the member count, are still named databases of the room.
+class RoomTable
+{
+public:
+    RoomTable() = default;
+    RoomTable(CacheDb &db, lmdb::dbi &table, lmdb::txn &txn, std::string_view room_id)
+      : db_(&db)
+      , table_(&table)
+      , room_id_(room_id)
+    {
+        lookupNumber(txn);
+    }
+
+    bool get(lmdb::txn &txn, std::string_view key, std::string_view &val)
+    {
+        return lookupNumber(txn) && table_->get(txn, this->key(key), val);
+    }
+    bool put(lmdb::txn &txn, std::string_view key, std::string_view val)
+    {
+        reserve(txn);
+        return table_->put(txn, this->key(key), val);
+    }
+    bool del(lmdb::txn &txn, std::string_view key)
+    {
+        return lookupNumber(txn) && table_->del(txn, this->key(key));
+    }
+    bool del(lmdb::txn &txn, std::string_view key, std::string_view val)
+    {
+        return lookupNumber(txn) && table_->del(txn, this->key(key), val);
+    }
+
+    //! Delete all entries of the room.
+    void drop(lmdb::txn &txn)
+    {
+        if (!lookupNumber(txn))
+            return;
+
+        std::vector<std::string> keys;
+        {
+            auto cursor          = lmdb::cursor::open(txn, *table_);
+            std::string_view key = prefix_, val;
+            bool found           = cursor.get(key, val, MDB_SET_RANGE);
+            while (found && key.starts_with(prefix_)) {
+                keys.emplace_back(key);
+                found = cursor.get(key, val, MDB_NEXT_NODUP);
+            }
+        }
+
+        for (const auto &key : keys)
+            table_->del(txn, key);
+    }
+
+    //! Calls f with the key within the room and the value of every entry of the room.
+    template<typename F>
+    void forEach(lmdb::txn &txn, F &&f)
+    {
+        if (!lookupNumber(txn))
+            return;
+
+        auto cursor          = lmdb::cursor::open(txn, *table_);
+        std::string_view key = prefix_, val;
+        bool found           = cursor.get(key, val, MDB_SET_RANGE);
+        while (found && key.starts_with(prefix_)) {
+            f(key.substr(prefix_.size()), val);
+            found = cursor.get(key, val, MDB_NEXT);
+        }
+    }
+
+    //! Assign a number to the room, if it has none yet, so that key() can be used for writes.
+    void reserve(lmdb::txn &txn)
+    {
+        if (!lookupNumber(txn))
+            assignNumber(txn);
+    }
+    //! Whether anything was ever stored for this room.
+    bool exists() const { return !prefix_.empty(); }
+    //! The key used in the shared table.
+    std::string key(std::string_view key) const
+    {
+        std::string ret;
+        ret.reserve(prefix_.size() + key.size());
+        ret.append(prefix_);
+        ret.append(key);
+        return ret;
+    }
+    lmdb::dbi &table() { return *table_; }
+
+    //! Splits a key of a shared table into the number of the room and the key within the room.
+    static std::pair<std::string_view, std::string_view> splitKey(std::string_view key)
+    {
+        if (key.size() < NumberSize)
+            return {};
+        return {key.substr(0, NumberSize), key.substr(NumberSize)};
+    }
+
+private:
+    static constexpr std::size_t NumberSize = 4;
+
+    //! The number may have been assigned through another RoomTable in the same transaction.
+    bool lookupNumber(lmdb::txn &txn)
+    {
+        std::string_view number;
+        if (prefix_.empty() && db_->roomNumbers.get(txn, room_id_, number))
+            prefix_ = number;
+        return !prefix_.empty();
+    }
+    void assignNumber(lmdb::txn &txn)
+    {
+        uint32_t next = 0;
+        std::string_view nextVal;
+        if (db_->syncState.get(txn, NEXT_ROOM_NUMBER_KEY, nextVal))
+            next = lmdb::from_sv<uint32_t>(nextVal);
+        db_->syncState.put(txn, NEXT_ROOM_NUMBER_KEY, lmdb::to_sv(next + 1));
+
+        // big endian, so that the keys of newer rooms are appended at the end of the tables
+        prefix_ = {static_cast<char>(next >> 24),
+                   static_cast<char>(next >> 16),
+                   static_cast<char>(next >> 8),
+                   static_cast<char>(next)};
+        db_->roomNumbers.put(txn, room_id_, prefix_);
+    }
+
+    CacheDb *db_      = nullptr;
+    lmdb::dbi *table_ = nullptr;
+    std::string room_id_;
+    std::string prefix_;
 };
 
-Cache::~Cache() noexcept = default;
+//! Value of the event_order db. It is stored as a fixed size header (format marker, flags, index
+//! in order2msg and length of the event id) followed by the event id and the pagination token, so
+//! that walking the timeline needs neither json parsing nor a lookup in msg2order to find out, if
+//! an event is visible.
+struct OrderEntry
+{
+    std::string event_id;
+    //! token to paginate to the events before this one
+    std::optional<std::string> prev_batch;
+    //! index in order2msg, if the event is visible
+    std::optional<uint64_t> msgIndex;
+    //! false for entries in the old json format, which don't store if the event is visible
+    bool knowsVisibility = true;
+
+    std::string serialize() const
+    {
+        const uint8_t flags = (msgIndex ? Visible : 0) | (prev_batch ? HasPrevBatch : 0);
+        const uint64_t index  = msgIndex.value_or(0);
+        const uint16_t idSize = static_cast<uint16_t>(event_id.size());
+
+        std::string data;
+        data.reserve(HeaderSize + event_id.size() + (prev_batch ? prev_batch->size() : 0));
+        data.push_back(static_cast<char>(Format));
+        data.push_back(static_cast<char>(flags));
+        data.append(lmdb::to_sv(index));
+        data.append(lmdb::to_sv(idSize));
+        data.append(event_id);
+        if (prev_batch)
+            data.append(*prev_batch);
+        return data;
+    }
+
+    static OrderEntry parse(std::string_view data)
+    {
+        OrderEntry entry;
+        if (data.size() >= HeaderSize && static_cast<uint8_t>(data[0]) == Format) {
+            const auto flags  = static_cast<uint8_t>(data[1]);
+            const auto index  = lmdb::from_sv<uint64_t>(data.substr(2, sizeof(uint64_t)));
+            const auto idSize = std::min<std::size_t>(
+              lmdb::from_sv<uint16_t>(data.substr(10, sizeof(uint16_t))), data.size() - HeaderSize);
+
+            entry.event_id = data.substr(HeaderSize, idSize);
+            if (flags & HasPrevBatch)
+                entry.prev_batch = data.substr(HeaderSize + idSize);
+            if (flags & Visible)
+                entry.msgIndex = index;
+            return entry;
+        }
+
+        entry.knowsVisibility = false;
+        try {
+            auto obj       = nlohmann::json::parse(data);
+            entry.event_id = obj.value("event_id", "");
+            if (obj.contains("prev_batch"))
+                entry.prev_batch = obj["prev_batch"].get<std::string>();
+        } catch (const nlohmann::json::exception &) {
+            // workaround bug in the initial db format, where we sometimes didn't store json...
+            entry.event_id = data;
+        }
+        return entry;
+    }
+
+private:
+    static constexpr uint8_t Format        = 0xff; // never the first byte of the json entries
+    static constexpr uint8_t Visible       = 1 << 0;
+    static constexpr uint8_t HasPrevBatch  = 1 << 1;
+    static constexpr std::size_t HeaderSize = 2 + sizeof(uint64_t) + sizeof(uint16_t);
+};
 
 static std::string
 combineOlmSessionKeyFromCurveAndSessionId(std::string_view curve25519, std::string_view session_id)
@@ -148,22 +981,43 @@ namespace {
 std::unique_ptr<Cache> instance_ = nullptr;
 }
 
+namespace {
+//! The read transaction of this thread. It is renewed for every read, unless a cache::ReadSnapshot
+//! is alive, in which case all reads share it until the snapshot ends.
+thread_local lmdb::txn readTxn = nullptr;
+//! Number of cache::ReadSnapshots alive on this thread.
+thread_local int snapshotDepth = 0;
+//! If the read transaction of this thread is kept open for the current snapshot.
+thread_local bool snapshotActive = false;
+}
+
 struct RO_txn
 {
-    ~RO_txn() { txn.reset(); }
+    ~RO_txn()
+    {
+        if (!snapshot)
+            txn.reset();
+    }
     operator MDB_txn *() const noexcept { return txn.handle(); }
     operator lmdb::txn &() noexcept { return txn; }
 
     lmdb::txn &txn;
+    //! the transaction belongs to a snapshot and is released at its end
+    bool snapshot = false;
 };
 
 RO_txn
 ro_txn(lmdb::env &env)
 {
-    thread_local lmdb::txn txn     = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+    auto &txn                      = readTxn;
     thread_local int reuse_counter = 0;
 
-    if (reuse_counter >= 100 || txn.env() != env.handle()) {
+    if (!txn.handle()) {
+        txn           = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+        reuse_counter = 0;
+    } else if (snapshotActive && txn.env() == env.handle()) {
+        return RO_txn{txn, true};
+    } else if (reuse_counter >= 100 || txn.env() != env.handle()) {
         txn.abort();
         txn           = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
         reuse_counter = 0;
@@ -178,13 +1032,14 @@ ro_txn(lmdb::env &env)
     }
     reuse_counter++;
 
-    return RO_txn{txn};
+    snapshotActive = snapshotDepth > 0;
+    return RO_txn{txn, snapshotActive};
 }
 
-lmdb::dbi
+RoomTable
 Cache::getEventsDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(txn, std::string(room_id + "/events").c_str(), MDB_CREATE);
+    return RoomTable(*db, db->events, txn, room_id);
 }
 
 lmdb::dbi
@@ -195,16 +1050,16 @@ Cache::getEventOrderDb(lmdb::txn &txn, const std::string &room_id)
 }
 
 // inverse of EventOrderDb
-lmdb::dbi
+RoomTable
 Cache::getEventToOrderDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(txn, std::string(room_id + "/event2order").c_str(), MDB_CREATE);
+    return RoomTable(*db, db->eventToOrder, txn, room_id);
 }
 
-lmdb::dbi
+RoomTable
 Cache::getMessageToOrderDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(txn, std::string(room_id + "/msg2order").c_str(), MDB_CREATE);
+    return RoomTable(*db, db->messageToOrder, txn, room_id);
 }
 
 lmdb::dbi
@@ -221,17 +1076,28 @@ Cache::getPendingMessagesDb(lmdb::txn &txn, const std::string &room_id)
       txn, std::string(room_id + "/pending").c_str(), MDB_CREATE | MDB_INTEGERKEY);
 }
 
-lmdb::dbi
+RoomTable
 Cache::getRelationsDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(
-      txn, std::string(room_id + "/related").c_str(), MDB_CREATE | MDB_DUPSORT);
+    return RoomTable(*db, db->relations, txn, room_id);
 }
 
-lmdb::dbi
+std::optional<std::string>
+Cache::megolmSessionKey(lmdb::txn &txn, const MegolmSessionIndex &index, bool create)
+{
+    // the inbound session and session data dbs use the same keys
+    RoomTable table(*db, db->inboundMegolmSessions, txn, index.room_id);
+    if (create)
+        table.reserve(txn);
+    else if (!table.exists())
+        return std::nullopt;
+    return table.key(index.session_id);
+}
+
+RoomTable
 Cache::getInviteStatesDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(txn, std::string(room_id + "/invite_state").c_str(), MDB_CREATE);
+    return RoomTable(*db, db->inviteStates, txn, room_id);
 }
 
 lmdb::dbi
@@ -240,10 +1106,10 @@ Cache::getInviteMembersDb(lmdb::txn &txn, const std::string &room_id)
     return lmdb::dbi::open(txn, std::string(room_id + "/invite_members").c_str(), MDB_CREATE);
 }
 
-lmdb::dbi
+RoomTable
 Cache::getStatesDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(txn, std::string(room_id + "/state").c_str(), MDB_CREATE);
+    return RoomTable(*db, db->states, txn, room_id);
 }
 
 static int
@@ -270,10 +1136,12 @@ Cache::getStatesKeyDb(lmdb::txn &txn, const std::string &room_id)
     return db_;
 }
 
-lmdb::dbi
+RoomTable
 Cache::getAccountDataDb(lmdb::txn &txn, const std::string &room_id)
 {
-    return lmdb::dbi::open(txn, std::string(room_id + "/account_data").c_str(), MDB_CREATE);
+    // the global account data is stored like the one of a room
+    return RoomTable(
+      *db, db->accountData, txn, room_id.empty() ? GLOBAL_ACCOUNT_DATA_ROOM : room_id);
 }
 
 lmdb::dbi
@@ -314,47 +1182,282 @@ Cache::removeLeftRooms(lmdb::txn &txn, const std::map<std::string, mtx::response
     }
 }
 
-static void
-compactDatabase(lmdb::env &from, lmdb::env &to)
+static lmdb::env
+openEnv(const QString &name)
 {
-    auto fromTxn = lmdb::txn::begin(from, nullptr, MDB_RDONLY);
-    auto toTxn   = lmdb::txn::begin(to);
+    auto settings      = UserSettings::instance();
+    std::size_t dbSize = std::max(
+      settings->qsettings()->value(MAX_DB_SIZE_SETTINGS_KEY, DB_SIZE_DEFAULT).toULongLong(),
+      DB_SIZE_DEFAULT);
+    unsigned dbCount =
+      std::max(settings->qsettings()->value(MAX_DBS_SETTINGS_KEY, MAX_DBS_DEFAULT).toUInt(),
+               MAX_DBS_DEFAULT);
+
+    // ignore unreasonably high values of more than a quarter of the addressable memory
+    if (dbSize > (1ull << (Q_PROCESSOR_WORDSIZE * 8 - 2))) {
+        dbSize = DB_SIZE_DEFAULT;
+    }
+    // Limit databases to about a million. This would cause more than 7-120MB to get written on
+    // every commit, which I doubt would work well. File an issue, if you tested this and it
+    // works fine.
+    if (dbCount > (1u << 20)) {
+        dbCount = 1u << 20;
+    }
+
+    auto e = lmdb::env::create();
+    e.set_mapsize(dbSize);
+    e.set_max_dbs(dbCount);
+    e.open(name.toStdString().c_str(), MDB_NOMETASYNC | MDB_NOSYNC);
+    return e;
+}
+
+static unsigned
+compactionFlags(std::string_view dbName)
+{
+    unsigned flags = 0;
+    if (dbName.ends_with("/event_order") || dbName.ends_with("/order2msg") ||
+        dbName.ends_with("/pending"))
+        flags |= MDB_INTEGERKEY;
+    if (dbName.ends_with("/related") || dbName.ends_with("/states_key") ||
+        dbName == RELATIONS_DB || dbName == SPACES_CHILDREN_DB || dbName == SPACES_PARENTS_DB)
+        flags |= MDB_DUPSORT;
+    return flags;
+}
+
+//! Copies the entries of dbName starting with prefix from fromTxn to toTxn, beginning at the key
+//! from. Stops after about COMPACTION_CHUNK_SIZE entries, but only between two keys, so that
+//! duplicates are copied together, and returns the key to continue at.
+static std::optional<std::string>
+copyEntries(lmdb::txn &fromTxn,
+            lmdb::txn &toTxn,
+            const std::string &dbName,
+            std::string_view prefix,
+            std::string_view from,
+            std::size_t &copied)
+{
+    auto flags = compactionFlags(dbName);
+    lmdb::dbi fromDb;
+    try {
+        fromDb = lmdb::dbi::open(fromTxn, dbName.c_str(), flags);
+    } catch (const lmdb::not_found_error &) {
+        // deleted since the compaction started
+        return std::nullopt;
+    }
+    auto toDb = lmdb::dbi::open(toTxn, dbName.c_str(), flags | MDB_CREATE);
+
+    if (dbName.ends_with("/states_key")) {
+        lmdb::dbi_set_dupsort(fromTxn, fromDb, compare_state_key);
+        lmdb::dbi_set_dupsort(toTxn, toDb, compare_state_key);
+    }
+
+    auto fromCursor = lmdb::cursor::open(fromTxn, fromDb);
+    auto toCursor   = lmdb::cursor::open(toTxn, toDb);
+
+    std::string_view key = from, val, lastKey;
+    bool found           = from.empty() ? fromCursor.get(key, val, MDB_cursor_op::MDB_FIRST)
+                                        : fromCursor.get(key, val, MDB_cursor_op::MDB_SET_RANGE);
+    for (std::size_t count = 0; found && key.starts_with(prefix); count++) {
+        if (count >= COMPACTION_CHUNK_SIZE && key != lastKey)
+            return std::string(key);
+
+        // Appending fails for entries not in order, i.e. rooms, which got their number during
+        // the compaction, or entries already copied by the previous chunk.
+        if (!toCursor.put(key, val, MDB_APPENDDUP))
+            toCursor.put(key, val);
+        copied++;
+
+        lastKey = key;
+        found   = fromCursor.get(key, val, MDB_cursor_op::MDB_NEXT);
+    }
+    return std::nullopt;
+}
+
+//! Copies the databases of from into the empty environment to, while from is still in use. Read
+//! transactions are only kept open for one room or for the databases not belonging to a room, so
+//! that the live database doesn't grow by keeping old pages alive for the whole copy. Each room is
+//! copied in one read transaction together with its entries in the shared tables, and the other
+//! databases are copied together in one more, so that each part is consistent in itself. Syncing
+//! again from the position at the start of the compaction brings the parts up to date. The copy is
+//! committed in chunks of COMPACTION_CHUNK_SIZE entries, reported to progress, and can be
+//! cancelled in between. Returns false, if it was cancelled.
+static bool
+compactDatabase(lmdb::env &from,
+                lmdb::env &to,
+                const std::atomic_bool &cancel,
+                const std::function<void(std::size_t copied, std::size_t total)> &progress)
+{
+    struct RoomDbs
+    {
+        std::string number;
+        std::string room_id;
+        std::vector<std::string> dbNames;
+    };
+    std::vector<RoomDbs> rooms;
+    std::vector<std::string> dbNames;
+    std::optional<std::string> startToken;
+    std::size_t total = 0;
+    {
+        auto txn = lmdb::txn::begin(from, nullptr, MDB_RDONLY);
+
+        std::string_view token;
+        if (lmdb::dbi::open(txn, SYNC_STATE_DB).get(txn, NEXT_BATCH_KEY, token))
+            startToken = std::string(token);
 
-    auto rootDb  = lmdb::dbi::open(fromTxn);
-    auto dbNames = lmdb::cursor::open(fromTxn, rootDb);
+        std::map<std::string, std::vector<std::string>, std::less<>> roomDbNames;
+        auto rootDb   = lmdb::dbi::open(txn);
+        auto dbCursor = lmdb::cursor::open(txn, rootDb);
+        std::string_view dbName;
+        while (dbCursor.get(dbName, MDB_cursor_op::MDB_NEXT_NODUP)) {
+            std::string name(dbName);
+            total += lmdb::dbi::open(txn, name.c_str(), compactionFlags(name)).size(txn);
 
-    std::string_view dbName;
-    while (dbNames.get(dbName, MDB_cursor_op::MDB_NEXT_NODUP)) {
-        nhlog::db()->info("Compacting db: {}", dbName);
+            if (auto sep = name.rfind('/'); name.starts_with('!') && sep != std::string::npos)
+                roomDbNames[name.substr(0, sep)].push_back(std::move(name));
+            else if (std::find(ROOM_TABLES.begin(), ROOM_TABLES.end(), name) == ROOM_TABLES.end())
+                dbNames.push_back(std::move(name));
+        }
+        dbCursor.close();
 
-        auto flags = MDB_CREATE;
+        // rooms may only have entries in the shared tables
+        auto roomNumbers = lmdb::dbi::open(txn, ROOM_NUMBERS_DB, MDB_CREATE);
+        {
+            auto numberCursor = lmdb::cursor::open(txn, roomNumbers);
+            std::string_view room_id, unused;
+            while (numberCursor.get(room_id, unused, MDB_NEXT))
+                roomDbNames.try_emplace(std::string(room_id));
+        }
+        for (auto &[room_id, names] : roomDbNames) {
+            std::string_view number;
+            roomNumbers.get(txn, room_id, number);
+            rooms.push_back({std::string(number), room_id, std::move(names)});
+        }
+        txn.commit();
+    }
 
-        if (dbName.ends_with("/event_order") || dbName.ends_with("/order2msg") ||
-            dbName.ends_with("/pending"))
-            flags |= MDB_INTEGERKEY;
-        if (dbName.ends_with("/related") || dbName.ends_with("/states_key") ||
-            dbName == SPACES_CHILDREN_DB || dbName == SPACES_PARENTS_DB)
-            flags |= MDB_DUPSORT;
+    // In the order of the shared tables, so that their entries can be appended. Rooms without a
+    // number yet come last, as they get the highest numbers.
+    std::sort(rooms.begin(), rooms.end(), [](const RoomDbs &a, const RoomDbs &b) {
+        if (a.number.empty() != b.number.empty())
+            return b.number.empty();
+        return a.number < b.number;
+    });
+
+    std::size_t copied = 0;
+    auto toTxn         = lmdb::txn::begin(to);
+    auto nextChunk     = [&]() {
+        toTxn.commit();
+        nhlog::db()->debug("Compacted {} of {} entries", copied, total);
+        progress(copied, total);
+        if (cancel)
+            return false;
+        toTxn = lmdb::txn::begin(to);
+        return true;
+    };
+
+    for (const auto &room : rooms) {
+        auto fromTxn  = lmdb::txn::begin(from, nullptr, MDB_RDONLY);
+        auto copyRoom = [&](const std::string &dbName, std::string_view prefix) {
+            std::string next(prefix);
+            while (auto resume = copyEntries(fromTxn, toTxn, dbName, prefix, next, copied)) {
+                if (!nextChunk())
+                    return false;
+                next = std::move(*resume);
+            }
+            return true;
+        };
+
+        for (const auto &dbName : room.dbNames)
+            if (!copyRoom(dbName, {}))
+                return false;
 
-        auto dbNameStr = std::string(dbName);
-        auto fromDb    = lmdb::dbi::open(fromTxn, dbNameStr.c_str(), flags);
-        auto toDb      = lmdb::dbi::open(toTxn, dbNameStr.c_str(), flags);
+        std::string_view number;
+        if (lmdb::dbi::open(fromTxn, ROOM_NUMBERS_DB).get(fromTxn, room.room_id, number)) {
+            std::string prefix(number);
+            for (const auto tableName : ROOM_TABLES)
+                if (!copyRoom(tableName, prefix))
+                    return false;
+        }
+        // commit instead of abort, so the dbis opened by the copy stay valid
+        fromTxn.commit();
+    }
 
-        if (dbName.ends_with("/states_key")) {
-            lmdb::dbi_set_dupsort(fromTxn, fromDb, compare_state_key);
-            lmdb::dbi_set_dupsort(toTxn, toDb, compare_state_key);
+    {
+        auto fromTxn = lmdb::txn::begin(from, nullptr, MDB_RDONLY);
+        for (const auto &dbName : dbNames) {
+            nhlog::db()->info("Compacting db: {}", dbName);
+
+            std::string next;
+            while (auto resume = copyEntries(fromTxn, toTxn, dbName, {}, next, copied)) {
+                if (!nextChunk()) {
+                    fromTxn.commit();
+                    return false;
+                }
+                next = std::move(*resume);
+            }
         }
+        // commit instead of abort, so the dbis opened by the copy stay valid
+        fromTxn.commit();
+    }
 
-        auto fromCursor = lmdb::cursor::open(fromTxn, fromDb);
-        auto toCursor   = lmdb::cursor::open(toTxn, toDb);
+    // The other databases may already contain later syncs, but syncing those again only repeats
+    // what is already stored.
+    auto syncState = lmdb::dbi::open(toTxn, SYNC_STATE_DB, MDB_CREATE);
+    if (startToken)
+        syncState.put(toTxn, NEXT_BATCH_KEY, *startToken);
+    else
+        syncState.del(toTxn, NEXT_BATCH_KEY);
+    toTxn.commit();
+    nhlog::db()->info("Compacted {} entries", copied);
+    progress(copied, total);
+    return true;
+}
 
+//! Prepares a finished compacted copy to replace the live database. The next sync continues from
+//! the position at the start of the compaction. Only what syncing can't bring back is taken from
+//! the live database: the crypto sessions, verification state and everything in the sync state
+//! apart from the sync position. Returns false, if the copy is incomplete.
+static bool
+finishCompaction(lmdb::env &live, lmdb::env &compacted)
+{
+    auto liveTxn = lmdb::txn::begin(live, nullptr, MDB_RDONLY);
+    auto toTxn   = lmdb::txn::begin(compacted);
+
+    auto syncState = lmdb::dbi::open(toTxn, SYNC_STATE_DB, MDB_CREATE);
+    std::string_view unused;
+    if (!syncState.get(toTxn, COMPACTION_FINISHED_KEY, unused))
+        return false;
+
+    for (const auto dbName : LOCAL_ONLY_DBS) {
+        auto toDb = lmdb::dbi::open(toTxn, dbName, MDB_CREATE);
+        toDb.drop(toTxn, false);
+
+        lmdb::dbi fromDb;
+        try {
+            fromDb = lmdb::dbi::open(liveTxn, dbName);
+        } catch (const lmdb::not_found_error &) {
+            continue;
+        }
+
+        auto cursor = lmdb::cursor::open(liveTxn, fromDb);
         std::string_view key, val;
-        while (fromCursor.get(key, val, MDB_cursor_op::MDB_NEXT)) {
-            toCursor.put(key, val, MDB_APPENDDUP);
+        while (cursor.get(key, val, MDB_NEXT))
+            toDb.put(toTxn, key, val, MDB_APPEND);
+    }
+
+    {
+        auto liveSyncState = lmdb::dbi::open(liveTxn, SYNC_STATE_DB);
+        auto cursor        = lmdb::cursor::open(liveTxn, liveSyncState);
+        std::string_view key, val;
+        while (cursor.get(key, val, MDB_NEXT)) {
+            if (key != NEXT_BATCH_KEY)
+                syncState.put(toTxn, key, val);
         }
     }
+    syncState.del(toTxn, COMPACTION_FINISHED_KEY);
 
     toTxn.commit();
+    liveTxn.commit();
+    return true;
 }
 
 bool
@@ -433,6 +1536,18 @@ Cache::Cache(const QString &userId, QObject *parent)
           }
       },
       Qt::QueuedConnection);
+    // queued, so that migrations run before the copy starts
+    connect(
+      this,
+      &Cache::databaseReady,
+      this,
+      [this] {
+          if (needsCompact) {
+              needsCompact = false;
+              compactInBackground();
+          }
+      },
+      Qt::QueuedConnection);
     setup();
 }
 
@@ -496,33 +1611,6 @@ Cache::setup()
         }
     }
 
-    auto openEnv = [](const QString &name) {
-        auto settings      = UserSettings::instance();
-        std::size_t dbSize = std::max(
-          settings->qsettings()->value(MAX_DB_SIZE_SETTINGS_KEY, DB_SIZE_DEFAULT).toULongLong(),
-          DB_SIZE_DEFAULT);
-        unsigned dbCount =
-          std::max(settings->qsettings()->value(MAX_DBS_SETTINGS_KEY, MAX_DBS_DEFAULT).toUInt(),
-                   MAX_DBS_DEFAULT);
-
-        // ignore unreasonably high values of more than a quarter of the addressable memory
-        if (dbSize > (1ull << (Q_PROCESSOR_WORDSIZE * 8 - 2))) {
-            dbSize = DB_SIZE_DEFAULT;
-        }
-        // Limit databases to about a million. This would cause more than 7-120MB to get written on
-        // every commit, which I doubt would work well. File an issue, if you tested this and it
-        // works fine.
-        if (dbCount > (1u << 20)) {
-            dbCount = 1u << 20;
-        }
-
-        auto e = lmdb::env::create();
-        e.set_mapsize(dbSize);
-        e.set_max_dbs(dbCount);
-        e.open(name.toStdString().c_str(), MDB_NOMETASYNC | MDB_NOSYNC);
-        return e;
-    };
-
     if (isInitial) {
         nhlog::db()->info("initializing LMDB");
 
@@ -546,37 +1634,39 @@ Cache::setup()
         // https://github.com/Nheko-Reborn/nheko/issues/1303
         db->env_ = openEnv(cacheDirectory_);
 
-        if (needsCompact) {
-            auto compactDir  = cacheDirectory_ + "-compacting";
-            auto toDeleteDir = cacheDirectory_ + "-olddb";
-            if (QFile::exists(cacheDirectory_))
-                QDir(compactDir).removeRecursively();
-            if (QFile::exists(toDeleteDir))
-                QDir(toDeleteDir).removeRecursively();
-            if (!QDir().mkpath(compactDir)) {
-                nhlog::db()->warn(
-                  "Failed to create directory '{}' for database compaction, skipping compaction!",
-                  compactDir.toStdString());
-            } else {
-                // lmdb::env_copy(db->env_, compactDir.toStdString().c_str(), MDB_CP_COMPACT);
-
-                // create a temporary db
-                auto temp = openEnv(compactDir);
+        // switch to the compacted copy written in the background during the last session
+        auto compactDir = cacheDirectory_ + "-compacting";
+        if (QFile::exists(compactDir)) {
+            bool finished = false;
+            try {
+                auto compacted = openEnv(compactDir);
+                finished       = finishCompaction(db->env_, compacted);
+                compacted.close();
+            } catch (const lmdb::error &e) {
+                nhlog::db()->warn("Failed to finish database compaction: {}", e.what());
+            }
 
-                // copy data
-                compactDatabase(db->env_, temp);
+            if (finished) {
+                auto toDeleteDir = cacheDirectory_ + "-olddb";
+                auto oldSize     = QFileInfo(cacheDirectory_ + "/data.mdb").size();
 
-                // close envs
-                temp.close();
                 db->env_.close();
 
                 // swap the databases and delete old one
+                if (QFile::exists(toDeleteDir))
+                    QDir(toDeleteDir).removeRecursively();
                 QDir().rename(cacheDirectory_, toDeleteDir);
                 QDir().rename(compactDir, cacheDirectory_);
                 QDir(toDeleteDir).removeRecursively();
 
                 // reopen env
                 db->env_ = openEnv(cacheDirectory_);
+
+                nhlog::db()->info("Switched to compacted database, reclaimed {} bytes.",
+                                  oldSize - QFileInfo(cacheDirectory_ + "/data.mdb").size());
+            } else {
+                nhlog::db()->info("Removing incomplete compacted database.");
+                QDir(compactDir).removeRecursively();
             }
         }
     } catch (const lmdb::error &e) {
@@ -611,11 +1701,23 @@ Cache::setup()
     db->outboundMegolmSessions = lmdb::dbi::open(txn, OUTBOUND_MEGOLM_SESSIONS_DB, MDB_CREATE);
     db->megolmSessionsData     = lmdb::dbi::open(txn, MEGOLM_SESSIONS_DATA_DB, MDB_CREATE);
 
-    db->olmSessions = lmdb::dbi::open(txn, OLM_SESSIONS_DB, MDB_CREATE);
+    db->olmSessions        = lmdb::dbi::open(txn, OLM_SESSIONS_DB, MDB_CREATE);
+    db->verifiedSignatures = lmdb::dbi::open(txn, VERIFIED_SIGNATURES_DB, MDB_CREATE);
 
     // What rooms are encrypted
     db->encryptedRooms_   = lmdb::dbi::open(txn, ENCRYPTED_ROOMS_DB, MDB_CREATE);
     db->eventExpiryBgJob_ = lmdb::dbi::open(txn, EVENT_EXPIRATION_BG_JOB_DB, MDB_CREATE);
+    db->retentionPolicies = lmdb::dbi::open(txn, RETENTION_POLICIES_DB, MDB_CREATE);
+
+    // Shared per room tables
+    db->roomNumbers    = lmdb::dbi::open(txn, ROOM_NUMBERS_DB, MDB_CREATE);
+    db->eventToOrder   = lmdb::dbi::open(txn, EVENT_TO_ORDER_DB, MDB_CREATE);
+    db->messageToOrder = lmdb::dbi::open(txn, MESSAGE_TO_ORDER_DB, MDB_CREATE);
+    db->relations      = lmdb::dbi::open(txn, RELATIONS_DB, MDB_CREATE | MDB_DUPSORT);
+    db->events         = lmdb::dbi::open(txn, ROOM_EVENTS_DB, MDB_CREATE);
+    db->states         = lmdb::dbi::open(txn, ROOM_STATES_DB, MDB_CREATE);
+    db->accountData    = lmdb::dbi::open(txn, ROOM_ACCOUNT_DATA_DB, MDB_CREATE);
+    db->inviteStates   = lmdb::dbi::open(txn, INVITE_STATES_DB, MDB_CREATE);
 
     [[maybe_unused]] auto verificationDb = getVerificationDb(txn);
     [[maybe_unused]] auto userKeysDb     = getUserKeysDb(txn);
@@ -630,6 +1732,73 @@ Cache::setup()
       true);
 }
 
+void
+Cache::compactInBackground()
+{
+    if (db->compactionRunning)
+        return;
+    if (db->compaction.joinable())
+        db->compaction.join();
+
+    auto compactDir = cacheDirectory_ + "-compacting";
+    QDir(compactDir).removeRecursively();
+    if (!QDir().mkpath(compactDir)) {
+        nhlog::db()->warn(
+          "Failed to create directory '{}' for database compaction, skipping compaction!",
+          compactDir.toStdString());
+        return;
+    }
+
+    lmdb::env target = nullptr;
+    try {
+        target = openEnv(compactDir);
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("Failed to create database for compaction: {}", e.what());
+        return;
+    }
+
+    nhlog::db()->info("Compacting database in the background.");
+    db->compactionRunning = true;
+    db->compaction        = std::thread(
+      [this, target = std::move(target), compactDir, liveDir = cacheDirectory_]() mutable {
+          bool finished = false;
+          try {
+              auto progress = [this](std::size_t copied, std::size_t total) {
+                  emit compactionProgress(copied, total);
+              };
+              finished = compactDatabase(db->env_, target, db->cancelCompaction, progress);
+
+              if (finished) {
+                  target.sync(true);
+                  auto txn       = lmdb::txn::begin(target);
+                  auto syncState = lmdb::dbi::open(txn, SYNC_STATE_DB, MDB_CREATE);
+                  syncState.put(txn, COMPACTION_FINISHED_KEY, "1");
+                  txn.commit();
+                  target.sync(true);
+              }
+          } catch (const lmdb::error &e) {
+              nhlog::db()->error("Failed to compact database: {}", e.what());
+              finished = false;
+          }
+          target.close();
+
+          if (finished) {
+              auto reclaimed = QFileInfo(liveDir + "/data.mdb").size() -
+                               QFileInfo(compactDir + "/data.mdb").size();
+              nhlog::db()->info(
+                "Database compaction finished, reclaiming about {} bytes on the next start.",
+                reclaimed);
+              emit compactionFinished(reclaimed);
+          } else {
+              QDir(compactDir).removeRecursively();
+              // the cache may be shutting down, when it was cancelled
+              if (!db->cancelCompaction)
+                  emit compactionFinished(-1);
+          }
+          db->compactionRunning = false;
+      });
+}
+
 static void
 fatalSecretError()
 {
@@ -882,9 +2051,10 @@ Cache::storeEventExpirationProgress(const std::string &room,
     j["s"] = expirationSettings;
     j["m"] = stopMarker;
 
-    auto txn = lmdb::txn::begin(db->env_);
-    db->eventExpiryBgJob_.put(txn, room, j.dump());
-    txn.commit();
+    auto value = j.dump();
+    db->queueWrite(
+      [this, room, value](lmdb::txn &txn) { db->eventExpiryBgJob_.put(txn, room, value); },
+      CacheDb::PendingValue{EVENT_EXPIRATION_BG_JOB_DB, room, value});
 }
 
 std::string
@@ -893,9 +2063,15 @@ Cache::loadEventExpirationProgress(const std::string &room, const std::string &e
 {
     try {
         auto txn = ro_txn(db->env_);
+        std::optional<std::string> pending;
         std::string_view data;
-        if (!db->eventExpiryBgJob_.get(txn, room, data))
+        if (db->pendingValue(EVENT_EXPIRATION_BG_JOB_DB, room, pending)) {
+            if (!pending)
+                return "";
+            data = *pending;
+        } else if (!db->eventExpiryBgJob_.get(txn, room, data)) {
             return "";
+        }
 
         auto j = nlohmann::json::parse(data);
         if (j.value("s", "") == expirationSettings)
@@ -954,135 +2130,221 @@ Cache::roomEncryptionSettings(const std::string &room_id)
     return std::nullopt;
 }
 
-mtx::crypto::ExportedSessionKeys
-Cache::exportSessionKeys()
+std::optional<mtx::crypto::ExportedSessionKeys>
+Cache::exportSessionKeys(const SessionKeysProgress &progress)
 {
     using namespace mtx::crypto;
 
     ExportedSessionKeys keys;
 
-    auto txn    = ro_txn(db->env_);
-    auto cursor = lmdb::cursor::open(txn, db->inboundMegolmSessions);
+    std::size_t total = 0;
+    {
+        auto txn = ro_txn(db->env_);
+        total    = db->inboundMegolmSessions.size(txn);
+    }
+    keys.sessions.reserve(total);
 
-    std::string_view key, value;
-    while (cursor.get(key, value, MDB_NEXT)) {
-        ExportedSession exported;
-        MegolmSessionIndex index;
+    // room number -> room_id
+    std::map<std::string, std::string, std::less<>> rooms;
+    {
+        auto txn    = ro_txn(db->env_);
+        auto cursor = lmdb::cursor::open(txn, db->roomNumbers);
+        std::string_view room_id, number;
+        while (cursor.get(room_id, number, MDB_NEXT))
+            rooms.emplace(number, room_id);
+    }
 
-        auto saved_session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+    // Every chunk uses its own read transaction, so that the export doesn't pin old pages of the
+    // database for minutes.
+    std::string lastKey;
+    bool done = false;
+    while (!done) {
+        auto txn    = ro_txn(db->env_);
+        auto cursor = lmdb::cursor::open(txn, db->inboundMegolmSessions);
+
+        std::string_view key = lastKey, value;
+        bool found           = lastKey.empty() ? cursor.get(key, value, MDB_FIRST)
+                                               : cursor.get(key, value, MDB_SET_RANGE);
+        if (found && !lastKey.empty() && key == lastKey)
+            found = cursor.get(key, value, MDB_NEXT);
+
+        std::size_t chunk = 0;
+        for (; found && chunk < SESSION_KEYS_PER_CHUNK;
+             found = cursor.get(key, value, MDB_NEXT), chunk++) {
+            lastKey = key;
+
+            ExportedSession exported;
+
+            auto [number, session_id] = RoomTable::splitKey(key);
+            auto room                 = rooms.find(number);
+            if (room == rooms.end()) {
+                nhlog::db()->critical("failed to export megolm session {}: unknown room",
+                                      session_id);
+                continue;
+            }
 
-        try {
-            index = nlohmann::json::parse(key).get<MegolmSessionIndex>();
-        } catch (const nlohmann::json::exception &e) {
-            nhlog::db()->critical("failed to export megolm session: {}", e.what());
-            continue;
-        }
+            try {
+                std::string_view v;
+                if (db->megolmSessionsData.get(txn, key, v)) {
+                    auto data           = nlohmann::json::parse(v).get<GroupSessionData>();
+                    exported.sender_key = data.sender_key;
+                    if (!data.sender_claimed_ed25519_key.empty())
+                        exported.sender_claimed_keys["ed25519"] = data.sender_claimed_ed25519_key;
+                    exported.forwarding_curve25519_key_chain = data.forwarding_curve25519_key_chain;
+                } else {
+                    continue;
+                }
 
-        try {
-            using namespace mtx::crypto;
-
-            std::string_view v;
-            if (db->megolmSessionsData.get(txn, nlohmann::json(index).dump(), v)) {
-                auto data           = nlohmann::json::parse(v).get<GroupSessionData>();
-                exported.sender_key = data.sender_key;
-                if (!data.sender_claimed_ed25519_key.empty())
-                    exported.sender_claimed_keys["ed25519"] = data.sender_claimed_ed25519_key;
-                exported.forwarding_curve25519_key_chain = data.forwarding_curve25519_key_chain;
-            } else {
+                auto saved_session =
+                  unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+                exported.session_key = export_session(saved_session.get(), -1);
+            } catch (std::exception &e) {
+                nhlog::db()->error("Failed to retrieve Megolm Session Data: {}", e.what());
                 continue;
             }
 
-        } catch (std::exception &e) {
-            nhlog::db()->error("Failed to retrieve Megolm Session Data: {}", e.what());
-            continue;
+            exported.room_id    = room->second;
+            exported.session_id = session_id;
+
+            keys.sessions.push_back(std::move(exported));
         }
 
-        exported.room_id     = index.room_id;
-        exported.session_id  = index.session_id;
-        exported.session_key = export_session(saved_session.get(), -1);
+        cursor.close();
+        done = !found;
 
-        keys.sessions.push_back(exported);
+        if (progress && !progress(keys.sessions.size(), total)) {
+            nhlog::crypto()->info("Export of session keys cancelled");
+            return std::nullopt;
+        }
     }
 
-    cursor.close();
-
     return keys;
 }
 
-void
-Cache::importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
+std::size_t
+Cache::importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                         const SessionKeysProgress &progress)
 {
-    std::size_t importCount = 0;
+    using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(db->env_);
-    for (const auto &s : keys.sessions) {
+    struct ImportedSession
+    {
         MegolmSessionIndex index;
-        index.room_id    = s.room_id;
-        index.session_id = s.session_id;
+        InboundGroupSessionPtr session;
+        GroupSessionData data;
+    };
 
-        GroupSessionData data{};
-        data.sender_key                      = s.sender_key;
-        data.forwarding_curve25519_key_chain = s.forwarding_curve25519_key_chain;
-        data.trusted                         = false;
+    std::size_t importCount = 0;
 
-        if (s.sender_claimed_keys.count("ed25519"))
-            data.sender_claimed_ed25519_key = s.sender_claimed_keys.at("ed25519");
+    for (std::size_t begin = 0; begin < keys.sessions.size(); begin += SESSION_KEYS_PER_CHUNK) {
+        const auto end = std::min(begin + SESSION_KEYS_PER_CHUNK, keys.sessions.size());
 
-        try {
-            auto exported_session = mtx::crypto::import_session(s.session_key);
+        // Importing the sessions is the expensive part, so it happens outside of the transaction.
+        std::vector<ImportedSession> chunk;
+        chunk.reserve(end - begin);
+        for (std::size_t i = begin; i < end; i++) {
+            const auto &s = keys.sessions[i];
 
-            using namespace mtx::crypto;
-            const auto key = nlohmann::json(index).dump();
-            const auto pickled =
-              pickle<InboundSessionObject>(exported_session.get(), pickle_secret_);
+            ImportedSession imported;
+            imported.index.room_id    = s.room_id;
+            imported.index.session_id = s.session_id;
 
-            std::string_view value;
-            if (db->inboundMegolmSessions.get(txn, key, value)) {
-                auto oldSession =
-                  unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
-                if (olm_inbound_group_session_first_known_index(exported_session.get()) >=
-                    olm_inbound_group_session_first_known_index(oldSession.get())) {
-                    nhlog::crypto()->warn(
-                      "Not storing inbound session with newer or equal first known index");
-                    continue;
+            imported.data.sender_key                      = s.sender_key;
+            imported.data.forwarding_curve25519_key_chain = s.forwarding_curve25519_key_chain;
+            imported.data.trusted                         = false;
+
+            if (s.sender_claimed_keys.count("ed25519"))
+                imported.data.sender_claimed_ed25519_key = s.sender_claimed_keys.at("ed25519");
+
+            try {
+                imported.session = import_session(s.session_key);
+            } catch (const olm_exception &e) {
+                nhlog::crypto()->critical(
+                  "failed to import inbound megolm session {}: {}", s.session_id, e.what());
+                continue;
+            }
+
+            chunk.push_back(std::move(imported));
+        }
+
+        // room -> stored session ids
+        std::map<std::string, std::vector<std::string>> stored;
+        std::vector<MegolmSessionIndex> replaced;
+        auto txn = lmdb::txn::begin(db->env_);
+        for (auto &imported : chunk) {
+            try {
+                const auto key = *megolmSessionKey(txn, imported.index, true);
+
+                std::string_view value;
+                if (db->inboundMegolmSessions.get(txn, key, value)) {
+                    auto oldSession =
+                      unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+                    if (olm_inbound_group_session_first_known_index(imported.session.get()) >=
+                        olm_inbound_group_session_first_known_index(oldSession.get())) {
+                        nhlog::crypto()->warn(
+                          "Not storing inbound session with newer or equal first known index");
+                        continue;
+                    }
                 }
+
+                db->inboundMegolmSessions.put(
+                  txn, key, pickle<InboundSessionObject>(imported.session.get(), pickle_secret_));
+                db->megolmSessionsData.put(txn, key, nlohmann::json(imported.data).dump());
+                replaced.push_back(imported.index);
+
+                stored[imported.index.room_id].push_back(std::move(imported.index.session_id));
+                importCount++;
+            } catch (const olm_exception &e) {
+                nhlog::crypto()->critical("failed to import inbound megolm session {}: {}",
+                                          imported.index.session_id,
+                                          e.what());
+                continue;
+            } catch (const lmdb::error &e) {
+                nhlog::crypto()->critical("failed to save inbound megolm session {}: {}",
+                                          imported.index.session_id,
+                                          e.what());
+                continue;
             }
+        }
+        txn.commit();
 
-            db->inboundMegolmSessions.put(txn, key, pickled);
-            db->megolmSessionsData.put(txn, key, nlohmann::json(data).dump());
+        // only after the commit, so that nobody caches the old session again in the meantime
+        for (const auto &index : replaced)
+            db->evictInboundSession(index);
+
+        // may be called from a worker thread, the timelines retry decrypting on the ui thread
+        if (!stored.empty())
+            QMetaObject::invokeMethod(
+              ChatPage::instance(),
+              [stored = std::move(stored)] {
+                  for (const auto &[room_id, session_ids] : stored)
+                      ChatPage::instance()->receivedSessionKeys(room_id, session_ids);
+              },
+              Qt::QueuedConnection);
 
-            ChatPage::instance()->receivedSessionKey(index.room_id, index.session_id);
-            importCount++;
-        } catch (const mtx::crypto::olm_exception &e) {
-            nhlog::crypto()->critical(
-              "failed to import inbound megolm session {}: {}", index.session_id, e.what());
-            continue;
-        } catch (const lmdb::error &e) {
-            nhlog::crypto()->critical(
-              "failed to save inbound megolm session {}: {}", index.session_id, e.what());
-            continue;
+        if (progress && !progress(end, keys.sessions.size())) {
+            nhlog::crypto()->info("Import of session keys cancelled");
+            break;
         }
     }
-    txn.commit();
 
     nhlog::crypto()->info("Imported {} out of {} keys", importCount, keys.sessions.size());
+    return importCount;
 }
 
 //
 // Session Management
 //
 
-void
-Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
-                                mtx::crypto::InboundGroupSessionPtr session,
-                                const GroupSessionData &data)
+bool
+Cache::storeInboundMegolmSession(lmdb::txn &txn,
+                                 const std::string &key,
+                                 const mtx::crypto::InboundGroupSessionPtr &session,
+                                 const GroupSessionData &data)
 {
     using namespace mtx::crypto;
-    const auto key     = nlohmann::json(index).dump();
     const auto pickled = pickle<InboundSessionObject>(session.get(), pickle_secret_);
 
-    auto txn = lmdb::txn::begin(db->env_);
-
     std::string_view value;
     if (db->inboundMegolmSessions.get(txn, key, value)) {
         auto oldSession = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
@@ -1097,7 +2359,7 @@ Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
             if (oldData.trusted && newIndex >= oldIndex) {
                 nhlog::crypto()->warn(
                   "Not storing inbound session of lesser trust or bigger index.");
-                return;
+                return false;
             }
 
             oldData.trusted = data.trusted || oldData.trusted;
@@ -1108,14 +2370,123 @@ Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
             }
 
             db->megolmSessionsData.put(txn, key, nlohmann::json(oldData).dump());
-            txn.commit();
-            return;
+            return newIndex < oldIndex;
         }
     }
 
     db->inboundMegolmSessions.put(txn, key, pickled);
     db->megolmSessionsData.put(txn, key, nlohmann::json(data).dump());
+    return true;
+}
+
+void
+Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
+                                mtx::crypto::InboundGroupSessionPtr session,
+                                const GroupSessionData &data)
+{
+    auto txn   = lmdb::txn::begin(db->env_);
+    bool cache = storeInboundMegolmSession(txn, *megolmSessionKey(txn, index, true), session, data);
+    txn.commit();
+
+    if (cache)
+        db->cacheInboundSession(index, std::move(session));
+}
+
+void
+Cache::saveInboundMegolmSessions(
+  std::vector<std::tuple<MegolmSessionIndex, mtx::crypto::InboundGroupSessionPtr, GroupSessionData>>
+    sessions)
+{
+    std::vector<std::pair<MegolmSessionIndex, mtx::crypto::InboundGroupSessionPtr>> toCache;
+
+    auto txn = lmdb::txn::begin(db->env_);
+    for (auto &[index, session, data] : sessions) {
+        if (storeInboundMegolmSession(txn, *megolmSessionKey(txn, index, true), session, data))
+            toCache.emplace_back(std::move(index), std::move(session));
+    }
     txn.commit();
+
+    for (auto &[index, session] : toCache)
+        db->cacheInboundSession(index, std::move(session));
+}
+
+bool
+Cache::withInboundMegolmSession(
+  const MegolmSessionIndex &index,
+  const std::function<void(const mtx::crypto::InboundGroupSessionPtr &)> &fn)
+{
+    using namespace mtx::crypto;
+
+    const auto cacheKey = CacheDb::inboundSessionCacheKey(index);
+
+    std::shared_ptr<CacheDb::CachedInboundSession> entry;
+    uint64_t generation;
+    {
+        std::lock_guard lock(db->inboundSessionCacheMtx);
+        if (auto cached = db->inboundSessionCache.object(cacheKey))
+            entry = *cached;
+        generation = db->inboundSessionGeneration;
+    }
+    // a snapshot may have started before the generation was read
+    const bool fromSnapshot = snapshotActive;
+
+    if (!entry) {
+        auto txn = ro_txn(db->env_);
+        auto key = megolmSessionKey(txn, index);
+        std::string_view value;
+        if (!key || !db->inboundMegolmSessions.get(txn, *key, value))
+            return false;
+
+        auto session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+
+        entry          = std::make_shared<CacheDb::CachedInboundSession>();
+        entry->session = std::move(session);
+
+        std::lock_guard lock(db->inboundSessionCacheMtx);
+        // Someone else might have loaded it in the meantime, prefer their copy.
+        if (auto cached = db->inboundSessionCache.object(cacheKey))
+            entry = *cached;
+        // A session stored or evicted since then may be newer than the one we read.
+        else if (generation == db->inboundSessionGeneration && !fromSnapshot)
+            db->inboundSessionCache.insert(
+              cacheKey, new std::shared_ptr<CacheDb::CachedInboundSession>(entry));
+    }
+
+    std::lock_guard lock(entry->mtx);
+    fn(entry->session);
+    return true;
+}
+
+std::map<uint32_t, std::string>
+Cache::saveMegolmSessionIndices(const MegolmSessionIndex &index,
+                                const std::map<uint32_t, std::string> &indices)
+{
+    // Decrypting inside a cache::ReadSnapshot would open a write transaction on a thread, which
+    // keeps a read transaction open. Decrypt before the snapshot starts instead.
+    assert(!snapshotActive);
+
+    auto txn = lmdb::txn::begin(db->env_);
+    auto key = megolmSessionKey(txn, index);
+
+    std::string_view value;
+    if (!key || !db->megolmSessionsData.get(txn, *key, value))
+        return indices;
+
+    std::map<uint32_t, std::string> stored;
+    bool changed = false;
+
+    auto data = nlohmann::json::parse(value).get<GroupSessionData>();
+    for (const auto &[messageIndex, eventId] : indices) {
+        auto [it, inserted] = data.indices.try_emplace(messageIndex, eventId);
+        changed |= inserted;
+        stored.emplace(messageIndex, it->second);
+    }
+
+    if (changed) {
+        db->megolmSessionsData.put(txn, *key, nlohmann::json(data).dump());
+        txn.commit();
+    }
+    return stored;
 }
 
 mtx::crypto::InboundGroupSessionPtr
@@ -1124,11 +2495,11 @@ Cache::getInboundMegolmSession(const MegolmSessionIndex &index)
     using namespace mtx::crypto;
 
     try {
-        auto txn        = ro_txn(db->env_);
-        std::string key = nlohmann::json(index).dump();
+        auto txn = ro_txn(db->env_);
+        auto key = megolmSessionKey(txn, index);
         std::string_view value;
 
-        if (db->inboundMegolmSessions.get(txn, key, value)) {
+        if (key && db->inboundMegolmSessions.get(txn, *key, value)) {
             auto session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
             return session;
         }
@@ -1145,11 +2516,11 @@ Cache::inboundMegolmSessionExists(const MegolmSessionIndex &index)
     using namespace mtx::crypto;
 
     try {
-        auto txn        = ro_txn(db->env_);
-        std::string key = nlohmann::json(index).dump();
+        auto txn = ro_txn(db->env_);
+        auto key = megolmSessionKey(txn, index);
         std::string_view value;
 
-        return db->inboundMegolmSessions.get(txn, key, value);
+        return key && db->inboundMegolmSessions.get(txn, *key, value);
     } catch (std::exception &e) {
         nhlog::db()->error("Failed to get inbound megolm session {}", e.what());
     }
@@ -1179,7 +2550,8 @@ Cache::updateOutboundMegolmSession(const std::string &room_id,
 
     auto txn = lmdb::txn::begin(db->env_);
     db->outboundMegolmSessions.put(txn, room_id, j.dump());
-    db->megolmSessionsData.put(txn, nlohmann::json(index).dump(), nlohmann::json(data).dump());
+    db->megolmSessionsData.put(
+      txn, *megolmSessionKey(txn, index, true), nlohmann::json(data).dump());
     txn.commit();
 }
 
@@ -1218,7 +2590,8 @@ Cache::saveOutboundMegolmSession(const std::string &room_id,
 
     auto txn = lmdb::txn::begin(db->env_);
     db->outboundMegolmSessions.put(txn, room_id, j.dump());
-    db->megolmSessionsData.put(txn, nlohmann::json(index).dump(), nlohmann::json(data).dump());
+    db->megolmSessionsData.put(
+      txn, *megolmSessionKey(txn, index, true), nlohmann::json(data).dump());
     txn.commit();
 }
 
@@ -1254,7 +2627,8 @@ Cache::getOutboundMegolmSession(const std::string &room_id)
         index.room_id    = room_id;
         index.session_id = mtx::crypto::session_id(ref.session.get());
 
-        if (db->megolmSessionsData.get(txn, nlohmann::json(index).dump(), value)) {
+        if (auto key = megolmSessionKey(txn, index);
+            key && db->megolmSessionsData.get(txn, *key, value)) {
             ref.data = nlohmann::json::parse(value).get<GroupSessionData>();
         }
 
@@ -1273,8 +2647,9 @@ Cache::getMegolmSessionData(const MegolmSessionIndex &index)
 
         auto txn = ro_txn(db->env_);
 
+        auto key = megolmSessionKey(txn, index);
         std::string_view value;
-        if (db->megolmSessionsData.get(txn, nlohmann::json(index).dump(), value)) {
+        if (key && db->megolmSessionsData.get(txn, *key, value)) {
             return nlohmann::json::parse(value).get<GroupSessionData>();
         }
 
@@ -1456,6 +2831,29 @@ Cache::deleteBackupVersion()
     txn.commit();
 }
 
+void
+Cache::saveBackupRestoreProgress(const BackupRestoreProgress &progress)
+{
+    auto txn = lmdb::txn::begin(db->env_);
+    db->syncState.put(txn, BACKUP_RESTORE_PROGRESS_KEY, nlohmann::json(progress).dump());
+    txn.commit();
+}
+
+std::optional<BackupRestoreProgress>
+Cache::backupRestoreProgress()
+{
+    try {
+        auto txn = ro_txn(db->env_);
+        std::string_view v;
+        if (!db->syncState.get(txn, BACKUP_RESTORE_PROGRESS_KEY, v))
+            return std::nullopt;
+
+        return nlohmann::json::parse(v).get<BackupRestoreProgress>();
+    } catch (...) {
+        return std::nullopt;
+    }
+}
+
 std::optional<OnlineBackupVersion>
 Cache::backupVersion()
 {
@@ -1474,7 +2872,7 @@ void
 Cache::removeInvite(lmdb::txn &txn, const std::string &room_id)
 {
     db->invites.del(txn, room_id);
-    getInviteStatesDb(txn, room_id).drop(txn, true);
+    getInviteStatesDb(txn, room_id).drop(txn);
     getInviteMembersDb(txn, room_id).drop(txn, true);
 }
 
@@ -1490,9 +2888,15 @@ void
 Cache::removeRoom(lmdb::txn &txn, const std::string &roomid)
 {
     db->rooms.del(txn, roomid);
-    getStatesDb(txn, roomid).drop(txn, true);
-    getAccountDataDb(txn, roomid).drop(txn, true);
+    getStatesDb(txn, roomid).drop(txn);
+    getAccountDataDb(txn, roomid).drop(txn);
     getMembersDb(txn, roomid).drop(txn, true);
+    {
+        std::lock_guard lock(db->memberIndexesMtx);
+        db->memberIndexes.remove(InternedId(roomid));
+    }
+    db->dropResolvedMembers(roomid);
+    db->dropRoomTrust(roomid);
 }
 
 void
@@ -1545,6 +2949,8 @@ Cache::deleteData()
 {
     if (this->databaseReady_) {
         this->databaseReady_ = false;
+        db->stopCompaction();
+        db->stopWriter();
         // TODO: We need to remove the db->env_ while not accepting new requests.
         lmdb::dbi_close(db->env_, db->syncState);
         lmdb::dbi_close(db->env_, db->rooms);
@@ -1558,10 +2964,28 @@ Cache::deleteData()
 
         db->env_.close();
 
-        verification_storage.status.clear();
+        {
+            std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+            verification_storage.status.clear();
+            verification_storage.generation++;
+        }
+        {
+            std::lock_guard lock(db->inboundSessionCacheMtx);
+            db->inboundSessionCache.clear();
+            db->inboundSessionGeneration++;
+        }
+        {
+            std::lock_guard lock(db->knownSignaturesMtx);
+            db->knownSignatures.clear();
+            db->knownSignaturesLoaded = false;
+        }
+        db->dropMemberIndexes();
+        db->dropResolvedMembers();
+        db->dropRoomTrust();
 
         if (!cacheDirectory_.isEmpty()) {
             QDir(cacheDirectory_).removeRecursively();
+            QDir(cacheDirectory_ + "-compacting").removeRecursively();
             nhlog::db()->info("deleted cache files from disk");
         }
 
@@ -1963,6 +3387,151 @@ Cache::runMigrations()
            nhlog::db()->info("Successfully updated olm sessions database format.");
            return true;
        }},
+      {"2024.02.01",
+       [this]() {
+           // move the per room event2order, msg2order and related dbs into the shared tables
+           try {
+               auto txn      = lmdb::txn::begin(db->env_, nullptr);
+               auto room_ids = getRoomIds(txn);
+
+               auto migrate = [&txn](const std::string &dbName, RoomTable table, unsigned flags) {
+                   try {
+                       auto oldDb = lmdb::dbi::open(txn, dbName.c_str(), flags);
+                       {
+                           auto cursor = lmdb::cursor::open(txn, oldDb);
+                           std::string_view key, val;
+                           while (cursor.get(key, val, MDB_NEXT))
+                               table.put(txn, key, val);
+                       }
+                       oldDb.drop(txn, true);
+                   } catch (const lmdb::not_found_error &) {
+                       // room never stored anything in this db
+                   }
+               };
+
+               for (const auto &room_id : room_ids) {
+                   try {
+                       migrate(room_id + "/event2order", getEventToOrderDb(txn, room_id), 0);
+                       migrate(room_id + "/msg2order", getMessageToOrderDb(txn, room_id), 0);
+                       migrate(room_id + "/related", getRelationsDb(txn, room_id), MDB_DUPSORT);
+                   } catch (std::exception &e) {
+                       nhlog::db()->error("While migrating timeline dbs of {}, ignoring error {}",
+                                          room_id,
+                                          e.what());
+                   }
+               }
+               txn.commit();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical(
+                 "Failed to move timeline dbs to shared tables in migration! {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully moved timeline dbs to shared tables.");
+           return true;
+       }},
+      {"2024.03.10",
+       [this]() {
+           // key megolm sessions by room number and session id instead of a json object
+           try {
+               auto txn = lmdb::txn::begin(db->env_, nullptr);
+
+               auto migrate = [this, &txn](lmdb::dbi &sessionDb) {
+                   std::vector<std::pair<std::string, std::string>> oldEntries;
+                   {
+                       auto cursor = lmdb::cursor::open(txn, sessionDb);
+                       std::string_view key, value;
+                       while (cursor.get(key, value, MDB_NEXT))
+                           if (key.starts_with('{'))
+                               oldEntries.emplace_back(key, value);
+                   }
+
+                   for (const auto &[key, value] : oldEntries) {
+                       try {
+                           auto index = nlohmann::json::parse(key).get<MegolmSessionIndex>();
+                           sessionDb.put(txn, *megolmSessionKey(txn, index, true), value);
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn("Dropping megolm session with invalid key {}: {}",
+                                             key,
+                                             e.what());
+                       }
+                       sessionDb.del(txn, key);
+                   }
+                   return oldEntries.size();
+               };
+
+               auto sessions = migrate(db->inboundMegolmSessions);
+               migrate(db->megolmSessionsData);
+               txn.commit();
+
+               nhlog::db()->info("Successfully migrated keys of {} megolm sessions.", sessions);
+               return true;
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to migrate megolm session keys! {}", e.what());
+               return false;
+           }
+       }},
+      {"2024.04.01",
+       [this]() {
+           // move the per room events, state, account_data and invite_state dbs into the shared
+           // tables, including the ones of rooms, which were left since
+           try {
+               auto txn = lmdb::txn::begin(db->env_, nullptr);
+
+               std::vector<std::string> dbNames;
+               {
+                   auto cursor = lmdb::cursor::open(txn, lmdb::dbi::open(txn));
+                   std::string_view dbName, unused;
+                   while (cursor.get(dbName, unused, MDB_NEXT_NODUP))
+                       dbNames.emplace_back(dbName);
+               }
+
+               std::size_t migrated = 0;
+               for (const auto &dbName : dbNames) {
+                   auto sep = dbName.rfind('/');
+                   if (sep == std::string::npos)
+                       continue;
+
+                   // the global account data is stored as "/account_data"
+                   auto room_id = dbName.substr(0, sep);
+                   auto suffix  = std::string_view(dbName).substr(sep);
+                   RoomTable table;
+                   if (suffix == "/events")
+                       table = getEventsDb(txn, room_id);
+                   else if (suffix == "/state")
+                       table = getStatesDb(txn, room_id);
+                   else if (suffix == "/account_data")
+                       table = getAccountDataDb(txn, room_id);
+                   else if (suffix == "/invite_state")
+                       table = getInviteStatesDb(txn, room_id);
+                   else
+                       continue;
+
+                   try {
+                       auto oldDb = lmdb::dbi::open(txn, dbName.c_str());
+                       {
+                           auto cursor = lmdb::cursor::open(txn, oldDb);
+                           std::string_view key, val;
+                           while (cursor.get(key, val, MDB_NEXT))
+                               table.put(txn, key, val);
+                       }
+                       oldDb.drop(txn, true);
+                       migrated++;
+                   } catch (std::exception &e) {
+                       nhlog::db()->error(
+                         "While migrating {}, ignoring error {}", dbName, e.what());
+                   }
+               }
+               txn.commit();
+
+               nhlog::db()->info("Successfully moved {} room dbs to shared tables.", migrated);
+               return true;
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to move room dbs to shared tables in migration! {}",
+                                     e.what());
+               return false;
+           }
+       }},
     };
 
     nhlog::db()->info("Running migrations, this may take a while!");
@@ -2111,13 +3680,50 @@ Cache::calculateRoomReadStatus()
     const auto joined_rooms = joinedRooms();
 
     std::map<QString, bool> readStatus;
+    std::unordered_map<std::string, bool> cachedStatus;
+
+    for (const auto &room : joined_rooms) {
+        bool unread = calculateRoomReadStatus(room);
+        readStatus.emplace(QString::fromStdString(room), unread);
+        cachedStatus.emplace(room, unread);
+    }
 
-    for (const auto &room : joined_rooms)
-        readStatus.emplace(QString::fromStdString(room), calculateRoomReadStatus(room));
+    {
+        std::lock_guard lock(db->readStatusMtx);
+        db->readStatus = std::move(cachedStatus);
+    }
 
     emit roomReadStatus(readStatus);
 }
 
+void
+Cache::updateRoomReadStatus(const std::vector<std::string> &changedRooms,
+                            const std::vector<std::string> &leftRooms)
+{
+    std::vector<std::pair<std::string, bool>> updated;
+    updated.reserve(changedRooms.size());
+    for (const auto &room : changedRooms)
+        updated.emplace_back(room, calculateRoomReadStatus(room));
+
+    std::map<QString, bool> delta;
+    {
+        std::lock_guard lock(db->readStatusMtx);
+        for (const auto &room : leftRooms)
+            db->readStatus.erase(room);
+
+        for (const auto &[room, unread] : updated) {
+            auto [it, inserted] = db->readStatus.try_emplace(room, unread);
+            if (inserted || it->second != unread) {
+                it->second = unread;
+                delta.emplace(QString::fromStdString(room), unread);
+            }
+        }
+    }
+
+    if (!delta.empty())
+        emit roomReadStatus(delta);
+}
+
 bool
 Cache::calculateRoomReadStatus(const std::string &room_id)
 {
@@ -2148,6 +3754,9 @@ Cache::calculateRoomReadStatus(const std::string &room_id)
 void
 Cache::updateState(const std::string &room, const mtx::responses::StateEvents &state, bool wipe)
 {
+    // left over from a transaction, which failed
+    db->discardMemberChanges();
+
     auto txn         = lmdb::txn::begin(db->env_);
     auto statesdb    = getStatesDb(txn, room);
     auto stateskeydb = getStatesKeyDb(txn, room);
@@ -2158,6 +3767,8 @@ Cache::updateState(const std::string &room, const mtx::responses::StateEvents &s
         membersdb.drop(txn);
         statesdb.drop(txn);
         stateskeydb.drop(txn);
+        db->dropResolvedMembers(room);
+        db->dropRoomTrust(room);
     }
 
     saveStateEvents(txn, statesdb, stateskeydb, membersdb, eventsDb, room, state.events);
@@ -2190,6 +3801,8 @@ Cache::updateState(const std::string &room, const mtx::responses::StateEvents &s
     db->rooms.put(txn, room, nlohmann::json(updatedInfo).dump());
     updateSpaces(txn, {room}, {room});
     txn.commit();
+
+    db->applyMemberChanges();
 }
 
 template<typename T>
@@ -2289,10 +3902,10 @@ Cache::getStateEventsWithType(lmdb::txn &txn,
 template<class T>
 void
 Cache::saveStateEvents(lmdb::txn &txn,
-                       lmdb::dbi &statesdb,
+                       RoomTable &statesdb,
                        lmdb::dbi &stateskeydb,
                        lmdb::dbi &membersdb,
-                       lmdb::dbi &eventsDb,
+                       RoomTable &eventsDb,
                        const std::string &room_id,
                        const std::vector<T> &events)
 {
@@ -2303,10 +3916,10 @@ Cache::saveStateEvents(lmdb::txn &txn,
 template<class T>
 void
 Cache::saveStateEvent(lmdb::txn &txn,
-                      lmdb::dbi &statesdb,
+                      RoomTable &statesdb,
                       lmdb::dbi &stateskeydb,
                       lmdb::dbi &membersdb,
-                      lmdb::dbi &eventsDb,
+                      RoomTable &eventsDb,
                       const std::string &room_id,
                       const T &event)
 {
@@ -2338,10 +3951,14 @@ Cache::saveStateEvent(lmdb::txn &txn,
             };
 
             membersdb.put(txn, e->state_key, nlohmann::json(tmp).dump());
+            db->queueMemberChange(room_id, e->state_key, &tmp);
+            db->updateResolvedMember(room_id, e->state_key, &tmp);
             break;
         }
         default: {
             membersdb.del(txn, e->state_key, "");
+            db->queueMemberChange(room_id, e->state_key, nullptr);
+            db->updateResolvedMember(room_id, e->state_key, nullptr);
             break;
         }
         }
@@ -2359,7 +3976,7 @@ Cache::saveStateEvent(lmdb::txn &txn,
     }
 
     std::visit(
-      [&txn, &statesdb, &stateskeydb, &eventsDb, &membersdb](const auto &e) {
+      [this, &txn, &statesdb, &stateskeydb, &eventsDb, &membersdb, &room_id](const auto &e) {
           if constexpr (isStateEvent_<decltype(e)>) {
               eventsDb.put(txn, e.event_id, nlohmann::json(e).dump());
 
@@ -2372,6 +3989,8 @@ Cache::saveStateEvent(lmdb::txn &txn,
                           // to the mxid)
                           MemberInfo tmp{e.state_key, ""};
                           membersdb.put(txn, e.state_key, nlohmann::json(tmp).dump());
+                          db->queueMemberChange(room_id, e.state_key, &tmp);
+                          db->updateResolvedMember(room_id, e.state_key, &tmp);
                       } else if (e.state_key.empty()) {
                           // strictly speaking some stuff in those events can be redacted, but
                           // this is close enough. Ref:
@@ -2618,7 +4237,11 @@ try {
 
     txn.commit();
 
-    std::map<QString, bool> readStatus;
+    db->applyMemberChanges();
+
+    std::vector<std::string> readStatusChanged, leftRooms;
+    for (const auto &room : res.rooms.leave)
+        leftRooms.push_back(room.first);
 
     for (const auto &room : res.rooms.join) {
         for (const auto &e : room.second.ephemeral.events) {
@@ -2643,11 +4266,24 @@ try {
                     emit newReadReceipts(QString::fromStdString(room.first), receipts);
             }
         }
-        readStatus.emplace(QString::fromStdString(room.first), calculateRoomReadStatus(room.first));
+
+        // only new events and moving the fully read marker change the read status
+        if (!room.second.timeline.events.empty() ||
+            std::ranges::any_of(room.second.account_data.events, [](const auto &e) {
+                return std::holds_alternative<
+                  AccountDataEvent<mtx::events::account_data::FullyRead>>(e);
+            }))
+            readStatusChanged.push_back(room.first);
     }
 
-    emit roomReadStatus(readStatus);
+    updateRoomReadStatus(readStatusChanged, leftRooms);
 } catch (const lmdb::error &lmdbException) {
+    db->discardMemberChanges();
+    // The other in memory caches may contain changes from the aborted transaction.
+    db->dropMemberIndexes();
+    db->dropResolvedMembers();
+    db->dropRoomTrust();
+
     if (lmdbException.code() == MDB_DBS_FULL || lmdbException.code() == MDB_MAP_FULL) {
         if (lmdbException.code() == MDB_DBS_FULL) {
             auto settings = UserSettings::instance();
@@ -2707,7 +4343,7 @@ Cache::saveInvites(lmdb::txn &txn, const std::map<std::string, mtx::responses::I
 
 void
 Cache::saveInvite(lmdb::txn &txn,
-                  lmdb::dbi &statesdb,
+                  RoomTable &statesdb,
                   lmdb::dbi &membersdb,
                   const mtx::responses::InvitedRoom &room)
 {
@@ -2785,6 +4421,7 @@ Cache::singleRoomInfo(const std::string &room_id)
                 tmp.member_count = getMembersDb(txn, room_id).size(txn);
                 tmp.join_rule    = getRoomJoinRule(txn, statesdb);
                 tmp.guest_access = getRoomGuestAccess(txn, statesdb);
+                db->applyPendingTimestamp(room_id, tmp);
 
                 return tmp;
             } catch (const nlohmann::json::exception &e) {
@@ -2803,31 +4440,33 @@ Cache::singleRoomInfo(const std::string &room_id)
 void
 Cache::updateLastMessageTimestamp(const std::string &room_id, uint64_t ts)
 {
-    auto txn = lmdb::txn::begin(db->env_);
-
-    try {
-        auto statesdb = getStatesDb(txn, room_id);
-
-        std::string_view data;
-
-        // Check if the room is joined.
-        if (db->rooms.get(txn, room_id, data)) {
-            try {
-                RoomInfo tmp                         = nlohmann::json::parse(data).get<RoomInfo>();
-                tmp.approximate_last_modification_ts = ts;
-                db->rooms.put(txn, room_id, nlohmann::json(tmp).dump());
-                txn.commit();
-                return;
-            } catch (const nlohmann::json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                  room_id,
-                                  std::string(data.data(), data.size()),
-                                  e.what());
-            }
-        }
-    } catch (const lmdb::error &e) {
-        nhlog::db()->warn("failed to read room info from db: room_id ({}), {}", room_id, e.what());
-    }
+    // an update, which is still queued, may be newer
+    std::optional<std::string> pending;
+    if (db->pendingValue(LAST_MESSAGE_TS_TABLE, room_id, pending) && pending)
+        ts = std::max(ts, std::stoull(*pending));
+
+    db->queueWrite(
+      [this, room_id, ts](lmdb::txn &txn) {
+          std::string_view data;
+
+          // Check if the room is joined.
+          if (db->rooms.get(txn, room_id, data)) {
+              try {
+                  RoomInfo tmp = nlohmann::json::parse(data).get<RoomInfo>();
+                  // the sync may have stored a newer timestamp directly
+                  if (tmp.approximate_last_modification_ts >= ts)
+                      return;
+                  tmp.approximate_last_modification_ts = ts;
+                  db->rooms.put(txn, room_id, nlohmann::json(tmp).dump());
+              } catch (const nlohmann::json::exception &e) {
+                  nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
+                                    room_id,
+                                    std::string(data.data(), data.size()),
+                                    e.what());
+              }
+          }
+      },
+      CacheDb::PendingValue{LAST_MESSAGE_TS_TABLE, room_id, std::to_string(ts)});
 }
 
 std::map<QString, RoomInfo>
@@ -2849,6 +4488,7 @@ Cache::getRoomInfo(const std::vector<std::string> &rooms)
                 tmp.member_count = getMembersDb(txn, room).size(txn);
                 tmp.join_rule    = getRoomJoinRule(txn, statesdb);
                 tmp.guest_access = getRoomGuestAccess(txn, statesdb);
+                db->applyPendingTimestamp(room, tmp);
 
                 room_info.emplace(QString::fromStdString(room), std::move(tmp));
             } catch (const nlohmann::json::exception &e) {
@@ -2911,9 +4551,7 @@ Cache::previousBatchToken(const std::string &room_id)
             return "";
         }
 
-        auto j = nlohmann::json::parse(val);
-
-        return j.value("prev_batch", "");
+        return OrderEntry::parse(val).prev_batch.value_or("");
     } catch (...) {
         return "";
     }
@@ -2925,10 +4563,15 @@ Cache::getEvent(const std::string &room_id, std::string_view event_id)
     auto txn      = ro_txn(db->env_);
     auto eventsDb = getEventsDb(txn, room_id);
 
+    std::optional<std::string> pending;
     std::string_view event{};
-    bool success = eventsDb.get(txn, event_id, event);
-    if (!success)
+    if (db->pendingValue(room_id + "/events", std::string(event_id), pending)) {
+        if (!pending)
+            return {};
+        event = *pending;
+    } else if (!eventsDb.get(txn, event_id, event)) {
         return {};
+    }
 
     try {
         return nlohmann::json::parse(event).get<mtx::events::collections::TimelineEvents>();
@@ -2942,11 +4585,13 @@ Cache::storeEvent(const std::string &room_id,
                   const std::string &event_id,
                   const mtx::events::collections::TimelineEvents &event)
 {
-    auto txn        = lmdb::txn::begin(db->env_);
-    auto eventsDb   = getEventsDb(txn, room_id);
-    auto event_json = mtx::accessors::serialize_event(event);
-    eventsDb.put(txn, event_id, event_json.dump());
-    txn.commit();
+    auto event_json = mtx::accessors::serialize_event(event).dump();
+    db->queueWrite(
+      [this, room_id, event_id, event_json](lmdb::txn &txn) {
+          auto eventsDb = getEventsDb(txn, room_id);
+          eventsDb.put(txn, event_id, event_json);
+      },
+      CacheDb::PendingValue{room_id + "/events", event_id, event_json});
 }
 
 void
@@ -2977,9 +4622,12 @@ Cache::relatedEvents(const std::string &room_id, const std::string &event_id)
     auto relationsDb = getRelationsDb(txn, room_id);
 
     std::vector<std::string> related_ids;
+    if (!relationsDb.exists())
+        return related_ids;
 
-    auto related_cursor         = lmdb::cursor::open(txn, relationsDb);
-    std::string_view related_to = event_id, related_event;
+    auto related_cursor         = lmdb::cursor::open(txn, relationsDb.table());
+    const auto key              = relationsDb.key(event_id);
+    std::string_view related_to = key, related_event;
     bool first                  = true;
 
     try {
@@ -2989,7 +4637,7 @@ Cache::relatedEvents(const std::string &room_id, const std::string &event_id)
         while (
           related_cursor.get(related_to, related_event, first ? MDB_FIRST_DUP : MDB_NEXT_DUP)) {
             first = false;
-            if (event_id != std::string_view(related_to.data(), related_to.size()))
+            if (key != std::string_view(related_to.data(), related_to.size()))
                 break;
 
             related_ids.emplace_back(related_event.data(), related_event.size());
@@ -3056,6 +4704,7 @@ Cache::roomNamesAndAliases()
         try {
             std::string room_id_str = std::string(room_id);
             RoomInfo info           = nlohmann::json::parse(std::move(room_data)).get<RoomInfo>();
+            db->applyPendingTimestamp(room_id_str, info);
 
             auto aliases = getStateEvent<mtx::events::state::CanonicalAlias>(txn, room_id_str);
             std::string alias;
@@ -3139,7 +4788,7 @@ Cache::getTimelineIndex(const std::string &room_id, std::string_view event_id)
 
     auto txn = ro_txn(db->env_);
 
-    lmdb::dbi orderDb;
+    RoomTable orderDb;
     try {
         orderDb = getMessageToOrderDb(txn, room_id);
     } catch (lmdb::runtime_error &e) {
@@ -3166,7 +4815,7 @@ Cache::getEventIndex(const std::string &room_id, std::string_view event_id)
 
     auto txn = ro_txn(db->env_);
 
-    lmdb::dbi orderDb;
+    RoomTable orderDb;
     try {
         orderDb = getEventToOrderDb(txn, room_id);
     } catch (lmdb::runtime_error &e) {
@@ -3193,9 +4842,9 @@ Cache::lastInvisibleEventAfter(const std::string &room_id, std::string_view even
 
     auto txn = ro_txn(db->env_);
 
-    lmdb::dbi orderDb;
+    RoomTable orderDb;
     lmdb::dbi eventOrderDb;
-    lmdb::dbi timelineDb;
+    RoomTable timelineDb;
     try {
         orderDb      = getEventToOrderDb(txn, room_id);
         eventOrderDb = getEventOrderDb(txn, room_id);
@@ -3220,13 +4869,14 @@ Cache::lastInvisibleEventAfter(const std::string &room_id, std::string_view even
         auto cursor = lmdb::cursor::open(txn, eventOrderDb);
         cursor.get(indexVal, MDB_SET);
         while (cursor.get(indexVal, event_id, MDB_NEXT)) {
-            std::string evId = nlohmann::json::parse(event_id)["event_id"].get<std::string>();
+            auto entry = OrderEntry::parse(event_id);
             std::string_view temp;
-            if (timelineDb.get(txn, evId, temp)) {
+            if (entry.knowsVisibility ? entry.msgIndex.has_value()
+                                      : timelineDb.get(txn, entry.event_id, temp)) {
                 return std::pair{prevIdx, std::string(prevId)};
             } else {
                 prevIdx = lmdb::from_sv<uint64_t>(indexVal);
-                prevId  = std::move(evId);
+                prevId  = std::move(entry.event_id);
             }
         }
 
@@ -3244,9 +4894,9 @@ Cache::lastVisibleEvent(const std::string &room_id, std::string_view event_id)
         return {};
 
     auto txn = ro_txn(db->env_);
-    lmdb::dbi orderDb;
+    RoomTable orderDb;
     lmdb::dbi eventOrderDb;
-    lmdb::dbi timelineDb;
+    RoomTable timelineDb;
     try {
         orderDb      = getEventToOrderDb(txn, room_id);
         eventOrderDb = getEventOrderDb(txn, room_id);
@@ -3265,10 +4915,12 @@ Cache::lastVisibleEvent(const std::string &room_id, std::string_view event_id)
         auto cursor = lmdb::cursor::open(txn, eventOrderDb);
         if (cursor.get(indexVal, event_id, MDB_SET)) {
             do {
-                evId = nlohmann::json::parse(event_id)["event_id"].get<std::string>();
+                auto entry = OrderEntry::parse(event_id);
+                evId       = std::move(entry.event_id);
                 std::string_view temp;
                 idx = lmdb::from_sv<uint64_t>(indexVal);
-                if (timelineDb.get(txn, evId, temp)) {
+                if (entry.knowsVisibility ? entry.msgIndex.has_value()
+                                          : timelineDb.get(txn, evId, temp)) {
                     return std::pair{idx, evId};
                 }
             } while (cursor.get(indexVal, event_id, MDB_PREV));
@@ -3360,7 +5012,7 @@ Cache::invite(std::string_view roomid)
 }
 
 QString
-Cache::getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
+Cache::getRoomAvatarUrl(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3413,7 +5065,7 @@ Cache::getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersd
 }
 
 QString
-Cache::getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
+Cache::getRoomName(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3505,7 +5157,7 @@ Cache::getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
 }
 
 mtx::events::state::JoinRule
-Cache::getRoomJoinRule(lmdb::txn &txn, lmdb::dbi &statesdb)
+Cache::getRoomJoinRule(lmdb::txn &txn, RoomTable &statesdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3526,7 +5178,7 @@ Cache::getRoomJoinRule(lmdb::txn &txn, lmdb::dbi &statesdb)
 }
 
 bool
-Cache::getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb)
+Cache::getRoomGuestAccess(lmdb::txn &txn, RoomTable &statesdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3547,7 +5199,7 @@ Cache::getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb)
 }
 
 QString
-Cache::getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb)
+Cache::getRoomTopic(lmdb::txn &txn, RoomTable &statesdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3570,7 +5222,7 @@ Cache::getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb)
 }
 
 QString
-Cache::getRoomVersion(lmdb::txn &txn, lmdb::dbi &statesdb)
+Cache::getRoomVersion(lmdb::txn &txn, RoomTable &statesdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3594,7 +5246,7 @@ Cache::getRoomVersion(lmdb::txn &txn, lmdb::dbi &statesdb)
 }
 
 bool
-Cache::getRoomIsSpace(lmdb::txn &txn, lmdb::dbi &statesdb)
+Cache::getRoomIsSpace(lmdb::txn &txn, RoomTable &statesdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3617,7 +5269,7 @@ Cache::getRoomIsSpace(lmdb::txn &txn, lmdb::dbi &statesdb)
 }
 
 bool
-Cache::getRoomIsTombstoned(lmdb::txn &txn, lmdb::dbi &statesdb)
+Cache::getRoomIsTombstoned(lmdb::txn &txn, RoomTable &statesdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3639,7 +5291,7 @@ Cache::getRoomIsTombstoned(lmdb::txn &txn, lmdb::dbi &statesdb)
 }
 
 QString
-Cache::getInviteRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
+Cache::getInviteRoomName(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3680,7 +5332,7 @@ Cache::getInviteRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &members
 }
 
 QString
-Cache::getInviteRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
+Cache::getInviteRoomAvatarUrl(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3721,7 +5373,7 @@ Cache::getInviteRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &me
 }
 
 QString
-Cache::getInviteRoomTopic(lmdb::txn &txn, lmdb::dbi &db_)
+Cache::getInviteRoomTopic(lmdb::txn &txn, RoomTable &db_)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3742,7 +5394,7 @@ Cache::getInviteRoomTopic(lmdb::txn &txn, lmdb::dbi &db_)
 }
 
 bool
-Cache::getInviteRoomIsSpace(lmdb::txn &txn, lmdb::dbi &db_)
+Cache::getInviteRoomIsSpace(lmdb::txn &txn, RoomTable &db_)
 {
     using namespace mtx::events;
     using namespace mtx::events::state;
@@ -3836,6 +5488,14 @@ Cache::getMember(const std::string &room_id, const std::string &user_id)
 std::vector<RoomMember>
 Cache::getMembers(const std::string &room_id, std::size_t startIndex, std::size_t len)
 {
+    // The member index can seek to an offset directly, while a cursor has to step over all
+    // previous members, which makes paging through big rooms quadratic.
+    if (auto index = db->loadedMemberIndex(room_id); index || startIndex > 0) {
+        if (!index)
+            index = memberIndex(room_id);
+        return index->members(startIndex, len);
+    }
+
     try {
         auto txn    = ro_txn(db->env_);
         auto db_    = getMembersDb(txn, room_id);
@@ -3880,6 +5540,55 @@ Cache::getMembers(const std::string &room_id, std::size_t startIndex, std::size_
     }
 }
 
+std::shared_ptr<MemberIndex>
+Cache::memberIndex(const std::string &room_id)
+{
+    if (auto cached = db->loadedMemberIndex(room_id))
+        return cached;
+
+    const auto key = InternedId(room_id);
+    auto index     = std::make_shared<MemberIndex>();
+
+    uint64_t generation;
+    {
+        std::lock_guard lock(db->memberIndexesMtx);
+        generation = db->memberIndexGeneration;
+    }
+    // a snapshot may have started before the generation was read
+    const bool fromSnapshot = snapshotActive;
+
+    try {
+        auto txn    = ro_txn(db->env_);
+        auto cursor = lmdb::cursor::open(txn, getMembersDb(txn, room_id));
+
+        std::string_view user_id, user_data;
+        while (cursor.get(user_id, user_data, MDB_NEXT)) {
+            try {
+                index->upsert(std::string(user_id),
+                              nlohmann::json::parse(user_data).get<MemberInfo>());
+            } catch (const nlohmann::json::exception &e) {
+                nhlog::db()->warn("{}", e.what());
+            }
+        }
+        cursor.close();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("Failed to build member index for room {}: {}", room_id, e.what());
+        return index;
+    }
+
+    std::lock_guard lock(db->memberIndexesMtx);
+    // a concurrent build might have finished first
+    if (auto cached = db->memberIndexes.object(key))
+        return *cached;
+    // members changed while building, the next call builds it again
+    if (generation != db->memberIndexGeneration || fromSnapshot)
+        return index;
+    db->memberIndexes.insert(key,
+                             new std::shared_ptr<MemberIndex>(index),
+                             std::max<qsizetype>(1, static_cast<qsizetype>(index->size())));
+    return index;
+}
+
 std::optional<MemberInfo>
 Cache::getInviteMember(const std::string &room_id, const std::string &user_id)
 {
@@ -4064,7 +5773,7 @@ Cache::removePendingStatus(const std::string &room_id, const std::string &txn_id
 
 void
 Cache::saveTimelineMessages(lmdb::txn &txn,
-                            lmdb::dbi &eventsDb,
+                            RoomTable &eventsDb,
                             const std::string &room_id,
                             const mtx::responses::Timeline &res)
 {
@@ -4081,8 +5790,8 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
     if (res.limited) {
         lmdb::dbi_drop(txn, orderDb, false);
-        lmdb::dbi_drop(txn, evToOrderDb, false);
-        lmdb::dbi_drop(txn, msg2orderDb, false);
+        evToOrderDb.drop(txn);
+        msg2orderDb.drop(txn);
         lmdb::dbi_drop(txn, order2msgDb, false);
         lmdb::dbi_drop(txn, pending, true);
     }
@@ -4116,10 +5825,10 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
         std::string_view event_id = event_id_val;
 
-        nlohmann::json orderEntry = nlohmann::json::object();
-        orderEntry["event_id"]    = event_id_val;
+        OrderEntry orderEntry;
+        orderEntry.event_id = event_id_val;
         if (first && !res.prev_batch.empty())
-            orderEntry["prev_batch"] = res.prev_batch;
+            orderEntry.prev_batch = res.prev_batch;
 
         std::string_view txn_order;
         if (!txn_id.empty() && evToOrderDb.get(txn, txn_id, txn_order)) {
@@ -4128,12 +5837,13 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
             std::string_view msg_txn_order;
             if (msg2orderDb.get(txn, txn_id, msg_txn_order)) {
+                orderEntry.msgIndex = lmdb::from_sv<uint64_t>(msg_txn_order);
                 order2msgDb.put(txn, msg_txn_order, event_id);
                 msg2orderDb.put(txn, event_id, msg_txn_order);
                 msg2orderDb.del(txn, txn_id);
             }
 
-            orderDb.put(txn, txn_order, orderEntry.dump());
+            orderDb.put(txn, txn_order, orderEntry.serialize());
             evToOrderDb.put(txn, event_id, txn_order);
             evToOrderDb.del(txn, txn_id);
 
@@ -4164,9 +5874,9 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                 first = false;
                 ++index;
 
-                nhlog::db()->debug("saving redaction '{}'", orderEntry.dump());
+                nhlog::db()->debug("saving redaction '{}'", event_id);
 
-                cursor.put(lmdb::to_sv(index), orderEntry.dump(), MDB_APPEND);
+                cursor.put(lmdb::to_sv(index), orderEntry.serialize(), MDB_APPEND);
                 evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
                 eventsDb.put(txn, event_id, event.dump());
             }
@@ -4227,10 +5937,7 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
                 ++index;
 
-                nhlog::db()->debug("saving '{}'", orderEntry.dump());
-
-                cursor.put(lmdb::to_sv(index), orderEntry.dump(), MDB_APPEND);
-                evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
+                nhlog::db()->debug("saving '{}'", event_id);
 
                 // TODO(Nico): Allow blacklisting more event types in UI
                 if (!isHiddenEvent(txn, e, room_id)) {
@@ -4238,9 +5945,13 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                     msgCursor.put(lmdb::to_sv(msgIndex), event_id, MDB_APPEND);
 
                     msg2orderDb.put(txn, event_id, lmdb::to_sv(msgIndex));
+                    orderEntry.msgIndex = msgIndex;
                 }
+
+                cursor.put(lmdb::to_sv(index), orderEntry.serialize(), MDB_APPEND);
+                evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
             } else {
-                nhlog::db()->warn("duplicate event '{}'", orderEntry.dump());
+                nhlog::db()->warn("duplicate event '{}'", event_id);
             }
             eventsDb.put(txn, event_id, event.dump());
 
@@ -4287,9 +5998,9 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
 
     if (res.chunk.empty()) {
         if (orderDb.get(txn, lmdb::to_sv(index), val)) {
-            auto orderEntry          = nlohmann::json::parse(val);
-            orderEntry["prev_batch"] = res.end;
-            orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
+            auto orderEntry       = OrderEntry::parse(val);
+            orderEntry.prev_batch = res.end;
+            orderDb.put(txn, lmdb::to_sv(index), orderEntry.serialize());
             txn.commit();
         }
         return msgIndex;
@@ -4311,11 +6022,8 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
         if (!evToOrderDb.get(txn, event_id, unused_read)) {
             --index;
 
-            nlohmann::json orderEntry = nlohmann::json::object();
-            orderEntry["event_id"]    = event_id_val;
-
-            orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
-            evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
+            OrderEntry orderEntry;
+            orderEntry.event_id = event_id_val;
 
             // TODO(Nico): Allow blacklisting more event types in UI
             if (!isHiddenEvent(txn, e, room_id)) {
@@ -4323,7 +6031,11 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
                 order2msgDb.put(txn, lmdb::to_sv(msgIndex), event_id);
 
                 msg2orderDb.put(txn, event_id, lmdb::to_sv(msgIndex));
+                orderEntry.msgIndex = msgIndex;
             }
+
+            orderDb.put(txn, lmdb::to_sv(index), orderEntry.serialize());
+            evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
         }
         eventsDb.put(txn, event_id, event.dump());
 
@@ -4338,25 +6050,28 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
     }
 
     if (!event_id_val.empty()) {
-        nlohmann::json orderEntry = nlohmann::json::object();
-        orderEntry["event_id"]    = event_id_val;
-        orderEntry["prev_batch"]  = res.end;
-        orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
+        // keep the visibility of the entry
+        OrderEntry orderEntry;
+        if (orderDb.get(txn, lmdb::to_sv(index), val))
+            orderEntry = OrderEntry::parse(val);
+        orderEntry.event_id   = event_id_val;
+        orderEntry.prev_batch = res.end;
+        orderDb.put(txn, lmdb::to_sv(index), orderEntry.serialize());
     } else if (!res.chunk.empty()) {
         // to not break pagination, even if all events are redactions we try to persist something in
         // the batch.
 
-        nlohmann::json orderEntry = nlohmann::json::object();
-        event_id_val              = mtx::accessors::event_id(res.chunk.back());
+        OrderEntry orderEntry;
+        event_id_val = mtx::accessors::event_id(res.chunk.back());
         --index;
 
         auto event = mtx::accessors::serialize_event(res.chunk.back()).dump();
         eventsDb.put(txn, event_id_val, event);
         evToOrderDb.put(txn, event_id_val, lmdb::to_sv(index));
 
-        orderEntry["event_id"]   = event_id_val;
-        orderEntry["prev_batch"] = res.end;
-        orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
+        orderEntry.event_id   = event_id_val;
+        orderEntry.prev_batch = res.end;
+        orderDb.put(txn, lmdb::to_sv(index), orderEntry.serialize());
     }
 
     txn.commit();
@@ -4382,37 +6097,27 @@ Cache::clearTimeline(const std::string &room_id)
     bool start                   = true;
     bool passed_pagination_token = false;
     while (cursor.get(indexVal, val, start ? MDB_LAST : MDB_PREV)) {
-        start = false;
-        nlohmann::json obj;
-
-        try {
-            obj = nlohmann::json::parse(std::string_view(val.data(), val.size()));
-        } catch (std::exception &) {
-            // workaround bug in the initial db format, where we sometimes didn't store
-            // json...
-            obj = {{"event_id", std::string(val.data(), val.size())}};
-        }
+        start      = false;
+        auto entry = OrderEntry::parse(val);
 
         if (passed_pagination_token) {
-            if (obj.count("event_id") != 0) {
-                std::string event_id = obj["event_id"].get<std::string>();
-
-                if (!event_id.empty()) {
-                    evToOrderDb.del(txn, event_id);
-                    eventsDb.del(txn, event_id);
-                    relationsDb.del(txn, event_id);
-
-                    std::string_view order{};
-                    bool exists = msg2orderDb.get(txn, event_id, order);
-                    if (exists) {
-                        order2msgDb.del(txn, order);
-                        msg2orderDb.del(txn, event_id);
-                    }
+            const auto &event_id = entry.event_id;
+
+            if (!event_id.empty()) {
+                evToOrderDb.del(txn, event_id);
+                eventsDb.del(txn, event_id);
+                relationsDb.del(txn, event_id);
+
+                std::string_view order{};
+                bool exists = msg2orderDb.get(txn, event_id, order);
+                if (exists) {
+                    order2msgDb.del(txn, order);
+                    msg2orderDb.del(txn, event_id);
                 }
             }
             lmdb::cursor_del(cursor);
         } else {
-            if (obj.count("prev_batch") != 0)
+            if (entry.prev_batch)
                 passed_pagination_token = true;
         }
     }
@@ -4428,14 +6133,7 @@ Cache::clearTimeline(const std::string &room_id)
         while (cursor.get(indexVal, eventId, innerStart ? MDB_LAST : MDB_PREV)) {
             innerStart = false;
 
-            nlohmann::json obj;
-            try {
-                obj = nlohmann::json::parse(std::string_view(eventId.data(), eventId.size()));
-            } catch (std::exception &) {
-                obj = {{"event_id", std::string(eventId.data(), eventId.size())}};
-            }
-
-            if (obj["event_id"] == std::string(val.data(), val.size())) {
+            if (OrderEntry::parse(eventId).event_id == val) {
                 found = true;
                 break;
             }
@@ -4459,24 +6157,25 @@ Cache::clearTimeline(const std::string &room_id)
 void
 Cache::markSentNotification(const std::string &event_id)
 {
-    auto txn = lmdb::txn::begin(db->env_);
-    db->notifications.put(txn, event_id, "");
-    txn.commit();
+    db->queueWrite([this, event_id](lmdb::txn &txn) { db->notifications.put(txn, event_id, ""); },
+                   CacheDb::PendingValue{NOTIFICATIONS_DB, event_id, ""});
 }
 
 void
 Cache::removeReadNotification(const std::string &event_id)
 {
-    auto txn = lmdb::txn::begin(db->env_);
-
-    db->notifications.del(txn, event_id);
-
-    txn.commit();
+    // queued as well, so that it is applied after a queued markSentNotification
+    db->queueWrite([this, event_id](lmdb::txn &txn) { db->notifications.del(txn, event_id); },
+                   CacheDb::PendingValue{NOTIFICATIONS_DB, event_id, std::nullopt});
 }
 
 bool
 Cache::isNotificationSent(const std::string &event_id)
 {
+    std::optional<std::string> pending;
+    if (db->pendingValue(NOTIFICATIONS_DB, event_id, pending))
+        return pending.has_value();
+
     auto txn = ro_txn(db->env_);
 
     std::string_view value;
@@ -4492,73 +6191,291 @@ Cache::getRoomIds(lmdb::txn &txn)
 
     std::vector<std::string> rooms;
 
-    std::string_view room_id, _unused;
-    while (cursor.get(room_id, _unused, MDB_NEXT))
-        rooms.emplace_back(room_id);
+    std::string_view room_id, _unused;
+    while (cursor.get(room_id, _unused, MDB_NEXT))
+        rooms.emplace_back(room_id);
+
+    cursor.close();
+
+    return rooms;
+}
+
+static std::uint64_t
+stricterLimit(std::uint64_t a, std::uint64_t b)
+{
+    if (!a || !b)
+        return a ? a : b;
+    return std::min(a, b);
+}
+
+static std::optional<RetentionPolicy>
+loadRetentionPolicy(lmdb::txn &txn, lmdb::dbi &policies, std::string_view id)
+{
+    std::string_view data;
+    if (!policies.get(txn, id, data))
+        return std::nullopt;
+
+    try {
+        return nlohmann::json::parse(data).get<RetentionPolicy>();
+    } catch (const nlohmann::json::exception &e) {
+        nhlog::db()->warn("Failed to parse retention policy of {}: {}", id, e.what());
+        return std::nullopt;
+    }
+}
+
+void
+Cache::setRetentionPolicy(const std::string &room_id, std::optional<RetentionPolicy> policy)
+{
+    auto txn = lmdb::txn::begin(db->env_);
+    if (policy)
+        db->retentionPolicies.put(txn, room_id, nlohmann::json(*policy).dump());
+    else
+        db->retentionPolicies.del(txn, room_id);
+    txn.commit();
+}
+
+void
+Cache::setDefaultRetentionPolicy(std::optional<RetentionPolicy> policy)
+{
+    setRetentionPolicy(std::string(DEFAULT_RETENTION_POLICY_KEY), std::move(policy));
+}
+
+//! The policy of the room, otherwise the strictest limits of the spaces containing it, otherwise
+//! the default policy.
+static RetentionPolicy
+effectiveRetentionPolicy(lmdb::txn &txn, CacheDb &db, const std::string &room_id)
+{
+    if (auto policy = loadRetentionPolicy(txn, db.retentionPolicies, room_id))
+        return *policy;
+
+    std::optional<RetentionPolicy> fromSpaces;
+    {
+        auto cursor            = lmdb::cursor::open(txn, db.spacesParents);
+        std::string_view child = room_id, parent;
+        bool found             = cursor.get(child, parent, MDB_SET);
+        while (found) {
+            if (auto policy = loadRetentionPolicy(txn, db.retentionPolicies, parent)) {
+                if (!fromSpaces) {
+                    fromSpaces = policy;
+                } else {
+                    fromSpaces->max_events =
+                      stricterLimit(fromSpaces->max_events, policy->max_events);
+                    fromSpaces->max_age_ms =
+                      stricterLimit(fromSpaces->max_age_ms, policy->max_age_ms);
+                    fromSpaces->max_bytes = stricterLimit(fromSpaces->max_bytes, policy->max_bytes);
+                }
+            }
+            found = cursor.get(child, parent, MDB_NEXT_DUP);
+        }
+    }
+    if (fromSpaces)
+        return *fromSpaces;
+
+    if (auto policy = loadRetentionPolicy(txn, db.retentionPolicies, DEFAULT_RETENTION_POLICY_KEY))
+        return *policy;
+    return RetentionPolicy{.max_events = MAX_RESTORED_MESSAGES};
+}
+
+bool
+Cache::trimRoomHistory(lmdb::txn &txn,
+                       const std::string &room_id,
+                       std::size_t maxEvents,
+                       RetentionStats &stats,
+                       std::optional<uint64_t> &bytes)
+{
+    auto policy = effectiveRetentionPolicy(txn, *db, room_id);
+
+    auto orderDb     = getEventOrderDb(txn, room_id);
+    auto evToOrderDb = getEventToOrderDb(txn, room_id);
+    auto o2m         = getOrderToMessageDb(txn, room_id);
+    auto m2o         = getMessageToOrderDb(txn, room_id);
+    auto eventsDb    = getEventsDb(txn, room_id);
+    auto relationsDb = getRelationsDb(txn, room_id);
+    auto cursor      = lmdb::cursor::open(txn, orderDb);
+
+    std::string_view indexVal, val;
+    uint64_t first, last;
+    if (cursor.get(indexVal, val, MDB_LAST)) {
+        last = lmdb::from_sv<uint64_t>(indexVal);
+    } else {
+        return true;
+    }
+    if (cursor.get(indexVal, val, MDB_FIRST)) {
+        first = lmdb::from_sv<uint64_t>(indexVal);
+    } else {
+        return true;
+    }
+
+    uint64_t message_count = last - first;
+    if (policy.max_bytes && !bytes) {
+        // the same sizes as subtracted below, page sizes would include the free space in pages
+        bytes = 0;
+        eventsDb.forEach(txn, [&bytes](std::string_view event_id, std::string_view event) {
+            *bytes += event_id.size() + event.size();
+        });
+    }
+    const uint64_t cutoff =
+      policy.max_age_ms
+        ? static_cast<uint64_t>(QDateTime::currentMSecsSinceEpoch()) - policy.max_age_ms
+        : 0;
+
+    std::size_t deleted = 0;
+    bool start          = true;
+    // the latest event is always kept
+    while (cursor.get(indexVal, val, start ? MDB_FIRST : MDB_NEXT) &&
+           lmdb::from_sv<uint64_t>(indexVal) != last) {
+        start = false;
+
+        std::string event_id = OrderEntry::parse(val).event_id;
+        std::string_view event;
+        bool hasEvent = !event_id.empty() && eventsDb.get(txn, event_id, event);
+
+        bool expired = (policy.max_events && message_count > policy.max_events) ||
+                       (policy.max_bytes && *bytes > policy.max_bytes);
+        // The age of events, which aren't stored, is unknown, so they are kept. Only the oldest
+        // entries are deleted, as the timeline expects the remaining ones to be contiguous.
+        if (!expired && cutoff && hasEvent)
+            expired =
+              nlohmann::json::parse(event).value("origin_server_ts", uint64_t{0}) < cutoff;
+        if (!expired)
+            break;
+
+        if (deleted == maxEvents)
+            return false;
+
+        uint64_t size = indexVal.size() + val.size() + event.size() + event_id.size();
+        if (bytes)
+            *bytes -= std::min<uint64_t>(*bytes, event.size() + event_id.size());
+
+        if (!event_id.empty()) {
+            evToOrderDb.del(txn, event_id);
+            eventsDb.del(txn, event_id);
+
+            relationsDb.del(txn, event_id);
+
+            std::string_view order{};
+            bool exists = m2o.get(txn, event_id, order);
+            if (exists) {
+                o2m.del(txn, order);
+                m2o.del(txn, event_id);
+            }
+        }
+        cursor.del();
 
-    cursor.close();
+        message_count--;
+        deleted++;
+        stats.events++;
+        stats.bytes += size;
+    }
 
-    return rooms;
+    return true;
 }
 
-void
-Cache::deleteOldMessages()
+RetentionStats
+Cache::applyRetentionPolicies(std::size_t maxEvents)
 {
-    std::string_view indexVal, val;
+    RetentionStats stats;
+    if (db->retentionRunning.exchange(true))
+        return stats;
 
-    auto txn      = lmdb::txn::begin(db->env_);
-    auto room_ids = getRoomIds(txn);
-
-    for (const auto &room_id : room_ids) {
-        auto orderDb     = getEventOrderDb(txn, room_id);
-        auto evToOrderDb = getEventToOrderDb(txn, room_id);
-        auto o2m         = getOrderToMessageDb(txn, room_id);
-        auto m2o         = getMessageToOrderDb(txn, room_id);
-        auto eventsDb    = getEventsDb(txn, room_id);
-        auto relationsDb = getRelationsDb(txn, room_id);
-        auto cursor      = lmdb::cursor::open(txn, orderDb);
-
-        uint64_t first, last;
-        if (cursor.get(indexVal, val, MDB_LAST)) {
-            last = lmdb::from_sv<uint64_t>(indexVal);
-        } else {
-            continue;
-        }
-        if (cursor.get(indexVal, val, MDB_FIRST)) {
-            first = lmdb::from_sv<uint64_t>(indexVal);
-        } else {
-            continue;
+    std::vector<std::string> trimmedRooms;
+
+    try {
+        std::vector<std::string> room_ids;
+        std::string position;
+        {
+            auto txn = ro_txn(db->env_);
+            room_ids = getRoomIds(txn);
+
+            std::string_view pos;
+            if (db->syncState.get(txn, RETENTION_POSITION_KEY, pos))
+                position = pos;
+        }
+
+        // continue after the room the last run finished with
+        std::ranges::sort(room_ids);
+        std::ranges::rotate(room_ids, std::ranges::upper_bound(room_ids, position));
+
+        for (const auto &room_id : room_ids) {
+            bool finished = false;
+            std::optional<uint64_t> bytes;
+            const auto deletedBefore = stats.events;
+            while (!finished && stats.events < maxEvents) {
+                auto txn = lmdb::txn::begin(db->env_);
+                finished = trimRoomHistory(
+                  txn,
+                  room_id,
+                  std::min<std::size_t>(RETENTION_BATCH_SIZE, maxEvents - stats.events),
+                  stats,
+                  bytes);
+                if (finished)
+                    db->syncState.put(txn, RETENTION_POSITION_KEY, room_id);
+                txn.commit();
+
+                if (stats.events != deletedBefore &&
+                    (trimmedRooms.empty() || trimmedRooms.back() != room_id))
+                    trimmedRooms.push_back(room_id);
+            }
+
+            if (!finished)
+                break;
         }
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("Failed to apply retention policies: {}", e.what());
+    } catch (const nlohmann::json::exception &e) {
+        nhlog::db()->error("Failed to apply retention policies: {}", e.what());
+    }
 
-        size_t message_count = static_cast<size_t>(last - first);
-        if (message_count < MAX_RESTORED_MESSAGES)
-            continue;
+    // the timelines drop the deleted events, before they load older ones again
+    stats.rooms = trimmedRooms.size();
+    for (const auto &room_id : trimmedRooms)
+        emit historyTrimmed(QString::fromStdString(room_id));
 
-        bool start = true;
-        while (cursor.get(indexVal, val, start ? MDB_FIRST : MDB_NEXT) &&
-               message_count-- > MAX_RESTORED_MESSAGES) {
-            start    = false;
-            auto obj = nlohmann::json::parse(std::string_view(val.data(), val.size()));
+    if (stats.events) {
+        nhlog::db()->info("Retention policies deleted {} events in {} rooms, about {} bytes.",
+                          stats.events,
+                          stats.rooms,
+                          stats.bytes);
 
-            if (obj.count("event_id") != 0) {
-                std::string event_id = obj["event_id"].get<std::string>();
-                evToOrderDb.del(txn, event_id);
-                eventsDb.del(txn, event_id);
+        std::lock_guard lock(db->retentionTotalsMtx);
+        db->retentionTotals.rooms += stats.rooms;
+        db->retentionTotals.events += stats.events;
+        db->retentionTotals.bytes += stats.bytes;
+    }
 
-                relationsDb.del(txn, event_id);
+    db->retentionRunning = false;
+    return stats;
+}
 
-                std::string_view order{};
-                bool exists = m2o.get(txn, event_id, order);
-                if (exists) {
-                    o2m.del(txn, order);
-                    m2o.del(txn, event_id);
-                }
-            }
-            cursor.del();
-        }
-        cursor.close();
+RetentionStats
+Cache::retentionStats()
+{
+    std::lock_guard lock(db->retentionTotalsMtx);
+    return db->retentionTotals;
+}
+
+WriteQueueStats
+Cache::writeQueueStats()
+{
+    uint64_t pending;
+    {
+        std::lock_guard lock(db->pendingWritesMtx);
+        pending = db->queuedWrites - db->finishedWrites;
     }
-    txn.commit();
+
+    return WriteQueueStats{
+      .pending      = pending,
+      .writes       = db->committedWrites,
+      .batches      = db->writeBatches,
+      .failed       = db->failedWrites,
+      .lock_wait_us = db->writeLockWaitUs,
+    };
+}
+
+void
+Cache::deleteOldMessages()
+{
+    applyRetentionPolicies();
 }
 
 void
@@ -4917,45 +6834,90 @@ Cache::roomMembers(const std::string &room_id)
 crypto::Trust
 Cache::roomVerificationStatus(const std::string &room_id)
 {
-    crypto::Trust trust = crypto::Verified;
+    std::vector<std::string> toCalculate, dirty;
+    bool rebuild;
+    std::pair<uint64_t, uint64_t> generation;
+    {
+        std::lock_guard lock(db->roomTrustMtx);
+        generation = db->trustGeneration(room_id);
 
-    try {
-        auto txn = lmdb::txn::begin(db->env_);
+        auto it = db->roomTrust.find(room_id);
+        rebuild = it == db->roomTrust.end();
+        if (!rebuild) {
+            if (it->second.dirty.empty())
+                return it->second.trust();
+            dirty.assign(it->second.dirty.begin(), it->second.dirty.end());
+            toCalculate = dirty;
+        }
+    }
 
-        auto db_    = getMembersDb(txn, room_id);
-        auto keysDb = getUserKeysDb(txn);
+    try {
+        CacheDb::RoomTrust calculated;
         std::vector<std::string> keysToRequest;
+        {
+            auto verifGeneration = verification_storage.currentGeneration();
+            auto txn             = ro_txn(db->env_);
+            auto db_             = getMembersDb(txn, room_id);
+
+            std::string_view user_id, unused;
+            if (rebuild) {
+                auto cursor = lmdb::cursor::open(txn, db_);
+                while (cursor.get(user_id, unused, MDB_NEXT))
+                    toCalculate.emplace_back(user_id);
+            } else {
+                // dirty members may have left the room
+                std::erase_if(toCalculate,
+                              [&](const std::string &u) { return !db_.get(txn, u, unused); });
+            }
 
-        std::string_view user_id, unused;
-        auto cursor = lmdb::cursor::open(txn, db_);
-        while (cursor.get(user_id, unused, MDB_NEXT)) {
-            auto verif = verificationStatus_(std::string(user_id), txn);
-            if (verif.unverified_device_count) {
-                trust = crypto::Unverified;
-                if (verif.verified_devices.empty() && verif.no_keys) {
-                    // we probably don't have the keys yet, so query them
-                    keysToRequest.push_back(std::string(user_id));
-                }
-            } else if (verif.user_verified == crypto::TOFU && trust == crypto::Verified)
-                trust = crypto::TOFU;
+            for (const auto &[user_id, verif] :
+                 verificationStatuses_(toCalculate, txn, verifGeneration)) {
+                if (verif.unverified_device_count) {
+                    calculated.add(user_id, crypto::Unverified);
+                    if (verif.verified_devices.empty() && verif.no_keys) {
+                        // we probably don't have the keys yet, so query them
+                        keysToRequest.push_back(user_id);
+                    }
+                } else if (verif.user_verified == crypto::TOFU)
+                    calculated.add(user_id, crypto::TOFU);
+                else
+                    calculated.add(user_id, crypto::Verified);
+            }
         }
 
-        if (!keysToRequest.empty()) {
-            std::string_view token;
+        if (!keysToRequest.empty())
+            markUserKeysOutOfDate(keysToRequest);
+
+        std::lock_guard lock(db->roomTrustMtx);
+        if (rebuild) {
+            // if something changed while calculating, the next call needs to start over
+            if (generation == db->trustGeneration(room_id))
+                db->roomTrust[room_id] = calculated;
+            return calculated.trust();
+        }
 
-            bool result = this->db->syncState.get(txn, NEXT_BATCH_KEY, token);
+        auto it = db->roomTrust.find(room_id);
+        if (it == db->roomTrust.end())
+            return calculated.trust();
 
-            if (!result)
-                token = "";
-            markUserKeysOutOfDate(txn, keysDb, keysToRequest, std::string(token));
+        auto &trust = it->second;
+        if (generation == db->trustGeneration(room_id)) {
+            for (const auto &member : dirty)
+                trust.dirty.erase(member);
+            for (const auto &[member, memberTrust] : calculated.members)
+                trust.add(member, memberTrust);
+            return trust.trust();
         }
 
+        // only the result is used, the members stay dirty
+        auto result = trust;
+        for (const auto &[member, memberTrust] : calculated.members)
+            result.add(member, memberTrust);
+        return result.trust();
     } catch (std::exception &e) {
         nhlog::db()->error("Failed to calculate verification status for {}: {}", room_id, e.what());
-        trust = crypto::Unverified;
+        return crypto::Unverified;
     }
-
-    return trust;
 }
 
 std::map<std::string, std::optional<UserKeyCache>>
@@ -4964,7 +6926,8 @@ Cache::getMembersWithKeys(const std::string &room_id, bool verified_only)
     std::string_view keys;
 
     try {
-        auto txn = ro_txn(db->env_);
+        auto verifGeneration = verification_storage.currentGeneration();
+        auto txn             = ro_txn(db->env_);
         std::map<std::string, std::optional<UserKeyCache>> members;
 
         auto db_    = getMembersDb(txn, room_id);
@@ -4978,7 +6941,7 @@ Cache::getMembersWithKeys(const std::string &room_id, bool verified_only)
             if (res) {
                 auto k = nlohmann::json::parse(keys).get<UserKeyCache>();
                 if (verified_only) {
-                    auto verif = verificationStatus_(std::string(user_id), txn);
+                    auto verif = verificationStatus_(std::string(user_id), txn, verifGeneration);
 
                     if (verif.user_verified == crypto::Trust::Verified ||
                         !verif.verified_devices.empty()) {
@@ -5027,39 +6990,33 @@ Cache::getMembersWithKeys(const std::string &room_id, bool verified_only)
 QString
 Cache::displayName(const QString &room_id, const QString &user_id)
 {
-    return QString::fromStdString(displayName(room_id.toStdString(), user_id.toStdString()));
-}
-
-static bool
-isDisplaynameSafe(const std::string &s)
-{
-    const auto str = QString::fromStdString(s);
-
-    for (QChar c : str) {
-        if (c.isPrint() && !c.isSpace())
-            return false;
-    }
-
-    return true;
+    return resolveMember(room_id.toStdString(), user_id.toStdString()).qName;
 }
 
 std::string
 Cache::displayName(const std::string &room_id, const std::string &user_id)
 {
-    if (auto info = getMember(room_id, user_id); info && !isDisplaynameSafe(info->name))
-        return info->name;
-
-    return user_id;
+    return resolveMember(room_id, user_id).name;
 }
 
 QString
 Cache::avatarUrl(const QString &room_id, const QString &user_id)
 {
-    if (auto info = getMember(room_id.toStdString(), user_id.toStdString());
-        info && !info->avatar_url.empty())
-        return QString::fromStdString(info->avatar_url);
+    return resolveMember(room_id.toStdString(), user_id.toStdString()).avatarUrl;
+}
+
+ResolvedMember
+Cache::resolveMember(const std::string &room_id, const std::string &user_id)
+{
+    uint64_t gen;
+    if (auto cached = db->cachedResolvedMember(room_id, user_id, gen))
+        return *cached;
 
-    return QString();
+    auto info = getMember(room_id, user_id);
+    ResolvedMember resolved(user_id, info ? &*info : nullptr);
+    if (db->env_.handle())
+        db->storeResolvedMember(room_id, user_id, resolved, gen);
+    return resolved;
 }
 
 mtx::events::presence::Presence
@@ -5273,8 +7230,14 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
 
     {
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+        verification_storage.generation++;
         for (auto &[user_id, update] : updates) {
             (void)update;
+            if (user_id == local_user)
+                db->dropRoomTrust();
+            else
+                db->invalidateTrust(user_id);
+
             if (user_id == local_user) {
                 std::swap(tmp, verification_storage.status);
             } else {
@@ -5312,9 +7275,6 @@ Cache::markUserKeysOutOfDate(lmdb::txn &txn,
                              const std::vector<std::string> &user_ids,
                              const std::string &sync_token)
 {
-    mtx::requests::QueryKeys query;
-    query.token = sync_token;
-
     for (const auto &user : user_ids) {
         if (user.size() > 255) {
             nhlog::db()->debug("Skipping device key query for user with invalid mxid: {}", user);
@@ -5339,43 +7299,131 @@ Cache::markUserKeysOutOfDate(lmdb::txn &txn,
 
         db_.put(txn, user, nlohmann::json(cacheEntry).dump());
 
-        query.device_keys[user] = {};
+        scheduleKeyQuery(user, sync_token, nullptr);
+    }
+}
+
+void
+Cache::scheduleKeyQuery(const std::string &user_id,
+                        const std::string &sync_token,
+                        KeyQueryCallback cb)
+{
+    std::lock_guard lock(db->keyQueriesMtx);
+
+    // Join a running query for the same state of the keys, otherwise query them again afterwards.
+    if (auto running = db->runningKeyQueries.find(user_id);
+        cb && running != db->runningKeyQueries.end() && running->second.first == sync_token) {
+        running->second.second.push_back(std::move(cb));
+        return;
+    }
+
+    auto &queued = db->queuedKeyQueries[user_id];
+    // the newest token wins, as the keys are up to date for it afterwards
+    if (queued.first.empty() || !sync_token.empty())
+        queued.first = sync_token;
+    if (cb)
+        queued.second.push_back(std::move(cb));
+
+    if (!db->keyQueryScheduled) {
+        db->keyQueryScheduled = true;
+        QMetaObject::invokeMethod(
+          this,
+          [this] { QTimer::singleShot(KEY_QUERY_DELAY_MS, this, &Cache::sendKeyQueries); },
+          Qt::QueuedConnection);
+    }
+}
+
+void
+Cache::sendKeyQueries()
+{
+    // batches per token, since the keys are marked as up to date for the token of the query
+    std::map<std::string, std::vector<mtx::requests::QueryKeys>> batches;
+    {
+        std::lock_guard lock(db->keyQueriesMtx);
+        db->keyQueryScheduled = false;
+
+        for (auto it = db->queuedKeyQueries.begin(); it != db->queuedKeyQueries.end();) {
+            // stays queued until the running query of the user finished
+            if (db->runningKeyQueries.count(it->first)) {
+                ++it;
+                continue;
+            }
+
+            auto &tokenBatches = batches[it->second.first];
+            if (tokenBatches.empty() ||
+                tokenBatches.back().device_keys.size() >= KEY_QUERY_BATCH_SIZE) {
+                tokenBatches.emplace_back().token = it->second.first;
+            }
+            tokenBatches.back().device_keys[it->first] = {};
+            db->runningKeyQueries[it->first] = std::move(it->second);
+            it = db->queuedKeyQueries.erase(it);
+        }
+    }
+
+    for (auto &[token, requests] : batches) {
+        for (auto &req : requests) {
+            nhlog::net()->debug("Querying keys of {} users", req.device_keys.size());
+
+            std::vector<std::string> users;
+            for (const auto &[user_id, devices] : req.device_keys)
+                users.push_back(user_id);
 
-        if (query.device_keys.size() >= 32) {
             http::client()->query_keys(
-              query,
-              [this, sync_token](const mtx::responses::QueryKeys &keys, mtx::http::RequestErr err) {
+              req,
+              [this, token, users = std::move(users)](const mtx::responses::QueryKeys &res,
+                                                      mtx::http::RequestErr err) {
                   if (err) {
-                      nhlog::net()->warn("failed to query device keys: {} {}",
-                                         err->matrix_error.error,
+                      nhlog::net()->warn("failed to query device keys: {},{}",
+                                         mtx::errors::to_string(err->matrix_error.errcode),
                                          static_cast<int>(err->status_code));
-                      return;
+                  } else {
+                      emit userKeysUpdate(token, res);
                   }
 
-                  emit userKeysUpdate(sync_token, keys);
+                  // queued after the update of the keys, so the waiters see the new keys
+                  QMetaObject::invokeMethod(
+                    this,
+                    [this, users, err]() { finishKeyQueries(users, err); },
+                    Qt::QueuedConnection);
               });
-            query.device_keys.clear();
         }
     }
+}
 
-    if (!query.device_keys.empty())
-        http::client()->query_keys(
-          query,
-          [this, sync_token](const mtx::responses::QueryKeys &keys, mtx::http::RequestErr err) {
-              if (err) {
-                  nhlog::net()->warn("failed to query device keys: {} {}",
-                                     err->matrix_error.error,
-                                     static_cast<int>(err->status_code));
-                  return;
-              }
+void
+Cache::finishKeyQueries(const std::vector<std::string> &users,
+                        const std::optional<mtx::http::ClientError> &err)
+{
+    std::vector<std::pair<std::string, std::vector<KeyQueryCallback>>> waiters;
+    {
+        std::lock_guard lock(db->keyQueriesMtx);
+        for (const auto &user_id : users) {
+            if (auto it = db->runningKeyQueries.find(user_id); it != db->runningKeyQueries.end()) {
+                if (!it->second.second.empty())
+                    waiters.emplace_back(user_id, std::move(it->second.second));
+                db->runningKeyQueries.erase(it);
+            }
+        }
+
+        if (!db->queuedKeyQueries.empty() && !db->keyQueryScheduled) {
+            db->keyQueryScheduled = true;
+            QTimer::singleShot(KEY_QUERY_DELAY_MS, this, &Cache::sendKeyQueries);
+        }
+    }
 
-              emit userKeysUpdate(sync_token, keys);
-          });
+    for (auto &[user_id, callbacks] : waiters) {
+        UserKeyCache keys;
+        if (!err) {
+            auto txn = ro_txn(db->env_);
+            keys     = userKeys_(user_id, txn).value_or(UserKeyCache{});
+        }
+        for (auto &cb : callbacks)
+            cb(keys, err);
+    }
 }
 
 void
-Cache::query_keys(const std::string &user_id,
-                  std::function<void(const UserKeyCache &, mtx::http::RequestErr)> cb)
+Cache::query_keys(const std::string &user_id, KeyQueryCallback cb)
 {
     if (user_id.size() > 255) {
         nhlog::db()->debug("Skipping device key query for user with invalid mxid: {}", user_id);
@@ -5386,7 +7434,6 @@ Cache::query_keys(const std::string &user_id,
         return;
     }
 
-    mtx::requests::QueryKeys req;
     std::string last_changed;
     {
         auto txn    = ro_txn(db->env_);
@@ -5404,44 +7451,11 @@ Cache::query_keys(const std::string &user_id,
         } else
             nhlog::db()->info("No keys found for {}", user_id);
 
-        req.device_keys[user_id] = {};
-
         if (cache_)
             last_changed = cache_->last_changed;
-        req.token = last_changed;
     }
 
-    // use context object so that we can disconnect again
-    QObject *context{new QObject(this)};
-    QObject::connect(
-      this,
-      &Cache::userKeysUpdateFinalize,
-      context,
-      [cb, user_id, context_ = context, this](std::string updated_user) mutable {
-          if (user_id == updated_user) {
-              context_->deleteLater();
-              auto txn  = ro_txn(db->env_);
-              auto keys = this->userKeys_(user_id, txn);
-              cb(keys.value_or(UserKeyCache{}), {});
-          }
-      },
-      Qt::QueuedConnection);
-
-    http::client()->query_keys(
-      req,
-      [cb, user_id, last_changed, this](const mtx::responses::QueryKeys &res,
-                                        mtx::http::RequestErr err) {
-          if (err) {
-              nhlog::net()->warn("failed to query device keys: {},{}",
-                                 mtx::errors::to_string(err->matrix_error.errcode),
-                                 static_cast<int>(err->status_code));
-              cb({}, err);
-              return;
-          }
-
-          emit userKeysUpdate(last_changed, res);
-          emit userKeysUpdateFinalize(user_id);
-      });
+    scheduleKeyQuery(user_id, last_changed, std::move(cb));
 }
 
 void
@@ -5472,6 +7486,22 @@ from_json(const nlohmann::json &j, OnlineBackupVersion &info)
     info.algorithm = j.at("a").get<std::string>();
 }
 
+void
+to_json(nlohmann::json &j, const BackupRestoreProgress &progress)
+{
+    j["v"] = progress.version;
+    j["r"] = progress.restored_rooms;
+    j["f"] = progress.finished;
+}
+
+void
+from_json(const nlohmann::json &j, BackupRestoreProgress &progress)
+{
+    progress.version        = j.at("v").get<std::string>();
+    progress.restored_rooms = j.value("r", std::set<std::string>{});
+    progress.finished       = j.value("f", false);
+}
+
 std::optional<VerificationCache>
 Cache::verificationCache(const std::string &user_id, lmdb::txn &txn)
 {
@@ -5524,10 +7554,13 @@ Cache::markDeviceVerified(const std::string &user_id, const std::string &key)
     std::map<std::string, VerificationStatus> tmp;
     {
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+        verification_storage.generation++;
         if (user_id == local_user) {
+            db->dropRoomTrust();
             std::swap(tmp, verification_storage.status);
             verification_storage.status.clear();
         } else {
+            db->invalidateTrust(user_id);
             verification_storage.status.erase(user_id);
         }
     }
@@ -5567,9 +7600,12 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
     std::map<std::string, VerificationStatus> tmp;
     {
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+        verification_storage.generation++;
         if (user_id == local_user) {
+            db->dropRoomTrust();
             std::swap(tmp, verification_storage.status);
         } else {
+            db->invalidateTrust(user_id);
             verification_storage.status.erase(user_id);
         }
     }
@@ -5585,17 +7621,151 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
 VerificationStatus
 Cache::verificationStatus(const std::string &user_id)
 {
-    auto txn = ro_txn(db->env_);
-    return verificationStatus_(user_id, txn);
+    auto generation = verification_storage.currentGeneration();
+    auto txn        = ro_txn(db->env_);
+    return verificationStatus_(user_id, txn, generation);
 }
 
-VerificationStatus
-Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
+namespace {
+//! Everything needed to calculate the verification status of a user. It is read from the database
+//! up front, so that the signatures can be checked without holding a transaction or lock.
+struct VerificationInput
 {
-    std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
-    if (verification_storage.status.count(user_id))
-        return verification_storage.status.at(user_id);
+    std::string user_id;
+    std::optional<VerificationCache> verifCache;
+    std::optional<UserKeyCache> theirKeys;
+};
+
+//! The part of the trust chain of the local user, which is the same for every user.
+struct OwnTrustChain
+{
+    std::string local_user;
+    std::string device_id;
+    std::optional<UserKeyCache> ourKeys;
+    //! our master key is signed by this device
+    bool masterKeyVerified = false;
+    //! our user signing key is signed by our master key
+    bool userSigningKeyVerified = false;
+};
+
+//! Checks signatures, skipping the ed25519 verification of the ones, which were verified before,
+//! even in an earlier run. Can be shared by several threads.
+class SignatureChecker
+{
+public:
+    explicit SignatureChecker(CacheDb &db)
+      : db_(db)
+    {}
+
+    bool verify(const std::string &key, const nlohmann::json &obj, const std::string &signature)
+    {
+        auto hash = signatureHash(key, obj, signature);
+        {
+            std::lock_guard lock(db_.knownSignaturesMtx);
+            if (db_.knownSignatures.contains(hash))
+                return true;
+        }
+
+        if (!mtx::crypto::ed25519_verify_signature(key, obj, signature))
+            return false;
+
+        std::lock_guard lock(db_.knownSignaturesMtx);
+        if (db_.knownSignatures.insert(hash).second)
+            verified_.push_back(std::move(hash));
+        return true;
+    }
+
+    //! Store the signatures, that were verified for the first time.
+    void store()
+    {
+        if (verified_.empty())
+            return;
+
+        db_.queueWrite([&db = db_, verified = std::move(verified_)](lmdb::txn &txn) {
+            for (const auto &hash : verified)
+                db.verifiedSignatures.put(txn, hash, "");
+        });
+    }
+
+private:
+    //! The signature only covers the object without its signatures and unsigned data.
+    static std::string
+    signatureHash(const std::string &key, const nlohmann::json &obj, const std::string &signature)
+    {
+        auto canonical = obj;
+        canonical.erase("signatures");
+        canonical.erase("unsigned");
+
+        QCryptographicHash hash(QCryptographicHash::Algorithm::Sha256);
+        hash.addData(QByteArray::fromStdString(key));
+        hash.addData(QByteArray(1, '\0'));
+        hash.addData(QByteArray::fromStdString(signature));
+        hash.addData(QByteArray(1, '\0'));
+        hash.addData(QByteArray::fromStdString(canonical.dump()));
+        return hash.result().toStdString();
+    }
+
+    CacheDb &db_;
+    //! guarded by knownSignaturesMtx
+    std::vector<std::string> verified_;
+};
+}
+
+static bool
+verifyAtLeastOneSig(SignatureChecker &checker,
+                    const auto &toVerif,
+                    const std::map<std::string, std::string> &keys,
+                    const std::string &keyOwner)
+{
+    auto sigs = toVerif.signatures.find(keyOwner);
+    if (sigs == toVerif.signatures.end())
+        return false;
+
+    // serialize the object only once for all of its signatures
+    std::optional<nlohmann::json> canonical;
+    for (const auto &[key_id, signature] : sigs->second) {
+        auto key = keys.find(key_id);
+        if (key == keys.end())
+            continue;
+
+        if (!canonical)
+            canonical = nlohmann::json(toVerif);
+        if (checker.verify(key->second, *canonical, signature))
+            return true;
+    }
+    return false;
+}
 
+static OwnTrustChain
+ownTrustChain(SignatureChecker &checker, std::optional<UserKeyCache> ourKeys)
+{
+    OwnTrustChain own;
+    own.local_user = utils::localUser().toStdString();
+    own.device_id  = http::client()->device_id();
+    own.ourKeys    = std::move(ourKeys);
+    if (!own.ourKeys)
+        return own;
+
+    const auto &mk     = own.ourKeys->master_keys;
+    std::string dev_id = "ed25519:" + own.device_id;
+    own.masterKeyVerified =
+      mk.signatures.count(own.local_user) && mk.signatures.at(own.local_user).count(dev_id) &&
+      checker.verify(olm::client()->identity_keys().ed25519,
+                     nlohmann::json(mk),
+                     mk.signatures.at(own.local_user).at(dev_id));
+    own.userSigningKeyVerified =
+      own.masterKeyVerified &&
+      verifyAtLeastOneSig(checker, own.ourKeys->user_signing_keys, mk.keys, own.local_user);
+    return own;
+}
+
+//! Only does cpu work, so it can run on any thread.
+static VerificationStatus
+calculateVerificationStatus(SignatureChecker &checker,
+                            const OwnTrustChain &own,
+                            const VerificationInput &input)
+{
+    const auto &user_id = input.user_id;
     VerificationStatus status;
 
     // assume there is at least one unverified device until we have checked we have the device
@@ -5603,35 +7773,16 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
     status.unverified_device_count = 1;
     status.no_keys                 = true;
 
-    if (auto verifCache = verificationCache(user_id, txn)) {
-        status.verified_devices = verifCache->device_verified;
+    if (input.verifCache) {
+        status.verified_devices = input.verifCache->device_verified;
     }
 
-    const auto local_user = utils::localUser().toStdString();
-
     crypto::Trust trustlevel = crypto::Trust::Unverified;
-    if (user_id == local_user) {
-        status.verified_devices.insert(http::client()->device_id());
+    if (user_id == own.local_user) {
+        status.verified_devices.insert(own.device_id);
         trustlevel = crypto::Trust::Verified;
     }
 
-    auto verifyAtLeastOneSig = [](const auto &toVerif,
-                                  const std::map<std::string, std::string> &keys,
-                                  const std::string &keyOwner) {
-        if (!toVerif.signatures.count(keyOwner))
-            return false;
-
-        for (const auto &[key_id, signature] : toVerif.signatures.at(keyOwner)) {
-            if (!keys.count(key_id))
-                continue;
-
-            if (mtx::crypto::ed25519_verify_signature(
-                  keys.at(key_id), nlohmann::json(toVerif), signature))
-                return true;
-        }
-        return false;
-    };
-
     auto updateUnverifiedDevices = [&status](auto &theirDeviceKeys) {
         int currentVerifiedDevices = 0;
         for (const auto &device_id : status.verified_devices) {
@@ -5651,63 +7802,53 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
         //
         // This means verifying the other user adds 2 extra steps,verifying our user_signing
         // key and their master key
-        auto ourKeys   = userKeys_(local_user, txn);
-        auto theirKeys = userKeys_(user_id, txn);
+        const auto &ourKeys   = own.ourKeys;
+        const auto &theirKeys = input.theirKeys;
         if (theirKeys)
             status.no_keys = false;
 
-        if (!ourKeys || !theirKeys) {
-            verification_storage.status[user_id] = status;
+        if (!ourKeys || !theirKeys)
             return status;
-        }
 
         // Update verified devices count to count without cross-signing
         updateUnverifiedDevices(theirKeys->device_keys);
 
-        {
-            auto &mk           = ourKeys->master_keys;
-            std::string dev_id = "ed25519:" + http::client()->device_id();
-            if (!mk.signatures.count(local_user) || !mk.signatures.at(local_user).count(dev_id) ||
-                !mtx::crypto::ed25519_verify_signature(olm::client()->identity_keys().ed25519,
-                                                       nlohmann::json(mk),
-                                                       mk.signatures.at(local_user).at(dev_id))) {
-                nhlog::crypto()->debug("We have not verified our own master key");
-                verification_storage.status[user_id] = status;
-                return status;
-            }
+        if (!own.masterKeyVerified) {
+            nhlog::crypto()->debug("We have not verified our own master key");
+            return status;
         }
 
         auto master_keys = ourKeys->master_keys.keys;
 
-        if (user_id != local_user) {
+        if (user_id != own.local_user) {
             bool theirMasterKeyVerified =
-              verifyAtLeastOneSig(ourKeys->user_signing_keys, master_keys, local_user) &&
-              verifyAtLeastOneSig(
-                theirKeys->master_keys, ourKeys->user_signing_keys.keys, local_user);
+              own.userSigningKeyVerified &&
+              verifyAtLeastOneSig(checker,
+                                  theirKeys->master_keys,
+                                  ourKeys->user_signing_keys.keys,
+                                  own.local_user);
 
             if (theirMasterKeyVerified)
                 trustlevel = crypto::Trust::Verified;
             else if (!theirKeys->master_key_changed)
                 trustlevel = crypto::Trust::TOFU;
-            else {
-                verification_storage.status[user_id] = status;
+            else
                 return status;
-            }
 
             master_keys = theirKeys->master_keys.keys;
         }
 
         status.user_verified = trustlevel;
 
-        verification_storage.status[user_id] = status;
-        if (!verifyAtLeastOneSig(theirKeys->self_signing_keys, master_keys, user_id))
+        if (!verifyAtLeastOneSig(checker, theirKeys->self_signing_keys, master_keys, user_id))
             return status;
 
         for (const auto &[device, device_key] : theirKeys->device_keys) {
             (void)device;
             try {
                 auto identkey = device_key.keys.at("curve25519:" + device_key.device_id);
-                if (verifyAtLeastOneSig(device_key, theirKeys->self_signing_keys.keys, user_id)) {
+                if (verifyAtLeastOneSig(
+                      checker, device_key, theirKeys->self_signing_keys.keys, user_id)) {
                     status.verified_devices.insert(device_key.device_id);
                     status.verified_device_keys[identkey] = trustlevel;
                 }
@@ -5716,7 +7857,6 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
         }
 
         updateUnverifiedDevices(theirKeys->device_keys);
-        verification_storage.status[user_id] = status;
         return status;
     } catch (std::exception &e) {
         nhlog::db()->error("Failed to calculate verification status of {}: {}", user_id, e.what());
@@ -5724,6 +7864,69 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
     }
 }
 
+VerificationStatus
+Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn, uint64_t generation)
+{
+    return verificationStatuses_({user_id}, txn, generation).at(user_id);
+}
+
+std::map<std::string, VerificationStatus>
+Cache::verificationStatuses_(const std::vector<std::string> &user_ids,
+                             lmdb::txn &txn,
+                             uint64_t generation)
+{
+    std::map<std::string, VerificationStatus> statuses;
+    std::vector<VerificationInput> inputs;
+    {
+        std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+        for (const auto &user_id : user_ids) {
+            if (auto it = verification_storage.status.find(user_id);
+                it != verification_storage.status.end())
+                statuses.emplace(user_id, it->second);
+            else
+                inputs.push_back(VerificationInput{.user_id = user_id});
+        }
+    }
+
+    if (inputs.empty())
+        return statuses;
+
+    SignatureChecker checker(*db);
+    OwnTrustChain own;
+    // A snapshot may have started before the generation was read.
+    bool cacheable = !snapshotActive;
+    try {
+        db->loadKnownSignatures(txn);
+        own = ownTrustChain(checker, userKeys_(utils::localUser().toStdString(), txn));
+        for (auto &input : inputs) {
+            input.verifCache = verificationCache(input.user_id, txn);
+            input.theirKeys  = userKeys_(input.user_id, txn);
+        }
+    } catch (std::exception &e) {
+        nhlog::db()->error("Failed to load keys to calculate verification status: {}", e.what());
+        cacheable = false;
+    }
+
+    // Checking the signatures is the expensive part, so big rooms spread it over several threads.
+    std::vector<VerificationStatus> results(inputs.size());
+    utils::parallelChunks(
+      inputs.size(), VERIFICATIONS_PER_THREAD, [&](std::size_t begin, std::size_t end) {
+          for (std::size_t i = begin; i < end; i++)
+              results[i] = calculateVerificationStatus(checker, own, inputs[i]);
+      });
+    checker.store();
+
+    std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+    // don't store results calculated from keys, which were replaced in the meantime
+    bool current = cacheable && generation == verification_storage.generation;
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        if (current)
+            verification_storage.status[inputs[i].user_id] = results[i];
+        statuses.emplace(inputs[i].user_id, std::move(results[i]));
+    }
+    return statuses;
+}
+
 void
 to_json(nlohmann::json &j, const RoomInfo &info)
 {
@@ -5793,6 +7996,26 @@ from_json(const nlohmann::json &j, ReadReceiptKey &key)
     key.room_id  = j.at("room_id").get<std::string>();
 }
 
+void
+to_json(nlohmann::json &j, const RetentionPolicy &policy)
+{
+    j = nlohmann::json::object();
+    if (policy.max_events)
+        j["max_events"] = policy.max_events;
+    if (policy.max_age_ms)
+        j["max_age_ms"] = policy.max_age_ms;
+    if (policy.max_bytes)
+        j["max_bytes"] = policy.max_bytes;
+}
+
+void
+from_json(const nlohmann::json &j, RetentionPolicy &policy)
+{
+    policy.max_events = j.value("max_events", uint64_t{0});
+    policy.max_age_ms = j.value("max_age_ms", uint64_t{0});
+    policy.max_bytes  = j.value("max_bytes", uint64_t{0});
+}
+
 void
 to_json(nlohmann::json &j, const MemberInfo &info)
 {
@@ -5927,6 +8150,19 @@ init(const QString &user_id)
     instance_ = std::make_unique<Cache>(user_id);
 }
 
+ReadSnapshot::ReadSnapshot()
+{
+    snapshotDepth++;
+}
+
+ReadSnapshot::~ReadSnapshot()
+{
+    if (--snapshotDepth == 0 && snapshotActive) {
+        snapshotActive = false;
+        readTxn.reset();
+    }
+}
+
 Cache *
 client()
 {
@@ -6007,27 +8243,27 @@ invites()
 }
 
 QString
-getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
+getRoomName(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb)
 {
     return instance_->getRoomName(txn, statesdb, membersdb);
 }
 mtx::events::state::JoinRule
-getRoomJoinRule(lmdb::txn &txn, lmdb::dbi &statesdb)
+getRoomJoinRule(lmdb::txn &txn, RoomTable &statesdb)
 {
     return instance_->getRoomJoinRule(txn, statesdb);
 }
 bool
-getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb)
+getRoomGuestAccess(lmdb::txn &txn, RoomTable &statesdb)
 {
     return instance_->getRoomGuestAccess(txn, statesdb);
 }
 QString
-getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb)
+getRoomTopic(lmdb::txn &txn, RoomTable &statesdb)
 {
     return instance_->getRoomTopic(txn, statesdb);
 }
 QString
-getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
+getRoomAvatarUrl(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb)
 {
     return instance_->getRoomAvatarUrl(txn, statesdb, membersdb);
 }
@@ -6287,15 +8523,16 @@ dropOutboundMegolmSession(const std::string &room_id)
     instance_->dropOutboundMegolmSession(room_id);
 }
 
-void
-importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
+std::size_t
+importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                  const SessionKeysProgress &progress)
 {
-    instance_->importSessionKeys(keys);
+    return instance_->importSessionKeys(keys, progress);
 }
-mtx::crypto::ExportedSessionKeys
-exportSessionKeys()
+std::optional<mtx::crypto::ExportedSessionKeys>
+exportSessionKeys(const SessionKeysProgress &progress)
 {
-    return instance_->exportSessionKeys();
+    return instance_->exportSessionKeys(progress);
 }
 
 //
@@ -6313,6 +8550,14 @@ getInboundMegolmSession(const MegolmSessionIndex &index)
 {
     return instance_->getInboundMegolmSession(index);
 }
+
+bool
+withInboundMegolmSession(
+  const MegolmSessionIndex &index,
+  const std::function<void(const mtx::crypto::InboundGroupSessionPtr &)> &fn)
+{
+    return instance_->withInboundMegolmSession(index, fn);
+}
 bool
 inboundMegolmSessionExists(const MegolmSessionIndex &index)
 {
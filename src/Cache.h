@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <functional>
+
 #include <QDateTime>
 #include <QString>
 
@@ -25,6 +27,8 @@ namespace mtx::responses {
 struct Notifications;
 }
 
+class RoomTable;
+
 namespace cache {
 void
 setNeedsCompactFlag();
@@ -32,6 +36,22 @@ setNeedsCompactFlag();
 void
 init(const QString &user_id);
 
+//! Makes all cache reads of the current thread share one read transaction, while it is alive,
+//! instead of renewing one for every read. Use it around a batch of reads, like binding a
+//! delegate or refreshing a model, to save the renewals and get consistent results. Changes
+//! committed after the first read in the snapshot only become visible once it ends, so don't keep
+//! it around for longer than a frame and don't write to the cache while it is alive. Snapshots can
+//! be nested.
+class ReadSnapshot
+{
+public:
+    ReadSnapshot();
+    ~ReadSnapshot();
+
+    ReadSnapshot(const ReadSnapshot &)            = delete;
+    ReadSnapshot &operator=(const ReadSnapshot &) = delete;
+};
+
 std::string
 displayName(const std::string &room_id, const std::string &user_id);
 QString
@@ -67,18 +87,18 @@ invites();
 
 //! Calculate & return the name of the room.
 QString
-getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
+getRoomName(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb);
 //! Get room join rules
 mtx::events::state::JoinRule
-getRoomJoinRule(lmdb::txn &txn, lmdb::dbi &statesdb);
+getRoomJoinRule(lmdb::txn &txn, RoomTable &statesdb);
 bool
-getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb);
+getRoomGuestAccess(lmdb::txn &txn, RoomTable &statesdb);
 //! Retrieve the topic of the room if any.
 QString
-getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb);
+getRoomTopic(lmdb::txn &txn, RoomTable &statesdb);
 //! Retrieve the room avatar's url if any.
 QString
-getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
+getRoomAvatarUrl(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb);
 
 //! Retrieve member info from a room.
 std::vector<RoomMember>
@@ -213,10 +233,11 @@ updateOutboundMegolmSession(const std::string &room_id,
 void
 dropOutboundMegolmSession(const std::string &room_id);
 
-void
-importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
-mtx::crypto::ExportedSessionKeys
-exportSessionKeys();
+std::size_t
+importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                  const SessionKeysProgress &progress = {});
+std::optional<mtx::crypto::ExportedSessionKeys>
+exportSessionKeys(const SessionKeysProgress &progress = {});
 
 //
 // Inbound Megolm Sessions
@@ -227,6 +248,11 @@ saveInboundMegolmSession(const MegolmSessionIndex &index,
                          const GroupSessionData &data);
 mtx::crypto::InboundGroupSessionPtr
 getInboundMegolmSession(const MegolmSessionIndex &index);
+//! Run fn with the cached, unpickled session. Returns false, if the session is unknown.
+bool
+withInboundMegolmSession(
+  const MegolmSessionIndex &index,
+  const std::function<void(const mtx::crypto::InboundGroupSessionPtr &)> &fn);
 bool
 inboundMegolmSessionExists(const MegolmSessionIndex &index);
 std::optional<GroupSessionData>
@@ -7,6 +7,7 @@
 #include <QObject>
 #include <QQmlEngine>
 
+#include <functional>
 #include <map>
 #include <mutex>
 #include <set>
@@ -112,6 +113,10 @@ to_json(nlohmann::json &obj, const MegolmSessionIndex &msg);
 void
 from_json(const nlohmann::json &obj, MegolmSessionIndex &msg);
 
+//! Called with the number of processed and total sessions after every chunk of a session key
+//! export or import. Returning false cancels it.
+using SessionKeysProgress = std::function<bool(std::size_t done, std::size_t total)>;
+
 struct StoredOlmSession
 {
     std::uint64_t last_message_ts = 0;
@@ -142,7 +147,16 @@ struct VerificationStorage
 {
     //! mapping of user to verification status
     std::map<std::string, VerificationStatus> status;
+    //! incremented, whenever entries are invalidated
+    uint64_t generation = 0;
     std::mutex verification_storage_mtx;
+
+    //! Read before starting the transaction, that statuses to store are calculated from.
+    uint64_t currentGeneration()
+    {
+        std::lock_guard lock(verification_storage_mtx);
+        return generation;
+    }
 };
 
 //! In memory cache of verification status
@@ -204,3 +218,20 @@ void
 to_json(nlohmann::json &j, const OnlineBackupVersion &info);
 void
 from_json(const nlohmann::json &j, OnlineBackupVersion &info);
+
+//! Progress of restoring all sessions from the online backup, so that an interrupted restore can
+//! continue where it stopped.
+struct BackupRestoreProgress
+{
+    //! the backup version being restored
+    std::string version;
+    //! rooms, whose sessions were already restored completely
+    std::set<std::string> restored_rooms;
+    //! if all rooms were restored
+    bool finished = false;
+};
+
+void
+to_json(nlohmann::json &j, const BackupRestoreProgress &progress);
+void
+from_json(const nlohmann::json &j, BackupRestoreProgress &progress);
@@ -128,6 +128,42 @@ to_json(nlohmann::json &j, const MemberInfo &info);
 void
 from_json(const nlohmann::json &j, MemberInfo &info);
 
+//! Limits for how much of the history of a room is kept in the local cache. 0 means unlimited.
+struct RetentionPolicy
+{
+    std::uint64_t max_events = 0;
+    std::uint64_t max_age_ms = 0;
+    //! limit for the size of the stored events of the room
+    std::uint64_t max_bytes = 0;
+};
+
+void
+to_json(nlohmann::json &j, const RetentionPolicy &policy);
+void
+from_json(const nlohmann::json &j, RetentionPolicy &policy);
+
+//! What the retention policies deleted. Rooms are counted once per run.
+struct RetentionStats
+{
+    std::uint64_t rooms  = 0;
+    std::uint64_t events = 0;
+    //! approximate size of the deleted entries
+    std::uint64_t bytes = 0;
+};
+
+//! Small writes are queued and committed in batches on a separate thread.
+struct WriteQueueStats
+{
+    //! writes queued, but not committed or dropped yet
+    std::uint64_t pending = 0;
+    std::uint64_t writes  = 0;
+    std::uint64_t batches = 0;
+    //! writes dropped, as their batch failed to commit repeatedly
+    std::uint64_t failed = 0;
+    //! time spent waiting for the write lock
+    std::uint64_t lock_wait_us = 0;
+};
+
 struct RoomSearchResult
 {
     std::string room_id;
@@ -4,7 +4,10 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <optional>
+#include <tuple>
 
 #include <QDateTime>
 #include <QString>
@@ -29,6 +32,9 @@ class dbi;
 }
 
 struct CacheDb;
+class MemberIndex;
+class RoomTable;
+struct ResolvedMember;
 
 class Cache final : public QObject
 {
@@ -54,9 +60,9 @@ public:
                                lmdb::dbi &db,
                                const std::vector<std::string> &user_ids,
                                const std::string &sync_token);
-    void query_keys(
-      const std::string &user_id,
-      std::function<void(const UserKeyCache &, const std::optional<mtx::http::ClientError> &)> cb);
+    using KeyQueryCallback =
+      std::function<void(const UserKeyCache &, const std::optional<mtx::http::ClientError> &)>;
+    void query_keys(const std::string &user_id, KeyQueryCallback cb);
 
     // device & user verification cache
     std::optional<UserKeyCache> userKeys(const std::string &user_id);
@@ -74,20 +80,20 @@ public:
     QMap<QString, std::optional<RoomInfo>> spaces();
 
     //! Calculate & return the name of the room.
-    QString getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
+    QString getRoomName(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb);
     //! Get room join rules
-    mtx::events::state::JoinRule getRoomJoinRule(lmdb::txn &txn, lmdb::dbi &statesdb);
-    bool getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb);
+    mtx::events::state::JoinRule getRoomJoinRule(lmdb::txn &txn, RoomTable &statesdb);
+    bool getRoomGuestAccess(lmdb::txn &txn, RoomTable &statesdb);
     //! Retrieve the topic of the room if any.
-    QString getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb);
+    QString getRoomTopic(lmdb::txn &txn, RoomTable &statesdb);
     //! Retrieve the room avatar's url if any.
-    QString getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
+    QString getRoomAvatarUrl(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb);
     //! Retrieve the version of the room if any.
-    QString getRoomVersion(lmdb::txn &txn, lmdb::dbi &statesdb);
+    QString getRoomVersion(lmdb::txn &txn, RoomTable &statesdb);
     //! Retrieve if the room is a space
-    bool getRoomIsSpace(lmdb::txn &txn, lmdb::dbi &statesdb);
+    bool getRoomIsSpace(lmdb::txn &txn, RoomTable &statesdb);
     //! Retrieve if the room is tombstoned (closed or replaced by a different room)
-    bool getRoomIsTombstoned(lmdb::txn &txn, lmdb::dbi &statesdb);
+    bool getRoomIsTombstoned(lmdb::txn &txn, RoomTable &statesdb);
 
     // for the event expiry background job
     void storeEventExpirationProgress(const std::string &room,
@@ -113,6 +119,9 @@ public:
     //! Retrieve member info from a room.
     std::vector<RoomMember>
     getMembers(const std::string &room_id, std::size_t startIndex = 0, std::size_t len = 30);
+    //! The in memory member index of a room, which is built on first use and then kept up to
+    //! date, when member events are stored.
+    std::shared_ptr<MemberIndex> memberIndex(const std::string &room_id);
 
     std::vector<RoomMember> getMembersFromInvite(const std::string &room_id,
                                                  std::size_t startIndex = 0,
@@ -135,6 +144,9 @@ public:
     void removeRoom(lmdb::txn &txn, const std::string &roomid);
     void removeRoom(const std::string &roomid);
     void setup();
+    //! Write a compacted copy of the database on a background thread, while the client keeps
+    //! running. The copy replaces the database on the next start.
+    void compactInBackground();
 
     cache::CacheVersion formatVersion();
     void setCurrentFormat();
@@ -175,7 +187,11 @@ public:
     //! Whether all the events in the timeline have been read.
     std::string getFullyReadEventId(const std::string &room_id);
     bool calculateRoomReadStatus(const std::string &room_id);
+    //! Calculate the read status of all joined rooms and emit it.
     void calculateRoomReadStatus();
+    //! Recalculate the read status of the given rooms and emit the ones, that changed.
+    void updateRoomReadStatus(const std::vector<std::string> &changedRooms,
+                              const std::vector<std::string> &leftRooms = {});
 
     void markSentNotification(const std::string &event_id);
     //! Removes an event from the sent notifications.
@@ -221,6 +237,19 @@ public:
     //! Remove old unused data.
     void deleteOldMessages();
     void deleteOldData() noexcept;
+
+    //! Set the retention policy of a room. Policies of spaces apply to the rooms in them, that
+    //! don't have their own, and the default policy applies to all other rooms.
+    void setRetentionPolicy(const std::string &room_id, std::optional<RetentionPolicy> policy);
+    void setDefaultRetentionPolicy(std::optional<RetentionPolicy> policy);
+    //! Delete the history exceeding the retention policies in small transactions. Stops after
+    //! maxEvents deleted events and continues with the same room on the next call. Emits
+    //! historyTrimmed for the rooms, whose oldest events were deleted.
+    RetentionStats applyRetentionPolicies(std::size_t maxEvents = 20'000);
+    //! What the retention policies deleted since startup.
+    RetentionStats retentionStats();
+    //! Activity of the queue of small writes since startup.
+    WriteQueueStats writeQueueStats();
     //! Retrieve all saved room ids.
     std::vector<std::string> getRoomIds(lmdb::txn &txn);
     std::vector<std::string> getParentRoomIds(const std::string &room_id);
@@ -253,8 +282,13 @@ public:
                                      mtx::crypto::OutboundGroupSessionPtr &session);
     void dropOutboundMegolmSession(const std::string &room_id);
 
-    void importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
-    mtx::crypto::ExportedSessionKeys exportSessionKeys();
+    //! Stores the sessions in chunks and returns how many were imported. Safe to call from a
+    //! worker thread.
+    std::size_t importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys,
+                                  const SessionKeysProgress &progress = {});
+    //! Reads the sessions in chunks. Returns nothing, if progress cancelled the export.
+    std::optional<mtx::crypto::ExportedSessionKeys>
+    exportSessionKeys(const SessionKeysProgress &progress = {});
 
     //
     // Inbound Megolm Sessions
@@ -262,7 +296,23 @@ public:
     void saveInboundMegolmSession(const MegolmSessionIndex &index,
                                   mtx::crypto::InboundGroupSessionPtr session,
                                   const GroupSessionData &data);
+    //! Save several sessions in one transaction.
+    void saveInboundMegolmSessions(std::vector<std::tuple<MegolmSessionIndex,
+                                                          mtx::crypto::InboundGroupSessionPtr,
+                                                          GroupSessionData>> sessions);
     mtx::crypto::InboundGroupSessionPtr getInboundMegolmSession(const MegolmSessionIndex &index);
+    //! Run fn with the unpickled session from the in memory session cache, loading it from the
+    //! db if necessary. The session is locked while fn runs, so fn must not access the session
+    //! cache itself. Returns false, if the session is unknown.
+    bool withInboundMegolmSession(
+      const MegolmSessionIndex &index,
+      const std::function<void(const mtx::crypto::InboundGroupSessionPtr &)> &fn);
+    //! Merge the replay protection indices into the stored data of a session in one write
+    //! transaction. Returns the event id stored for each of the message indices afterwards, which
+    //! differs from the passed one, if another event claimed the index first.
+    std::map<uint32_t, std::string>
+    saveMegolmSessionIndices(const MegolmSessionIndex &index,
+                             const std::map<uint32_t, std::string> &indices);
     bool inboundMegolmSessionExists(const MegolmSessionIndex &index);
     std::optional<GroupSessionData> getMegolmSessionData(const MegolmSessionIndex &index);
 
@@ -285,6 +335,8 @@ public:
     void saveBackupVersion(const OnlineBackupVersion &data);
     void deleteBackupVersion();
     std::optional<OnlineBackupVersion> backupVersion();
+    void saveBackupRestoreProgress(const BackupRestoreProgress &progress);
+    std::optional<BackupRestoreProgress> backupRestoreProgress();
 
     void storeSecret(std::string_view name, const std::string &secret, bool internal = false);
     void deleteSecret(std::string_view name, bool internal = false);
@@ -299,15 +351,37 @@ public:
 
 signals:
     void newReadReceipts(const QString &room_id, const std::vector<QString> &event_ids);
+    //! The read status of the rooms, which changed since it was last emitted.
     void roomReadStatus(const std::map<QString, bool> &status);
     void userKeysUpdate(const std::string &sync_token, const mtx::responses::QueryKeys &keyQuery);
-    void userKeysUpdateFinalize(const std::string &user_id);
     void verificationStatusChanged(const std::string &userid);
     void selfVerificationStatusChanged();
     void secretChanged(const std::string name);
     void databaseReady();
+    //! The retention policies deleted the oldest events of a room.
+    void historyTrimmed(const QString &room_id);
+    void compactionProgress(quint64 copied, quint64 total);
+    //! Emitted with the estimated number of bytes the copy saves on the next start, or -1 if it
+    //! failed.
+    void compactionFinished(qint64 reclaimedBytes);
 
 private:
+    //! Stores an inbound megolm session, merging it with an already stored one. Returns if the
+    //! session should replace the one in the session cache after committing.
+    bool storeInboundMegolmSession(lmdb::txn &txn,
+                                   const std::string &key,
+                                   const mtx::crypto::InboundGroupSessionPtr &session,
+                                   const GroupSessionData &data);
+
+    //! Queue a query of the keys of a user. Queries are collected for a short time and then sent
+    //! in batches. cb may be empty, if only the keys in the cache should be updated.
+    void scheduleKeyQuery(const std::string &user_id,
+                          const std::string &sync_token,
+                          KeyQueryCallback cb);
+    void sendKeyQueries();
+    void finishKeyQueries(const std::vector<std::string> &users,
+                          const std::optional<mtx::http::ClientError> &err);
+
     void loadSecretsFromStore(
       std::vector<std::pair<std::string, bool>> toLoad,
       std::function<void(const std::string &name, bool internal, const std::string &value)>
@@ -318,20 +392,30 @@ private:
 
     //! Save an invited room.
     void saveInvite(lmdb::txn &txn,
-                    lmdb::dbi &statesdb,
+                    RoomTable &statesdb,
                     lmdb::dbi &membersdb,
                     const mtx::responses::InvitedRoom &room);
 
-    QString getInviteRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
-    QString getInviteRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb);
-    QString getInviteRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb);
-    bool getInviteRoomIsSpace(lmdb::txn &txn, lmdb::dbi &db);
+    QString getInviteRoomName(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb);
+    QString getInviteRoomTopic(lmdb::txn &txn, RoomTable &statesdb);
+    QString getInviteRoomAvatarUrl(lmdb::txn &txn, RoomTable &statesdb, lmdb::dbi &membersdb);
+    bool getInviteRoomIsSpace(lmdb::txn &txn, RoomTable &db);
 
     std::optional<MemberInfo> getMember(const std::string &room_id, const std::string &user_id);
+    //! Display name and avatar of a member, from the in memory table if possible.
+    ResolvedMember resolveMember(const std::string &room_id, const std::string &user_id);
 
     std::string getLastEventId(lmdb::txn &txn, const std::string &room_id);
+    //! Delete up to maxEvents of the oldest events of a room, which exceed its retention policy.
+    //! Returns true, if the room is within its policy afterwards. bytes is the size of the stored
+    //! events of the room. It is calculated on the first call and kept up to date for the next.
+    bool trimRoomHistory(lmdb::txn &txn,
+                         const std::string &room_id,
+                         std::size_t maxEvents,
+                         RetentionStats &stats,
+                         std::optional<uint64_t> &bytes);
     void saveTimelineMessages(lmdb::txn &txn,
-                              lmdb::dbi &eventsDb,
+                              RoomTable &eventsDb,
                               const std::string &room_id,
                               const mtx::responses::Timeline &res);
 
@@ -345,19 +429,19 @@ private:
 
     template<class T>
     void saveStateEvents(lmdb::txn &txn,
-                         lmdb::dbi &statesdb,
+                         RoomTable &statesdb,
                          lmdb::dbi &stateskeydb,
                          lmdb::dbi &membersdb,
-                         lmdb::dbi &eventsDb,
+                         RoomTable &eventsDb,
                          const std::string &room_id,
                          const std::vector<T> &events);
 
     template<class T>
     void saveStateEvent(lmdb::txn &txn,
-                        lmdb::dbi &statesdb,
+                        RoomTable &statesdb,
                         lmdb::dbi &stateskeydb,
                         lmdb::dbi &membersdb,
-                        lmdb::dbi &eventsDb,
+                        RoomTable &eventsDb,
                         const std::string &room_id,
                         const T &event);
 
@@ -386,30 +470,36 @@ private:
                       const std::set<std::string> &spaces_with_updates,
                       std::set<std::string> rooms_with_updates);
 
-    lmdb::dbi getEventsDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getEventsDb(lmdb::txn &txn, const std::string &room_id);
 
     lmdb::dbi getEventOrderDb(lmdb::txn &txn, const std::string &room_id);
 
     // inverse of EventOrderDb
-    lmdb::dbi getEventToOrderDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getEventToOrderDb(lmdb::txn &txn, const std::string &room_id);
 
-    lmdb::dbi getMessageToOrderDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getMessageToOrderDb(lmdb::txn &txn, const std::string &room_id);
 
     lmdb::dbi getOrderToMessageDb(lmdb::txn &txn, const std::string &room_id);
 
     lmdb::dbi getPendingMessagesDb(lmdb::txn &txn, const std::string &room_id);
 
-    lmdb::dbi getRelationsDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getRelationsDb(lmdb::txn &txn, const std::string &room_id);
+
+    //! Key of a megolm session in the inbound session and session data dbs: the number of the
+    //! room followed by the session id, so that the sessions of a room are stored next to each
+    //! other. Empty, if the room has no number yet, unless create is set.
+    std::optional<std::string>
+    megolmSessionKey(lmdb::txn &txn, const MegolmSessionIndex &index, bool create = false);
 
-    lmdb::dbi getInviteStatesDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getInviteStatesDb(lmdb::txn &txn, const std::string &room_id);
 
     lmdb::dbi getInviteMembersDb(lmdb::txn &txn, const std::string &room_id);
 
-    lmdb::dbi getStatesDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getStatesDb(lmdb::txn &txn, const std::string &room_id);
 
     lmdb::dbi getStatesKeyDb(lmdb::txn &txn, const std::string &room_id);
 
-    lmdb::dbi getAccountDataDb(lmdb::txn &txn, const std::string &room_id);
+    RoomTable getAccountDataDb(lmdb::txn &txn, const std::string &room_id);
 
     lmdb::dbi getMembersDb(lmdb::txn &txn, const std::string &room_id);
 
@@ -420,7 +510,13 @@ private:
     QString getDisplayName(const mtx::events::StateEvent<mtx::events::state::Member> &event);
 
     std::optional<VerificationCache> verificationCache(const std::string &user_id, lmdb::txn &txn);
-    VerificationStatus verificationStatus_(const std::string &user_id, lmdb::txn &txn);
+    VerificationStatus
+    verificationStatus_(const std::string &user_id, lmdb::txn &txn, uint64_t generation);
+    //! Verification status of several users, calculating the ones not in the cache in parallel.
+    //! The calculated ones are only cached, if the generation of the verification storage, read
+    //! before txn was started, is still current.
+    std::map<std::string, VerificationStatus> verificationStatuses_(
+      const std::vector<std::string> &user_ids, lmdb::txn &txn, uint64_t generation);
     std::optional<UserKeyCache> userKeys_(const std::string &user_id, lmdb::txn &txn);
 
     void setNextBatchToken(lmdb::txn &txn, const std::string &token);
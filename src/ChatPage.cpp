@@ -5,6 +5,7 @@
 #include <QApplication>
 #include <QInputDialog>
 #include <QMessageBox>
+#include <QThreadPool>
 
 #include <algorithm>
 #include <unordered_set>
@@ -92,6 +93,25 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QObject *parent)
                   lastSpacesUpdate = QDateTime::currentDateTime();
                   utils::updateSpaceVias();
                   utils::removeExpiredEvents();
+                  QThreadPool::globalInstance()->start([] {
+                      cache::client()->applyRetentionPolicies();
+
+                      auto retention = cache::client()->retentionStats();
+                      nhlog::db()->info("Retention since startup: {} events in {} rooms, about {} "
+                                        "bytes deleted",
+                                        retention.events,
+                                        retention.rooms,
+                                        retention.bytes);
+
+                      auto writes = cache::client()->writeQueueStats();
+                      nhlog::db()->info("Queued writes since startup: {} committed in {} batches, "
+                                        "{} dropped, {} pending, {}ms waiting for the write lock",
+                                        writes.writes,
+                                        writes.batches,
+                                        writes.failed,
+                                        writes.pending,
+                                        writes.lock_wait_us / 1000);
+                  });
               }
 
               if (!isConnected_)
@@ -586,6 +606,10 @@ ChatPage::bootstrap(QString userid, QString homeserver, QString token)
                 &Cache::newReadReceipts,
                 view_manager_,
                 &TimelineViewManager::updateReadReceipts);
+        connect(cache::client(),
+                &Cache::historyTrimmed,
+                view_manager_,
+                &TimelineViewManager::historyTrimmed);
 
         connect(cache::client(), &Cache::secretChanged, this, [this](const std::string &secret) {
             if (secret == mtx::secret_storage::secrets::megolm_backup_v1) {
@@ -747,20 +771,35 @@ ChatPage::startInitialSync()
             nhlog::net()->info("initial sync completed");
             try {
                 cache::client()->saveState(res);
-
-                olm::handle_to_device_messages(res.to_device.events);
-
-                emit initializeViews(std::move(res));
-
-                cache::calculateRoomReadStatus();
             } catch (const lmdb::error &e) {
                 nhlog::db()->error("failed to save state after initial sync: {}", e.what());
                 startInitialSync();
                 return;
             }
 
-            emit trySyncCb();
-            emit contentLoaded();
+            // the views are only loaded, once the room keys sent with the sync are stored
+            auto sync         = std::make_shared<mtx::responses::Sync>(res);
+            auto initializeUI = [this, sync] {
+                try {
+                    emit initializeViews(std::move(*sync));
+
+                    cache::calculateRoomReadStatus();
+                } catch (const lmdb::error &e) {
+                    nhlog::db()->error("failed to load state after initial sync: {}", e.what());
+                    startInitialSync();
+                    return;
+                }
+
+                emit trySyncCb();
+                emit contentLoaded();
+            };
+
+            try {
+                olm::handle_to_device_messages(res.to_device.events, initializeUI);
+            } catch (const lmdb::error &e) {
+                nhlog::db()->error("failed to handle to device messages: {}", e.what());
+                initializeUI();
+            }
         });
     });
 }
@@ -805,76 +844,104 @@ ChatPage::handleSyncResponse(const mtx::responses::Sync &res, const std::string
     // TODO: fine grained error handling
     try {
         cache::client()->saveState(res);
-        olm::handle_to_device_messages(res.to_device.events);
-
-        // reject forbidden invites
-        if (!res.rooms.invite.empty()) {
-            if (auto ev =
-                  cache::client()->getAccountData(mtx::events::EventType::NhekoInvitePermissions)) {
-                const auto &invitePerms = std::get<mtx::events::AccountDataEvent<
-                  mtx::events::account_data::nheko_extensions::InvitePermissions>>(*ev)
-                                            .content;
-
-                for (const auto &[roomid, invite] : res.rooms.invite) {
-                    std::string_view inviter = "";
-                    for (const auto &memberEv : invite.invite_state) {
-                        if (auto member =
-                              std::get_if<mtx::events::StrippedEvent<mtx::events::state::Member>>(
-                                &memberEv)) {
-                            if (member->content.membership ==
-                                  mtx::events::state::Membership::Invite &&
-                                member->state_key == http::client()->user_id().to_string()) {
-                                inviter = member->sender;
-                                break;
+    } catch (const lmdb::map_full_error &e) {
+        nhlog::db()->error("lmdb is full: {}", e.what());
+        // not on the sync thread, deleting can take a while
+        QThreadPool::globalInstance()->start([] { cache::deleteOldData(); });
+        scheduleNextSync();
+        return;
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("saving sync response: {}", e.what());
+        scheduleNextSync();
+        return;
+    }
+
+    // The timelines only get the sync, once the room keys sent with it are stored, so that they
+    // don't request the keys of its events.
+    auto sync = std::make_shared<mtx::responses::Sync>(res);
+    auto updateUI = [this, sync, oldIgnoredUsers = std::move(oldIgnoredUsers)] {
+        try {
+            // reject forbidden invites
+            if (!sync->rooms.invite.empty()) {
+                if (auto ev = cache::client()->getAccountData(
+                      mtx::events::EventType::NhekoInvitePermissions)) {
+                    const auto &invitePerms = std::get<mtx::events::AccountDataEvent<
+                      mtx::events::account_data::nheko_extensions::InvitePermissions>>(*ev)
+                                                .content;
+
+                    for (const auto &[roomid, invite] : sync->rooms.invite) {
+                        std::string_view inviter = "";
+                        for (const auto &memberEv : invite.invite_state) {
+                            if (auto member = std::get_if<
+                                  mtx::events::StrippedEvent<mtx::events::state::Member>>(
+                                  &memberEv)) {
+                                if (member->content.membership ==
+                                      mtx::events::state::Membership::Invite &&
+                                    member->state_key == http::client()->user_id().to_string()) {
+                                    inviter = member->sender;
+                                    break;
+                                }
                             }
                         }
-                    }
 
-                    if (!invitePerms.invite_allowed(roomid, inviter)) {
-                        leaveRoom(QString::fromStdString(roomid), "");
+                        if (!invitePerms.invite_allowed(roomid, inviter)) {
+                            leaveRoom(QString::fromStdString(roomid), "");
+                        }
                     }
                 }
             }
-        }
 
-        emit syncUI(std::move(res));
-
-        // if the ignored users changed, clear timeline of all affected rooms.
-        if (oldIgnoredUsers) {
-            if (auto newEv =
-                  cache::client()->getAccountData(mtx::events::EventType::IgnoredUsers)) {
-                std::vector<mtx::events::account_data::IgnoredUser> changedUsers{};
-                std::ranges::set_symmetric_difference(
-                  oldIgnoredUsers->users,
-                  std::get<mtx::events::AccountDataEvent<mtx::events::account_data::IgnoredUsers>>(
-                    *newEv)
-                    .content.users,
-                  std::back_inserter(changedUsers),
-                  {},
-                  &mtx::events::account_data::IgnoredUser::id,
-                  &mtx::events::account_data::IgnoredUser::id);
-
-                std::unordered_set<std::string> roomsToReload;
-                for (const auto &user : changedUsers) {
-                    auto commonRooms = cache::client()->getCommonRooms(user.id);
-                    for (const auto &room : commonRooms)
-                        roomsToReload.insert(room.first);
-                }
+            emit syncUI(std::move(*sync));
+
+            // if the ignored users changed, clear timeline of all affected rooms.
+            if (oldIgnoredUsers) {
+                if (auto newEv =
+                      cache::client()->getAccountData(mtx::events::EventType::IgnoredUsers)) {
+                    std::vector<mtx::events::account_data::IgnoredUser> changedUsers{};
+                    std::ranges::set_symmetric_difference(
+                      oldIgnoredUsers->users,
+                      std::get<
+                        mtx::events::AccountDataEvent<mtx::events::account_data::IgnoredUsers>>(
+                        *newEv)
+                        .content.users,
+                      std::back_inserter(changedUsers),
+                      {},
+                      &mtx::events::account_data::IgnoredUser::id,
+                      &mtx::events::account_data::IgnoredUser::id);
+
+                    std::unordered_set<std::string> roomsToReload;
+                    for (const auto &user : changedUsers) {
+                        auto commonRooms = cache::client()->getCommonRooms(user.id);
+                        for (const auto &room : commonRooms)
+                            roomsToReload.insert(room.first);
+                    }
 
-                for (const auto &room : roomsToReload) {
-                    if (auto model =
-                          view_manager_->rooms()->getRoomById(QString::fromStdString(room)))
-                        model->clearTimeline();
+                    for (const auto &room : roomsToReload) {
+                        if (auto model =
+                              view_manager_->rooms()->getRoomById(QString::fromStdString(room)))
+                            model->clearTimeline();
+                    }
                 }
             }
+        } catch (const lmdb::error &e) {
+            nhlog::db()->error("handling sync response: {}", e.what());
         }
-    } catch (const lmdb::map_full_error &e) {
-        nhlog::db()->error("lmdb is full: {}", e.what());
-        cache::deleteOldData();
+
+        scheduleNextSync();
+    };
+
+    try {
+        olm::handle_to_device_messages(res.to_device.events, updateUI);
     } catch (const lmdb::error &e) {
-        nhlog::db()->error("saving sync response: {}", e.what());
+        // the olm messages are handed off last, so they didn't take updateUI yet
+        nhlog::db()->error("handling to device messages: {}", e.what());
+        updateUI();
     }
+}
 
+void
+ChatPage::scheduleNextSync()
+{
     if (shouldThrottleSync())
         QTimer::singleShot(1000, this, &ChatPage::trySyncCb);
     else
@@ -1196,6 +1263,13 @@ ChatPage::receivedSessionKey(const std::string &room_id, const std::string &sess
     view_manager_->receivedSessionKey(room_id, session_id);
 }
 
+void
+ChatPage::receivedSessionKeys(const std::string &room_id,
+                              const std::vector<std::string> &session_ids)
+{
+    view_manager_->receivedSessionKeys(room_id, session_ids);
+}
+
 QString
 ChatPage::status() const
 {
@@ -1417,6 +1491,12 @@ ChatPage::getBackupVersion()
                   if (!oldBackupVersion || oldBackupVersion->version != data.version) {
                       view_manager_->rooms()->refetchOnlineKeyBackupKeys();
                   }
+
+                  // continue a full restore of the backup, which was interrupted
+                  if (auto restore = cache::client()->backupRestoreProgress();
+                      restore && !restore->finished && restore->version == data.version) {
+                      olm::download_full_keybackup();
+                  }
               } else {
                   nhlog::crypto()->info("Unsupported key backup algorithm: {}", res.algorithm);
                   cache::client()->deleteBackupVersion();
@@ -96,6 +96,9 @@ public slots:
     void unbanUser(const QString &room, QString userid, QString reason);
 
     void receivedSessionKey(const std::string &room_id, const std::string &session_id);
+    //! Notify a room once about a batch of sessions, i.e. from a backup restore.
+    void receivedSessionKeys(const std::string &room_id,
+                             const std::vector<std::string> &session_ids);
     void decryptDownloadedSecrets(mtx::secret_storage::AesHmacSha2KeyDescription keyDesc,
                                   const SecretsToDecrypt &secrets);
     void sendNotificationReply(const QString &roomid, const QString &eventid, const QString &body);
@@ -183,6 +186,8 @@ private:
     void startInitialSync();
     void tryInitialSync();
     void trySync();
+    //! Sync again, after a sync response was handled.
+    void scheduleNextSync();
     void verifyOneTimeKeyCountAfterStartup();
     void ensureOneTimeKeyCount(const std::map<std::string_view, uint16_t> &counts,
                                const std::optional<std::vector<std::string>> &fallback_keys);
@@ -66,8 +66,28 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
     const auto build_time = std::chrono::duration<double, std::milli>(end_at - start_at);
     nhlog::ui()->debug("CompletionProxyModel: build trie: {} ms", build_time.count());
 
+    init();
+}
+
+CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
+                                           SearchFunction search,
+                                           int max_mistakes,
+                                           size_t max_completions,
+                                           QObject *parent)
+  : QAbstractProxyModel(parent)
+  , search_(std::move(search))
+  , maxMistakes_(max_mistakes)
+  , max_completions_(max_completions)
+{
+    setSourceModel(model);
+    init();
+}
+
+void
+CompletionProxyModel::init()
+{
     // initialize default mapping
-    mapping.resize(std::min(max_completions_, static_cast<size_t>(model->rowCount())));
+    mapping.resize(std::min(max_completions_, static_cast<size_t>(sourceModel()->rowCount())));
     std::iota(mapping.begin(), mapping.end(), 0);
 
     connect(
@@ -86,8 +106,12 @@ CompletionProxyModel::invalidate()
 {
     auto key = searchString_.toUcs4();
     beginResetModel();
-    if (!key.empty()) // return default model data, if no search string
-        mapping = trie_.search(key, max_completions_, maxMistakes_);
+    if (!key.empty()) { // return default model data, if no search string
+        if (search_)
+            mapping = search_(searchString_, max_completions_, maxMistakes_);
+        else
+            mapping = trie_.search(key, max_completions_, maxMistakes_);
+    }
     endResetModel();
 }
 
@@ -9,7 +9,12 @@
 #include <QAbstractProxyModel>
 
 #include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <numeric>
 #include <span>
+#include <vector>
 
 enum class ElementRank
 {
@@ -17,147 +22,234 @@ enum class ElementRank
     second
 };
 
+//! Search index for completions. Entries are collected by insert() and compiled into a flat
+//! trie on the first search after an insert. Each node stores its children as a sorted,
+//! contiguous range of the node array, so lookups are binary searches over adjacent memory.
 template<typename Key, typename Value>
 struct trie
 {
-    std::vector<std::pair<ElementRank, Value>> values;
-    std::map<Key, trie> next;
-
     template<ElementRank r>
     void insert(const QVector<Key> &keys, const Value &v)
     {
-        auto t = this;
-        for (const auto k : keys) {
-            t = &t->next[k];
-        }
-
-        if constexpr (r == ElementRank::first) {
-            auto it =
-              std::ranges::upper_bound(t->values, r, {}, &std::pair<ElementRank, Value>::first);
-            t->values.emplace(it, r, v);
-        } else if constexpr (r == ElementRank::second) {
-            t->values.emplace_back(r, v);
-        }
+        entries.push_back(Entry{std::vector<Key>(keys.begin(), keys.end()), r, v});
+        dirty = true;
     }
 
     std::vector<Value> valuesAndSubvalues(size_t limit = -1) const
     {
-        std::vector<Value> ret;
-        if (limit < 200)
-            ret.reserve(limit);
-
-        for (const auto &v : values) {
-            if (ret.size() >= limit)
-                return ret;
-            else
-                ret.push_back(v.second);
-        }
+        build();
 
-        for (const auto &[k, t] : next) {
-            (void)k;
-            if (ret.size() >= limit)
-                return ret;
-            else {
-                auto temp = t.valuesAndSubvalues(limit - ret.size());
-                for (auto &&v : temp) {
-                    if (ret.size() >= limit)
-                        return ret;
-
-                    if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                        ret.push_back(std::move(v));
-                    }
-                }
-            }
-        }
-
-        return ret;
+        Results results(*this, limit);
+        if (!nodes.empty())
+            results.collect(0);
+        return std::move(results.ret);
     }
 
     std::vector<Value> search(const std::span<Key> &keys,
                               size_t result_count_limit,
-                              size_t max_edit_distance_ = 2) const
+                              size_t max_edit_distance = 2) const
     {
-        std::vector<Value> ret;
-        if (!result_count_limit)
-            return ret;
+        build();
 
-        if (keys.empty())
-            return valuesAndSubvalues(result_count_limit);
+        Results results(*this, result_count_limit);
+        if (!result_count_limit || nodes.empty())
+            return results.ret;
 
-        auto append = [&ret, result_count_limit](std::vector<Value> &&in) {
-            for (auto &&v : in) {
-                if (ret.size() >= result_count_limit)
-                    return;
+        if (keys.empty()) {
+            results.collect(0);
+            return std::move(results.ret);
+        }
 
-                if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                    ret.push_back(std::move(v));
-                }
-            }
-        };
-
-        auto limit = [&ret, result_count_limit] {
-            return std::min(result_count_limit, (result_count_limit - ret.size()) * 2);
-        };
-
-        // Try first exact matches, then with maximum errors
-        for (size_t max_edit_distance = 0;
-             max_edit_distance <= max_edit_distance_ && ret.size() < result_count_limit;
-             max_edit_distance += 1) {
-            if (max_edit_distance && ret.size() < result_count_limit) {
-                max_edit_distance -= 1;
-
-                // swap chars case
-                if (keys.size() >= 2) {
-                    auto t = this;
-                    for (int i = 1; i >= 0; i--) {
-                        if (auto e = t->next.find(keys[i]); e != t->next.end()) {
-                            t = &e->second;
-                        } else {
-                            t = nullptr;
-                            break;
-                        }
-                    }
-
-                    if (t) {
-                        append(t->search(keys.subspan(2), limit(), max_edit_distance));
-                    }
-                }
-
-                // insert case
-                for (const auto &[k, t] : this->next) {
-                    if (k == keys[0])
-                        continue;
-                    if (ret.size() >= limit())
-                        break;
-
-                    // insert
-                    append(t.search(keys, limit(), max_edit_distance));
-                }
-
-                // delete character case
-                append(this->search(keys.subspan(1), limit(), max_edit_distance));
-
-                // substitute case
-                for (const auto &[k, t] : this->next) {
-                    if (k == keys[0])
-                        continue;
-                    if (ret.size() >= limit())
-                        break;
-
-                    // substitute
-                    append(t.search(keys.subspan(1), limit(), max_edit_distance));
-                }
-
-                max_edit_distance += 1;
+        // Walk the trie while maintaining the rows of the (restricted Damerau-) Levenshtein
+        // matrix of the search term and the current path. The rows are stored in one buffer,
+        // that is allocated once per search. Exact matches are collected first, then the ones
+        // with one mistake and so on.
+        const size_t width = keys.size() + 1;
+        std::vector<size_t> rows(width * (maxDepth + 1));
+        for (size_t i = 0; i < width; i++)
+            rows[i] = i;
+
+        for (size_t distance = 0; distance <= max_edit_distance && !results.full(); distance++)
+            searchNode(0, 0, 0, keys, rows, distance, results);
+
+        return std::move(results.ret);
+    }
+
+private:
+    struct Entry
+    {
+        std::vector<Key> keys;
+        ElementRank rank;
+        Value value;
+    };
+    struct Node
+    {
+        Key key{};
+        std::uint32_t childBegin = 0, childEnd = 0;
+        std::uint32_t valueBegin = 0, valueEnd = 0;
+    };
+
+    //! Deduplicating result list, that uses a bitset over the value ids.
+    struct Results
+    {
+        Results(const trie &t_, size_t limit_)
+          : t(t_)
+          , seen((t_.distinctValues.size() + 63) / 64)
+          , limit(limit_)
+        {
+            if (limit < 200)
+                ret.reserve(limit);
+        }
+
+        bool full() const { return ret.size() >= limit; }
+
+        void add(std::uint32_t id)
+        {
+            auto &word = seen[id / 64];
+            auto bit   = std::uint64_t{1} << (id % 64);
+            if (!(word & bit)) {
+                word |= bit;
+                ret.push_back(t.distinctValues[id]);
             }
+        }
 
-            if (auto e = this->next.find(keys[0]); e != this->next.end()) {
-                append(e->second.search(keys.subspan(1), limit(), max_edit_distance));
+        //! Add the values of a node and all nodes below it.
+        void collect(std::uint32_t node)
+        {
+            const auto &n = t.nodes[node];
+            for (auto v = n.valueBegin; v < n.valueEnd && !full(); v++)
+                add(t.values[v]);
+            for (auto c = n.childBegin; c < n.childEnd && !full(); c++)
+                collect(c);
+        }
+
+        const trie &t;
+        std::vector<std::uint64_t> seen;
+        std::vector<Value> ret;
+        size_t limit;
+    };
+
+    void searchNode(std::uint32_t node,
+                    size_t depth,
+                    Key parentKey,
+                    const std::span<Key> &keys,
+                    std::vector<size_t> &rows,
+                    size_t distance,
+                    Results &results) const
+    {
+        const size_t width = keys.size() + 1;
+        const size_t *row  = &rows[depth * width];
+
+        // The whole search term matches the path to this node, so everything below matches.
+        if (row[keys.size()] <= distance) {
+            results.collect(node);
+            return;
+        }
+
+        const auto &n = nodes[node];
+        for (auto c = n.childBegin; c < n.childEnd && !results.full(); c++) {
+            const Key k    = nodes[c].key;
+            size_t *next   = &rows[(depth + 1) * width];
+            next[0]        = depth + 1;
+            size_t rowBest = next[0];
+            for (size_t i = 1; i < width; i++) {
+                next[i] =
+                  std::min({row[i] + 1, next[i - 1] + 1, row[i - 1] + (keys[i - 1] != k)});
+                // swapped characters
+                if (depth >= 1 && i >= 2 && keys[i - 1] == parentKey && keys[i - 2] == k)
+                    next[i] = std::min(next[i], rows[(depth - 1) * width + i - 2] + 1);
+                rowBest = std::min(rowBest, next[i]);
             }
+
+            if (rowBest <= distance)
+                searchNode(c, depth + 1, k, keys, rows, distance, results);
+        }
+    }
+
+    //! Compile the inserted entries into the flat trie.
+    void build() const
+    {
+        if (!dirty)
+            return;
+        dirty = false;
+
+        nodes.clear();
+        values.clear();
+        distinctValues.clear();
+        maxDepth = 0;
+
+        std::map<Value, std::uint32_t> valueIds;
+        std::vector<std::uint32_t> entryValueIds(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            auto [it, inserted] = valueIds.try_emplace(
+              entries[i].value, static_cast<std::uint32_t>(distinctValues.size()));
+            if (inserted)
+                distinctValues.push_back(entries[i].value);
+            entryValueIds[i] = it->second;
+            maxDepth         = std::max(maxDepth, entries[i].keys.size());
         }
 
-        return ret;
+        // Sort by keys, then rank. Insertion order is kept otherwise.
+        std::vector<std::uint32_t> order(entries.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::ranges::stable_sort(order, [this](std::uint32_t a, std::uint32_t b) {
+            if (entries[a].keys != entries[b].keys)
+                return entries[a].keys < entries[b].keys;
+            return entries[a].rank < entries[b].rank;
+        });
+
+        nodes.emplace_back();
+        buildNode(0, order, 0, order.size(), 0, entryValueIds);
     }
+
+    void buildNode(std::uint32_t node,
+                   const std::vector<std::uint32_t> &order,
+                   size_t begin,
+                   size_t end,
+                   size_t depth,
+                   const std::vector<std::uint32_t> &entryValueIds) const
+    {
+        // entries ending at this node sort first
+        nodes[node].valueBegin = static_cast<std::uint32_t>(values.size());
+        while (begin < end && entries[order[begin]].keys.size() == depth)
+            values.push_back(entryValueIds[order[begin++]]);
+        nodes[node].valueEnd = static_cast<std::uint32_t>(values.size());
+
+        // allocate all children next to each other first, then fill them
+        std::vector<std::pair<size_t, size_t>> childRanges;
+        for (size_t i = begin; i < end;) {
+            const Key k = entries[order[i]].keys[depth];
+            size_t j    = i + 1;
+            while (j < end && entries[order[j]].keys[depth] == k)
+                j++;
+            childRanges.emplace_back(i, j);
+            i = j;
+        }
+
+        nodes[node].childBegin = static_cast<std::uint32_t>(nodes.size());
+        for (const auto &[b, e] : childRanges) {
+            (void)e;
+            nodes.emplace_back().key = entries[order[b]].keys[depth];
+        }
+        nodes[node].childEnd = static_cast<std::uint32_t>(nodes.size());
+
+        for (size_t c = 0; c < childRanges.size(); c++)
+            buildNode(nodes[node].childBegin + static_cast<std::uint32_t>(c),
+                      order,
+                      childRanges[c].first,
+                      childRanges[c].second,
+                      depth + 1,
+                      entryValueIds);
+    }
+
+    std::vector<Entry> entries;
+
+    mutable bool dirty = false;
+    mutable std::vector<Node> nodes;
+    //! value ids of all nodes, each node owns a contiguous range
+    mutable std::vector<std::uint32_t> values;
+    mutable std::vector<Value> distinctValues;
+    mutable size_t maxDepth = 0;
 };
 
 class CompletionProxyModel final : public QAbstractProxyModel
@@ -165,7 +257,17 @@ class CompletionProxyModel final : public QAbstractProxyModel
     Q_OBJECT
     Q_PROPERTY(QString searchString READ searchString WRITE setSearchString NOTIFY newSearchString)
 public:
+    //! Searches the source model and returns the matching rows, ranked by relevance.
+    using SearchFunction =
+      std::function<std::vector<int>(const QString &term, size_t limit, size_t max_mistakes)>;
+
+    CompletionProxyModel(QAbstractItemModel *model,
+                         int max_mistakes       = 2,
+                         size_t max_completions = 30,
+                         QObject *parent        = nullptr);
+    //! Use an existing search index of the source model instead of building a trie.
     CompletionProxyModel(QAbstractItemModel *model,
+                         SearchFunction search,
                          int max_mistakes       = 2,
                          size_t max_completions = 30,
                          QObject *parent        = nullptr);
@@ -193,8 +295,11 @@ signals:
     void newSearchString(QString);
 
 private:
+    void init();
+
     QString searchString_;
     trie<uint, int> trie_;
+    SearchFunction search_;
     std::vector<int> mapping;
     int maxMistakes_;
     size_t max_completions_;
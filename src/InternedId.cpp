@@ -0,0 +1,60 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "InternedId.h"
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include <QHash>
+
+InternedId::InternedId(std::string_view id)
+  : d(intern(id))
+{
+}
+
+InternedId::InternedId(const QString &id)
+  : d(intern(id.toStdString()))
+{
+}
+
+const std::string &
+InternedId::str() const
+{
+    static const std::string empty;
+    return d ? d->str : empty;
+}
+
+const QString &
+InternedId::qstr() const
+{
+    static const QString empty;
+    return d ? d->qstr : empty;
+}
+
+const InternedId::Data *
+InternedId::intern(std::string_view id)
+{
+    static std::shared_mutex mtx;
+    // the keys point into the strings owned by the values
+    static std::unordered_map<std::string_view, std::unique_ptr<const Data>> table;
+
+    {
+        std::shared_lock lock(mtx);
+        if (auto it = table.find(id); it != table.end())
+            return it->second.get();
+    }
+
+    auto data = std::make_unique<const Data>(Data{
+      .str  = std::string(id),
+      .qstr = QString::fromUtf8(id.data(), static_cast<qsizetype>(id.size())),
+      .hash = qHashBits(id.data(), id.size()),
+    });
+
+    std::unique_lock lock(mtx);
+    auto [it, inserted] = table.try_emplace(data->str, std::move(data));
+    return it->second.get();
+}
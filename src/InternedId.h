@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include <QString>
+
+//! Handle to an interned Matrix identifier, like a room or user id. Every identifier is stored only
+//! once for the lifetime of the process, so handles are the size of a pointer, are compared by
+//! address and carry a precomputed hash. Event ids should not be interned, since there is no bound
+//! on how many of them are seen.
+class InternedId
+{
+public:
+    InternedId() = default;
+    explicit InternedId(std::string_view id);
+    explicit InternedId(const QString &id);
+
+    const std::string &str() const;
+    const QString &qstr() const;
+
+    friend bool operator==(InternedId a, InternedId b) noexcept { return a.d == b.d; }
+    friend size_t qHash(InternedId id, size_t seed = 0) noexcept
+    {
+        return id.d ? id.d->hash ^ seed : seed;
+    }
+
+private:
+    struct Data
+    {
+        std::string str;
+        QString qstr;
+        size_t hash;
+    };
+
+    static const Data *intern(std::string_view id);
+
+    const Data *d = nullptr;
+};
+
+template<>
+struct std::hash<InternedId>
+{
+    size_t operator()(InternedId id) const noexcept { return qHash(id); }
+};
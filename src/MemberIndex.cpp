@@ -0,0 +1,229 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MemberIndex.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include <QTextBoundaryFinder>
+
+namespace {
+//! Edit distance between term and the closest prefix of key. Returns max_distance + 1, if it is
+//! bigger than max_distance.
+std::size_t
+prefixDistance(QStringView term, QStringView key, std::size_t max_distance)
+{
+    key = key.left(term.size() + max_distance);
+
+    std::vector<std::size_t> prev(key.size() + 1), cur(key.size() + 1);
+    for (std::size_t j = 0; j < prev.size(); j++)
+        prev[j] = j;
+
+    for (qsizetype i = 1; i <= term.size(); i++) {
+        cur[0]              = static_cast<std::size_t>(i);
+        std::size_t rowBest = cur[0];
+        for (qsizetype j = 1; j <= key.size(); j++) {
+            cur[j]  = std::min({prev[j] + 1,
+                               cur[j - 1] + 1,
+                               prev[j - 1] + (term[i - 1] == key[j - 1] ? 0 : 1)});
+            rowBest = std::min(rowBest, cur[j]);
+        }
+
+        if (rowBest > max_distance)
+            return max_distance + 1;
+        std::swap(prev, cur);
+    }
+
+    return std::min(*std::ranges::min_element(prev), max_distance + 1);
+}
+}
+
+QString
+MemberIndex::normalize(const QString &str)
+{
+    return str.normalized(QString::NormalizationForm_KD).toCaseFolded();
+}
+
+std::vector<MemberIndex::Entry>::iterator
+MemberIndex::lowerBound(std::string_view user_id)
+{
+    return std::ranges::lower_bound(members_, user_id, {}, &Entry::user_id);
+}
+
+std::vector<MemberIndex::Entry>::const_iterator
+MemberIndex::find(std::string_view user_id) const
+{
+    auto it = std::ranges::lower_bound(members_, user_id, {}, &Entry::user_id);
+    return it != members_.end() && it->user_id == user_id ? it : members_.end();
+}
+
+void
+MemberIndex::insertKeys(Entry &entry)
+{
+    const auto &user_id = entry.user_id;
+    auto insert         = [this, &user_id, &entry](const QString &str) {
+        auto key = normalize(str);
+        if (key.isEmpty())
+            return;
+
+        keys_.emplace(key, std::pair{Rank::Full, user_id});
+        entry.keys.push_back(key);
+
+        QTextBoundaryFinder finder(QTextBoundaryFinder::BoundaryType::Word, key);
+        finder.toStart();
+        do {
+            auto start = finder.position();
+            finder.toNextBoundary();
+            auto end = finder.position();
+
+            auto part = QStringView(key).mid(start, end - start).trimmed();
+            // the first word is already covered by the full key, separators like "@" or ":" are
+            // not worth searching for
+            if (start != 0 &&
+                std::ranges::any_of(part, [](QChar c) { return c.isLetterOrNumber(); })) {
+                keys_.emplace(part.toString(), std::pair{Rank::Part, user_id});
+                entry.keys.push_back(part.toString());
+            }
+        } while (finder.position() < key.size() && finder.position() != -1);
+    };
+
+    insert(entry.member.display_name);
+    insert(entry.member.user_id);
+}
+
+void
+MemberIndex::removeKeys(const Entry &entry)
+{
+    for (const auto &key : entry.keys) {
+        auto [begin, end] = keys_.equal_range(key);
+        for (auto it = begin; it != end; ++it) {
+            if (it->second.second == entry.user_id) {
+                keys_.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+void
+MemberIndex::upsert(const std::string &user_id, const MemberInfo &info)
+{
+    std::lock_guard lock(mtx);
+
+    auto it = lowerBound(user_id);
+    if (it == members_.end() || it->user_id != user_id) {
+        it          = members_.insert(it, Entry{});
+        it->user_id = user_id;
+    }
+
+    auto &entry = *it;
+    removeKeys(entry);
+    entry.keys.clear();
+
+    entry.member = RoomMember{
+      QString::fromStdString(user_id),
+      QString::fromStdString(info.name),
+      QString::fromStdString(info.avatar_url),
+      info.is_direct,
+    };
+    insertKeys(entry);
+}
+
+void
+MemberIndex::remove(const std::string &user_id)
+{
+    std::lock_guard lock(mtx);
+
+    auto it = lowerBound(user_id);
+    if (it == members_.end() || it->user_id != user_id)
+        return;
+
+    removeKeys(*it);
+    members_.erase(it);
+}
+
+std::size_t
+MemberIndex::size() const
+{
+    std::lock_guard lock(mtx);
+    return members_.size();
+}
+
+std::vector<RoomMember>
+MemberIndex::members(std::size_t start, std::size_t len) const
+{
+    std::lock_guard lock(mtx);
+
+    std::vector<RoomMember> ret;
+    if (start >= members_.size())
+        return ret;
+
+    auto count = std::min(len, members_.size() - start);
+    ret.reserve(count);
+
+    auto begin = members_.begin() + static_cast<std::ptrdiff_t>(start);
+    for (auto it = begin; it != begin + static_cast<std::ptrdiff_t>(count); ++it)
+        ret.push_back(it->member);
+
+    return ret;
+}
+
+std::vector<QString>
+MemberIndex::search(const QString &term, std::size_t limit, std::size_t max_mistakes) const
+{
+    std::vector<QString> ret;
+    if (!limit)
+        return ret;
+
+    auto key = normalize(term);
+
+    std::lock_guard lock(mtx);
+
+    std::unordered_set<std::string_view> seen;
+    auto append = [&ret, &seen, this](const std::string &user_id) {
+        if (seen.insert(user_id).second)
+            ret.push_back(find(user_id)->member.user_id);
+    };
+
+    // exact prefix matches, full texts first, then parts of them
+    for (auto rank : {Rank::Full, Rank::Part}) {
+        for (auto it = keys_.lower_bound(key); it != keys_.end() && it->first.startsWith(key);
+             ++it) {
+            if (it->second.first != rank)
+                continue;
+
+            append(it->second.second);
+            if (ret.size() >= limit)
+                return ret;
+        }
+    }
+
+    if (!max_mistakes || key.isEmpty())
+        return ret;
+
+    // fuzzy matches, ordered by their distance
+    std::vector<std::vector<const std::string *>> byDistance(max_mistakes + 1);
+    const QString *lastKey   = nullptr;
+    std::size_t lastDistance = 0;
+    for (const auto &[k, v] : keys_) {
+        if (!lastKey || *lastKey != k) {
+            lastKey      = &k;
+            lastDistance = prefixDistance(key, k, max_mistakes);
+        }
+
+        if (lastDistance > 0 && lastDistance <= max_mistakes)
+            byDistance[lastDistance].push_back(&v.second);
+    }
+
+    for (const auto &candidates : byDistance) {
+        for (const auto *user_id : candidates) {
+            append(*user_id);
+            if (ret.size() >= limit)
+                return ret;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <QString>
+
+#include "CacheStructs.h"
+
+//! In memory index of the joined and invited members of a room, which allows prefix and fuzzy
+//! searches over their names and mxids. It is built once from the members db and then kept up to
+//! date with the member events, that are stored in the cache, so that completers and member lists
+//! don't need to reload and reparse all members of a room every time they are opened.
+class MemberIndex
+{
+public:
+    //! Insert or update a member.
+    void upsert(const std::string &user_id, const MemberInfo &info);
+    //! Remove a member, i.e. because they left.
+    void remove(const std::string &user_id);
+
+    std::size_t size() const;
+    //! Members sorted by mxid, starting at the start-th member. Seeking to start is constant time,
+    //! so paging through the list doesn't get slower for later pages.
+    std::vector<RoomMember> members(std::size_t start = 0, std::size_t len = -1) const;
+    //! Mxids of members, whose name or mxid start with the search term, followed by the ones,
+    //! where only a word of it does. If there are not enough results, this is followed by members
+    //! within max_mistakes edits of the search term.
+    std::vector<QString>
+    search(const QString &term, std::size_t limit, std::size_t max_mistakes = 2) const;
+
+    //! The form search keys and search terms are normalized to.
+    static QString normalize(const QString &str);
+
+private:
+    struct Entry
+    {
+        std::string user_id;
+        RoomMember member;
+        std::vector<QString> keys;
+    };
+
+    enum class Rank
+    {
+        Full,
+        Part,
+    };
+
+    void insertKeys(Entry &entry);
+    void removeKeys(const Entry &entry);
+    std::vector<Entry>::iterator lowerBound(std::string_view user_id);
+    std::vector<Entry>::const_iterator find(std::string_view user_id) const;
+
+    mutable std::mutex mtx;
+    //! sorted by mxid, so that offsets can be looked up directly
+    std::vector<Entry> members_;
+    //! normalized key -> (rank, mxid)
+    std::multimap<QString, std::pair<Rank, std::string>> keys_;
+};
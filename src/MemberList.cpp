@@ -8,6 +8,7 @@
 #include "Cache_p.h"
 #include "ChatPage.h"
 #include "Logging.h"
+#include "MemberIndex.h"
 #include "timeline/RoomlistModel.h"
 #include "timeline/TimelineModel.h"
 #include "timeline/TimelineViewManager.h"
@@ -28,7 +29,7 @@ MemberListBackend::MemberListBackend(const QString &room_id, QObject *parent)
 
     try {
         // HACK: due to QTBUG-1020169, we'll load a big chunk to speed things up
-        auto members = cache::getMembers(room_id_.toStdString(), 0, -1);
+        auto members = cache::client()->memberIndex(room_id_.toStdString())->members();
         addUsers(members);
         numUsersLoaded_ = (int)members.size();
     } catch (const lmdb::error &e) {
@@ -49,7 +50,12 @@ MemberListBackend::addUsers(const std::vector<RoomMember> &members)
       QModelIndex{}, m_memberList.count(), m_memberList.count() + (int)members.size() - 1);
 
     for (const auto &member : members)
-        m_memberList.push_back({member, thisRoom->avatarUrl(member.user_id)});
+        m_memberList.push_back({
+          member,
+          thisRoom->avatarUrl(member.user_id),
+          powerLevels_.user_level(member.user_id.toStdString()),
+          member.display_name.toCaseFolded(),
+        });
 
     endInsertRows();
 }
@@ -74,14 +80,14 @@ MemberListBackend::data(const QModelIndex &index, int role) const
 
     switch (role) {
     case Mxid:
-        return m_memberList[index.row()].first.user_id;
+        return m_memberList[index.row()].member.user_id;
     case DisplayName:
-        return m_memberList[index.row()].first.display_name;
+        return m_memberList[index.row()].member.display_name;
     case AvatarUrl:
-        return m_memberList[index.row()].second;
+        return m_memberList[index.row()].avatarUrl;
     case Trustlevel: {
         auto stat =
-          cache::verificationStatus(m_memberList[index.row()].first.user_id.toStdString());
+          cache::verificationStatus(m_memberList[index.row()].member.user_id.toStdString());
 
         if (!stat)
             return crypto::Unverified;
@@ -91,8 +97,7 @@ MemberListBackend::data(const QModelIndex &index, int role) const
             return stat->user_verified;
     }
     case Powerlevel:
-        return static_cast<qlonglong>(
-          powerLevels_.user_level(m_memberList[index.row()].first.user_id.toStdString()));
+        return static_cast<qlonglong>(m_memberList[index.row()].powerlevel);
     default:
         return {};
     }
@@ -114,7 +119,7 @@ MemberListBackend::fetchMore(const QModelIndex &)
     loadingMoreMembers_ = true;
     emit loadingMoreMembersChanged();
 
-    auto members = cache::getMembers(room_id_.toStdString(), rowCount());
+    auto members = cache::client()->memberIndex(room_id_.toStdString())->members(rowCount(), 30);
     addUsers(members);
     numUsersLoaded_ += (int)members.size();
     emit numUsersLoadedChanged();
@@ -166,10 +171,32 @@ MemberList::sortBy(const MemberSortRoles role)
 bool
 MemberList::filterAcceptsRow(int source_row, const QModelIndex &) const
 {
-    return m_model.m_memberList[source_row].first.user_id.contains(filterString,
-                                                                   Qt::CaseInsensitive) ||
-           m_model.m_memberList[source_row].first.display_name.contains(filterString,
-                                                                        Qt::CaseInsensitive);
+    return m_model.m_memberList[source_row].member.user_id.contains(filterString,
+                                                                    Qt::CaseInsensitive) ||
+           m_model.m_memberList[source_row].member.display_name.contains(filterString,
+                                                                         Qt::CaseInsensitive);
+}
+
+bool
+MemberList::lessThan(const QModelIndex &source_left, const QModelIndex &source_right) const
+{
+    const auto &left  = m_model.m_memberList[source_left.row()];
+    const auto &right = m_model.m_memberList[source_right.row()];
+
+    switch (sortRole()) {
+    case MemberSortRoles::Powerlevel:
+        if (left.powerlevel != right.powerlevel)
+            return left.powerlevel < right.powerlevel;
+        break;
+    case MemberSortRoles::DisplayName:
+        if (left.sortName != right.sortName)
+            return left.sortName < right.sortName;
+        break;
+    default:
+        break;
+    }
+
+    return left.member.user_id < right.member.user_id;
 }
 
 #include "moc_MemberList.cpp"
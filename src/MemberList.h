@@ -66,7 +66,16 @@ protected:
     void fetchMore(const QModelIndex &) override;
 
 private:
-    QVector<QPair<RoomMember, QString>> m_memberList;
+    struct Member
+    {
+        RoomMember member;
+        QString avatarUrl;
+        //! sort keys, precomputed so that sorting doesn't need to look them up per comparison
+        int64_t powerlevel;
+        QString sortName;
+    };
+
+    QVector<Member> m_memberList;
     QString room_id_;
     RoomInfo info_;
     int numUsersLoaded_{0};
@@ -122,6 +131,7 @@ public slots:
 
 protected:
     bool filterAcceptsRow(int source_row, const QModelIndex &source_parent) const override;
+    bool lessThan(const QModelIndex &source_left, const QModelIndex &source_right) const override;
 
 private:
     QString filterString;
@@ -8,11 +8,16 @@
 #include <QFontDatabase>
 #include <QInputDialog>
 #include <QMessageBox>
+#include <QPointer>
+#include <QProgressDialog>
 #include <QStandardPaths>
 #include <QString>
-#include <QTextStream>
+#include <QThreadPool>
 #include <mtx/secret_storage.hpp>
 
+#include <atomic>
+#include <memory>
+
 #include "Cache.h"
 #include "JdenticonProvider.h"
 #include "MainWindow.h"
@@ -2147,6 +2152,39 @@ UserSettingsModel::setData(const QModelIndex &index, const QVariant &value, int
     return false;
 }
 
+namespace {
+//! Progress dialog for a session key export or import running on a worker thread. The returned
+//! function reports the progress to it and returns false, once the user cancelled.
+std::pair<QPointer<QProgressDialog>, SessionKeysProgress>
+sessionKeysProgressDialog(QObject *context, const QString &label)
+{
+    auto dialog = new QProgressDialog(label, QObject::tr("Cancel"), 0, 0);
+    dialog->setWindowModality(Qt::ApplicationModal);
+    dialog->setMinimumDuration(500);
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
+
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    QObject::connect(
+      dialog, &QProgressDialog::canceled, dialog, [cancelled] { *cancelled = true; });
+
+    QPointer<QProgressDialog> ptr = dialog;
+    auto progress                 = [context, ptr, cancelled](std::size_t done, std::size_t total) {
+        QMetaObject::invokeMethod(
+          context,
+          [ptr, done, total] {
+              if (ptr) {
+                  ptr->setMaximum(static_cast<int>(total));
+                  ptr->setValue(static_cast<int>(done));
+              }
+          },
+          Qt::QueuedConnection);
+        return !*cancelled;
+    };
+
+    return {ptr, progress};
+}
+}
+
 void
 UserSettingsModel::importSessionKeys()
 {
@@ -2154,14 +2192,8 @@ UserSettingsModel::importSessionKeys()
     const QString fileName   = QFileDialog::getOpenFileName(
       nullptr, tr("Open Sessions File"), homeFolder, QLatin1String(""));
 
-    QFile file(fileName);
-    if (!file.open(QIODevice::ReadOnly)) {
-        QMessageBox::warning(nullptr, tr("Error"), file.errorString());
+    if (fileName.isEmpty())
         return;
-    }
-
-    auto bin     = file.peek(file.size());
-    auto payload = std::string(bin.data(), bin.size());
 
     bool ok;
     auto password = QInputDialog::getText(nullptr,
@@ -2178,12 +2210,41 @@ UserSettingsModel::importSessionKeys()
         return;
     }
 
-    try {
-        auto sessions = mtx::crypto::decrypt_exported_sessions(payload, password.toStdString());
-        cache::importSessionKeys(std::move(sessions));
-    } catch (const std::exception &e) {
-        QMessageBox::warning(nullptr, tr("Error"), e.what());
-    }
+    // Decrypting and storing hundreds of thousands of sessions takes a while, so it happens on a
+    // worker thread, while a progress dialog allows cancelling it.
+    auto [dialog, progress] = sessionKeysProgressDialog(this, tr("Importing session keys..."));
+    QThreadPool::globalInstance()->start([this,
+                                          dialog   = dialog,
+                                          progress = progress,
+                                          fileName,
+                                          password = password.toStdString()] {
+        QString error;
+        try {
+            QFile file(fileName);
+            if (!file.open(QIODevice::ReadOnly)) {
+                error = file.errorString();
+            } else {
+                auto sessions = [&file, &password] {
+                    auto bin = file.readAll();
+                    return mtx::crypto::decrypt_exported_sessions(
+                      std::string(bin.data(), bin.size()), password);
+                }();
+                cache::importSessionKeys(sessions, progress);
+            }
+        } catch (const std::exception &e) {
+            error = QString::fromUtf8(e.what());
+        }
+
+        QMetaObject::invokeMethod(
+          this,
+          [dialog, error] {
+              if (dialog)
+                  dialog->close();
+              if (!error.isEmpty())
+                  QMessageBox::warning(nullptr, tr("Error"), error);
+          },
+          Qt::QueuedConnection);
+    });
 }
 void
 UserSettingsModel::exportSessionKeys()
@@ -2223,28 +2284,52 @@ UserSettingsModel::exportSessionKeys()
     const QString fileName   = QFileDialog::getSaveFileName(
       nullptr, tr("File to save the exported session keys"), homeFolder);
 
-    QFile file(fileName);
-    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-        QMessageBox::warning(nullptr, tr("Error"), file.errorString());
-        return;
-    }
-
-    // Export sessions & save to file.
-    try {
-        auto encrypted_blob = mtx::crypto::encrypt_exported_sessions(cache::exportSessionKeys(),
-                                                                     password.toStdString());
-
-        QString b64 = QString::fromStdString(mtx::crypto::bin2base64(encrypted_blob));
-
-        QString prefix(QStringLiteral("-----BEGIN MEGOLM SESSION DATA-----"));
-        QString suffix(QStringLiteral("-----END MEGOLM SESSION DATA-----"));
-        QString newline(QStringLiteral("\n"));
-        QTextStream out(&file);
-        out << prefix << newline << b64 << newline << suffix << newline;
-        file.close();
-    } catch (const std::exception &e) {
-        QMessageBox::warning(nullptr, tr("Error"), e.what());
-    }
+    if (fileName.isEmpty())
+        return;
+
+    // Export sessions & save to file on a worker thread.
+    auto [dialog, progress] = sessionKeysProgressDialog(this, tr("Exporting session keys..."));
+    QThreadPool::globalInstance()->start([this,
+                                          dialog   = dialog,
+                                          progress = progress,
+                                          fileName,
+                                          password = password.toStdString()] {
+        QString error;
+        try {
+            // only keep one copy of the sessions around at a time
+            std::string encrypted_blob;
+            if (auto keys = cache::exportSessionKeys(progress))
+                encrypted_blob = mtx::crypto::encrypt_exported_sessions(*keys, password);
+
+            if (!encrypted_blob.empty()) {
+                QFile file(fileName);
+                if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+                    error = file.errorString();
+                } else {
+                    auto b64 = mtx::crypto::bin2base64(encrypted_blob);
+                    encrypted_blob.clear();
+                    encrypted_blob.shrink_to_fit();
+
+                    file.write("-----BEGIN MEGOLM SESSION DATA-----\n");
+                    file.write(b64.data(), static_cast<qint64>(b64.size()));
+                    file.write("\n-----END MEGOLM SESSION DATA-----\n");
+                    file.close();
+                }
+            }
+        } catch (const std::exception &e) {
+            error = QString::fromUtf8(e.what());
+        }
+
+        QMetaObject::invokeMethod(
+          this,
+          [dialog, error] {
+              if (dialog)
+                  dialog->close();
+              if (!error.isEmpty())
+                  QMessageBox::warning(nullptr, tr("Error"), error);
+          },
+          Qt::QueuedConnection);
+    });
 }
 void
 UserSettingsModel::requestCrossSigningSecrets()
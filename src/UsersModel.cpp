@@ -10,6 +10,7 @@
 #include "Cache_p.h"
 #include "CompletionModelRoles.h"
 #include "Logging.h"
+#include "MemberIndex.h"
 #include "UserSettingsPage.h"
 #include "Utils.h"
 
@@ -38,7 +39,9 @@ UsersModel::UsersModel(const std::string &roomId, QObject *parent)
         }
     } else {
         const auto start_at = std::chrono::steady_clock::now();
-        for (const auto &m : cache::getMembers(roomId, 0, -1)) {
+        memberIndex_        = cache::client()->memberIndex(roomId);
+        for (const auto &m : memberIndex_->members()) {
+            rowOfUser.insert(m.user_id, static_cast<int>(userids.size()));
             displayNames.push_back(m.display_name);
             userids.push_back(m.user_id);
             avatarUrls.push_back(m.avatar_url);
@@ -89,3 +92,18 @@ UsersModel::data(const QModelIndex &index, int role) const
     }
     return {};
 }
+
+std::vector<int>
+UsersModel::search(const QString &term, size_t limit, size_t max_mistakes) const
+{
+    std::vector<int> rows;
+    if (!memberIndex_)
+        return rows;
+
+    // The index might have members, that joined after this model was created, skip those.
+    for (const auto &user_id : memberIndex_->search(term, limit, max_mistakes))
+        if (auto row = rowOfUser.constFind(user_id); row != rowOfUser.constEnd())
+            rows.push_back(*row);
+
+    return rows;
+}
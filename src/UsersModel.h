@@ -5,6 +5,11 @@
 #pragma once
 
 #include <QAbstractListModel>
+#include <QHash>
+
+#include <memory>
+
+class MemberIndex;
 
 class UsersModel final : public QAbstractListModel
 {
@@ -25,8 +30,15 @@ public:
     }
     QVariant data(const QModelIndex &index, int role) const override;
 
+    //! Whether search() can be used instead of building a search index over the model.
+    bool hasMemberIndex() const { return memberIndex_ != nullptr; }
+    //! Rows matching the search term, using the member index of the room.
+    std::vector<int> search(const QString &term, size_t limit, size_t max_mistakes) const;
+
 private:
     std::string room_id;
+    std::shared_ptr<MemberIndex> memberIndex_;
+    QHash<QString, int> rowOfUser;
     std::vector<QString> avatarUrls;
     std::vector<QString> displayNames;
     std::vector<QString> userids;
@@ -4,8 +4,11 @@
 
 #include "Utils.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cmath>
+#include <latch>
 #include <unordered_set>
 #include <variant>
 
@@ -23,6 +26,7 @@
 #include <QStringBuilder>
 #include <QTextBoundaryFinder>
 #include <QTextDocument>
+#include <QThreadPool>
 #include <QTimer>
 #include <QWindow>
 #include <QXmlStreamReader>
@@ -42,6 +46,7 @@
 #include "Logging.h"
 #include "MatrixClient.h"
 #include "UserSettingsPage.h"
+#include "emoji/Emoji.h"
 
 static QString
 getQuoteBody(const RelatedInfo &related);
@@ -291,12 +296,37 @@ utils::localUser()
 bool
 utils::codepointIsEmoji(uint code)
 {
-    // TODO: Be more precise here.
-    return (code >= 0x2600 && code <= 0x27bf) || (code >= 0x2b00 && code <= 0x2bff) ||
-           (code >= 0x1f000 && code <= 0x1faff) || code == 0x200d || code == 0xfe0f ||
-           code == 0x231a || code == 0x231b || (code >= 0x23e9 && code <= 0x23ff) ||
-           code == 0x25aa || code == 0x25ab || code == 0x25b6 || code == 0x25c0 ||
-           (code >= 0x25fb && code <= 0x25fe) || (code >= 0x2460 && code <= 0x24ff);
+    return emoji::isEmoji(code);
+}
+
+int
+utils::emojiOnlyCount(std::string_view utf8)
+{
+    int emojiCount = 0;
+
+    for (std::size_t i = 0; i < utf8.size();) {
+        auto lead = static_cast<unsigned char>(utf8[i]);
+
+        // ASCII is never an emoji, which also makes this return early for most messages
+        if (lead < 0x80)
+            return 0;
+
+        std::size_t len = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 0;
+        if (len == 0 || i + len > utf8.size())
+            return 0;
+
+        char32_t code = lead & (0x7f >> len);
+        for (std::size_t j = 1; j < len; j++)
+            code = (code << 6) | (static_cast<unsigned char>(utf8[i + j]) & 0x3f);
+
+        if (!emoji::isEmoji(code))
+            return 0;
+
+        emojiCount++;
+        i += len;
+    }
+
+    return emojiCount;
 }
 
 QString
@@ -305,6 +335,10 @@ utils::replaceEmoji(const QString &body)
     if constexpr (QT_VERSION >= QT_VERSION_CHECK(6, 9, 0)) {
         return body;
     } else {
+        // ASCII never contains emoji
+        if (std::all_of(body.cbegin(), body.cend(), [](QChar c) { return c.unicode() < 0x80; }))
+            return body;
+
         QString fmtBody;
         fmtBody.reserve(body.size());
 
@@ -2246,3 +2280,55 @@ utils::markFileAsFromWeb(const QString &path [[maybe_unused]])
     file.close();
 #endif
 }
+
+void
+utils::parallelChunks(std::size_t count,
+                      std::size_t minPerChunk,
+                      const std::function<void(std::size_t begin, std::size_t end)> &work)
+{
+    if (count == 0)
+        return;
+
+    const std::size_t threads =
+      std::clamp<std::size_t>(count / std::max<std::size_t>(minPerChunk, 1),
+                              1,
+                              std::max(1, QThreadPool::globalInstance()->maxThreadCount()));
+    const std::size_t chunk = (count + threads - 1) / threads;
+
+    // Chunks, that the pool didn't start yet, are run by this thread, so that it doesn't wait
+    // for a pool, which may be busy with callers like it.
+    struct Chunk
+    {
+        std::size_t begin = 0, end = 0;
+        std::atomic_bool claimed{false};
+    };
+    struct Work
+    {
+        explicit Work(std::size_t chunkCount)
+          : chunks(chunkCount)
+          , done(static_cast<std::ptrdiff_t>(chunkCount))
+        {
+        }
+        std::vector<Chunk> chunks;
+        std::latch done;
+    };
+    auto state = std::make_shared<Work>((count + chunk - 1) / chunk);
+    for (std::size_t i = 0; i < state->chunks.size(); i++) {
+        state->chunks[i].begin = i * chunk;
+        state->chunks[i].end   = std::min((i + 1) * chunk, count);
+    }
+
+    // work is only used by chunks claimed before the wait below returns
+    auto run = [state, fn = &work](std::size_t index) {
+        auto &c = state->chunks[index];
+        if (c.claimed.exchange(true))
+            return;
+        (*fn)(c.begin, c.end);
+        state->done.count_down();
+    };
+    for (std::size_t i = 1; i < state->chunks.size(); i++)
+        QThreadPool::globalInstance()->start([run, i] { run(i); });
+    for (std::size_t i = 0; i < state->chunks.size(); i++)
+        run(i);
+    state->done.wait();
+}
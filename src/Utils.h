@@ -9,6 +9,8 @@
 #include <QPixmap>
 #include <mtx/events.hpp>
 
+#include <functional>
+
 namespace mtx::events::collections {
 struct TimelineEvents;
 struct StateEvents;
@@ -53,6 +55,10 @@ stripReplyFallbacks(const mtx::events::collections::TimelineEvents &event,
 bool
 codepointIsEmoji(uint code);
 
+//! Returns the number of codepoints in the utf8 string, if it only consists of emoji, 0 otherwise.
+int
+emojiOnlyCount(std::string_view utf8);
+
 QString
 replaceEmoji(const QString &body);
 
@@ -218,4 +224,11 @@ parseMatrixUri(QString uri);
 
 void
 markFileAsFromWeb(const QString &file);
+
+//! Splits [0, count) into chunks of at least minPerChunk items, calls work(begin, end) for each of
+//! them on the global thread pool and waits for all of them.
+void
+parallelChunks(std::size_t count,
+               std::size_t minPerChunk,
+               const std::function<void(std::size_t begin, std::size_t end)> &work);
 }
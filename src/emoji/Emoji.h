@@ -85,4 +85,9 @@ public:
 
 QString
 categoryToName(emoji::Emoji::Category cat);
+
+//! Checks if the codepoint is used in any emoji sequence listed in the Unicode emoji-test.txt.
+//! ASCII is never considered an emoji, even if it is part of a keycap sequence.
+bool
+isEmoji(char32_t code);
 } // namespace emoji
@@ -4,13 +4,21 @@
 
 #include "Olm.h"
 
+#include <QElapsedTimer>
 #include <QObject>
 #include <QRandomGenerator>
+#include <QThreadPool>
 #include <QTimer>
 
 #include <fmt/ranges.h>
 #include <nlohmann/json.hpp>
 
+#include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <ranges>
 #include <variant>
 
@@ -25,6 +33,7 @@
 #include "Logging.h"
 #include "MatrixClient.h"
 #include "UserSettingsPage.h"
+#include "Utils.h"
 
 namespace {
 auto client_ = std::make_unique<mtx::crypto::OlmClient>();
@@ -33,6 +42,56 @@ std::map<std::string, std::string> request_id_to_secret_name;
 
 constexpr auto MEGOLM_ALGO = "m.megolm.v1.aes-sha2";
 constexpr auto OLM_ALGO    = "m.olm.v1.curve25519-aes-sha2";
+
+//! Minimum number of olm messages, which are encrypted on each thread.
+constexpr std::size_t OLM_ENCRYPTIONS_PER_THREAD = 32;
+//! Maximum number of messages in one /sendToDevice request.
+constexpr std::size_t TO_DEVICE_MESSAGES_PER_REQUEST = 250;
+
+//! Minimum number of backed up sessions, which are decrypted on each thread.
+constexpr std::size_t BACKUP_SESSIONS_PER_THREAD = 64;
+//! Number of rooms, which a full backup restore decrypts and stores at the same time.
+constexpr std::size_t BACKUP_ROOMS_STORED_AT_ONCE = 2;
+//! How long missing sessions of a room are collected, before they are looked up in the backup.
+constexpr int KEY_BACKUP_LOOKUP_DELAY_MS = 500;
+//! If more sessions of a room are missing, all sessions of the room are restored at once.
+constexpr std::size_t KEY_BACKUP_SINGLE_LOOKUPS = 3;
+
+//! Number of locks shared by the olm sessions of all devices.
+constexpr std::size_t OLM_SESSION_LOCKS = 64;
+std::array<std::mutex, OLM_SESSION_LOCKS> olmSessionLocks;
+
+std::size_t
+olm_session_lock_index(const std::string &curve25519)
+{
+    return std::hash<std::string>{}(curve25519) % OLM_SESSION_LOCKS;
+}
+
+//! Returns the lock of the olm sessions with the device owning curve25519. It is held from loading
+//! a session until the advanced session is stored, so that decrypting and encrypting on different
+//! threads don't advance two copies of the same session and overwrite each other. Devices share a
+//! fixed number of locks by the hash of their key.
+std::mutex &
+olm_session_lock(const std::string &curve25519)
+{
+    return olmSessionLocks[olm_session_lock_index(curve25519)];
+}
+
+//! Locks the olm sessions of several devices. Each shared lock is taken once and in order, so that
+//! two threads locking overlapping devices can't deadlock.
+std::vector<std::unique_lock<std::mutex>>
+lock_olm_sessions(const std::set<std::string> &curve25519_keys)
+{
+    std::set<std::size_t> indexes;
+    for (const auto &curve25519 : curve25519_keys)
+        indexes.insert(olm_session_lock_index(curve25519));
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(indexes.size());
+    for (auto index : indexes)
+        locks.emplace_back(olmSessionLocks[index]);
+    return locks;
+}
 }
 
 namespace olm {
@@ -116,14 +175,518 @@ handle_secret_request(const mtx::events::DeviceEvent<mtx::events::msg::SecretReq
                        });
 }
 
+//! Checks, that the decrypted payload was sent to us by one of the devices of the sender, and
+//! parses it. Returns the ed25519 key of the sending device and the event.
+static std::optional<std::pair<std::string, mtx::events::collections::DeviceEvents>>
+verify_olm_payload(const OlmMessage &msg,
+                   const nlohmann::json &payload,
+                   const UserKeyCache &otherUserDeviceKeys,
+                   const std::string &our_ed25519)
+{
+    // Other properties are included in order to prevent an attacker from
+    // publishing someone else's curve25519 keys as their own and subsequently
+    // claiming to have sent messages which they didn't. sender must correspond
+    // to the user who sent the event, recipient to the local user, and
+    // recipient_keys to the local ed25519 key.
+    if (!payload.is_object()) {
+        nhlog::crypto()->warn("Decrypted event isn't an object: {}", payload.dump());
+        return std::nullopt;
+    }
+    std::string receiver_ed25519 =
+      payload.value("recipient_keys", nlohmann::json::object()).value("ed25519", "");
+    if (receiver_ed25519.empty() || receiver_ed25519 != our_ed25519) {
+        nhlog::crypto()->warn("Decrypted event doesn't include our ed25519: {}", payload.dump());
+        return std::nullopt;
+    }
+    std::string receiver = payload.value("recipient", "");
+    if (receiver.empty() || receiver != http::client()->user_id().to_string()) {
+        nhlog::crypto()->warn("Decrypted event doesn't include our user_id: {}", payload.dump());
+        return std::nullopt;
+    }
+
+    // Clients must confirm that the sender_key and the ed25519 field value
+    // under the keys property match the keys returned by /keys/query for the
+    // given user, and must also verify the signature of the payload. Without
+    // this check, a client cannot be sure that the sender device owns the
+    // private part of the ed25519 key it claims to have in the Olm payload.
+    // This is crucial when the ed25519 key corresponds to a verified device.
+    std::string sender_ed25519 =
+      payload.value("keys", nlohmann::json::object()).value("ed25519", "");
+    if (sender_ed25519.empty()) {
+        nhlog::crypto()->warn("Decrypted event doesn't include sender ed25519: {}",
+                              payload.dump());
+        return std::nullopt;
+    }
+
+    bool from_their_device = false;
+    for (const auto &[device_id, key] : otherUserDeviceKeys.device_keys) {
+        auto c_key = key.keys.find("curve25519:" + device_id);
+        auto e_key = key.keys.find("ed25519:" + device_id);
+
+        if (c_key == key.keys.end() || e_key == key.keys.end()) {
+            nhlog::crypto()->warn("Skipping device {} as we have no keys for it.", device_id);
+        } else if (c_key->second == msg.sender_key && e_key->second == sender_ed25519) {
+            from_their_device = true;
+            break;
+        }
+    }
+    if (!from_their_device) {
+        nhlog::crypto()->warn("Decrypted event isn't sent from a device "
+                              "listed by that user! {}",
+                              payload.dump());
+        return std::nullopt;
+    }
+
+    nlohmann::json event_array = nlohmann::json::array();
+    event_array.push_back(payload);
+
+    std::vector<mtx::events::collections::DeviceEvents> temp_events;
+    mtx::responses::utils::parse_device_events(event_array, temp_events);
+    if (temp_events.empty()) {
+        nhlog::crypto()->warn("Decrypted unknown event: {}", payload.dump());
+        return std::nullopt;
+    }
+    return std::pair(sender_ed25519, temp_events.at(0));
+}
+
+//! Handles an event decrypted from an olm message. Called on the ui thread.
+static void
+handle_decrypted_olm_event(const OlmMessage &msg,
+                           const std::string &sender_ed25519,
+                           mtx::events::collections::DeviceEvents &device_event)
+{
+    using namespace mtx::events;
+    if (auto e1 = std::get_if<DeviceEvent<msg::KeyVerificationAccept>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationAccept(e1->content);
+    } else if (auto e2 = std::get_if<DeviceEvent<msg::KeyVerificationRequest>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationRequest(e2->content, e2->sender);
+    } else if (auto e3 = std::get_if<DeviceEvent<msg::KeyVerificationCancel>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationCancel(e3->content);
+    } else if (auto e4 = std::get_if<DeviceEvent<msg::KeyVerificationKey>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationKey(e4->content);
+    } else if (auto e5 = std::get_if<DeviceEvent<msg::KeyVerificationMac>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationMac(e5->content);
+    } else if (auto e6 = std::get_if<DeviceEvent<msg::KeyVerificationStart>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationStart(e6->content, e6->sender);
+    } else if (auto e7 = std::get_if<DeviceEvent<msg::KeyVerificationReady>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationReady(e7->content);
+    } else if (auto e8 = std::get_if<DeviceEvent<msg::KeyVerificationDone>>(&device_event)) {
+        ChatPage::instance()->receivedDeviceVerificationDone(e8->content);
+    } else if (auto roomKey = std::get_if<DeviceEvent<msg::RoomKey>>(&device_event)) {
+        create_inbound_megolm_session(*roomKey, msg.sender_key, sender_ed25519);
+    } else if (auto forwardedRoomKey =
+                 std::get_if<DeviceEvent<msg::ForwardedRoomKey>>(&device_event)) {
+        forwardedRoomKey->content.forwarding_curve25519_key_chain.push_back(msg.sender_key);
+        import_inbound_megolm_session(*forwardedRoomKey);
+    } else if (auto e = std::get_if<DeviceEvent<msg::SecretSend>>(&device_event)) {
+        auto local_user = http::client()->user_id();
+
+        if (msg.sender != local_user.to_string())
+            return;
+
+        auto secret_name_it = request_id_to_secret_name.find(e->content.request_id);
+
+        if (secret_name_it != request_id_to_secret_name.end()) {
+            auto secret_name = secret_name_it->second;
+            request_id_to_secret_name.erase(secret_name_it);
+
+            nhlog::crypto()->info("Received secret: {}", secret_name);
+
+            mtx::events::msg::SecretRequest secretRequest{};
+            secretRequest.action = mtx::events::msg::RequestAction::Cancellation;
+            secretRequest.requesting_device_id = http::client()->device_id();
+            secretRequest.request_id           = e->content.request_id;
+
+            auto verificationStatus = cache::verificationStatus(local_user.to_string());
+
+            if (!verificationStatus)
+                return;
+
+            auto deviceKeys = cache::userKeys(local_user.to_string());
+            if (!deviceKeys)
+                return;
+
+            std::string sender_device_id;
+            for (auto &[dev, key] : deviceKeys->device_keys) {
+                if (key.keys["curve25519:" + dev] == msg.sender_key) {
+                    sender_device_id = dev;
+                    break;
+                }
+            }
+            if (!verificationStatus->verified_devices.count(sender_device_id) ||
+                !verificationStatus->verified_device_keys.count(msg.sender_key) ||
+                verificationStatus->verified_device_keys.at(msg.sender_key) !=
+                  crypto::Trust::Verified) {
+                nhlog::net()->critical("Received secret from unverified device {}! Ignoring!",
+                                       sender_device_id);
+                return;
+            }
+
+            std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::SecretRequest>>
+              body;
+
+            for (const auto &dev : verificationStatus->verified_devices) {
+                if (dev != secretRequest.requesting_device_id && dev != sender_device_id)
+                    body[local_user][dev] = secretRequest;
+            }
+
+            if (!body.empty()) {
+                http::client()->send_to_device<mtx::events::msg::SecretRequest>(
+                  http::client()->generate_txn_id(),
+                  body,
+                  [secret_name](mtx::http::RequestErr err) {
+                      if (err) {
+                          nhlog::net()->error("Failed to send request cancellation "
+                                              "for secrect "
+                                              "'{}'",
+                                              secret_name);
+                      }
+                  });
+            }
+
+            nhlog::crypto()->info("Storing secret {}", secret_name);
+            cache::client()->storeSecret(secret_name, e->content.secret);
+        }
+
+    } else if (auto sec_req = std::get_if<DeviceEvent<msg::SecretRequest>>(&device_event)) {
+        handle_secret_request(sec_req, msg.sender);
+    }
+}
+
+//! Creates a new olm session with the device, which sent an undecryptable message.
+static void
+recover_olm_channel(const OlmMessage &msg, const UserKeyCache &otherUserDeviceKeys)
+{
+    try {
+        std::map<std::string, std::vector<std::string>> targets;
+        for (const auto &[device_id, key] : otherUserDeviceKeys.device_keys) {
+            if (key.keys.at("curve25519:" + device_id) == msg.sender_key)
+                targets[msg.sender].push_back(device_id);
+        }
+
+        send_encrypted_to_device_messages(
+          targets, mtx::events::DeviceEvent<mtx::events::msg::Dummy>{}, true);
+        nhlog::crypto()->info(
+          "Recovering from broken olm channel with {}:{}", msg.sender, msg.sender_key);
+    } catch (std::exception &e) {
+        nhlog::crypto()->error("Failed to recover from broken olm sessions: {}", e.what());
+    }
+}
+
+//! Creates the inbound megolm session for a room key received via olm.
+static std::optional<
+  std::tuple<MegolmSessionIndex, mtx::crypto::InboundGroupSessionPtr, GroupSessionData>>
+prepare_inbound_megolm_session(const mtx::events::DeviceEvent<mtx::events::msg::RoomKey> &roomKey,
+                               const std::string &sender_key,
+                               const std::string &sender_ed25519)
+{
+    MegolmSessionIndex index;
+    index.room_id    = roomKey.content.room_id;
+    index.session_id = roomKey.content.session_id;
+
+    try {
+        auto megolm_session =
+          olm::client()->init_inbound_group_session(roomKey.content.session_key);
+
+        GroupSessionData data{};
+        data.forwarding_curve25519_key_chain = {sender_key};
+        data.sender_claimed_ed25519_key      = sender_ed25519;
+        data.sender_key                      = sender_key;
+
+        data.trusted = olm_inbound_group_session_is_verified(megolm_session.get());
+
+        backup_session_key(index, data, megolm_session);
+        return std::tuple(std::move(index), std::move(megolm_session), std::move(data));
+    } catch (const mtx::crypto::olm_exception &e) {
+        nhlog::crypto()->critical("failed to create inbound megolm session: {}", e.what());
+        return std::nullopt;
+    }
+}
+
+namespace {
+//! The olm messages of a sync together with the keys of their senders.
+struct OlmBatch
+{
+    std::vector<OlmMessage> messages;
+    std::map<std::string, UserKeyCache> keys;
+    //! senders, whose keys are still being queried
+    std::size_t waitingFor = 0;
+    //! called on the ui thread, once the messages are handled
+    std::function<void()> done;
+
+    std::string curve25519;
+    std::string ed25519;
+};
+
+//! Batches waiting to be decrypted. Only used on the ui thread.
+std::deque<OlmBatch> olmBatches;
+bool olmBatchRunning = false;
+}
+
+static void
+run_next_olm_batch();
+
+//! Decrypts a batch of olm messages on a worker thread. The messages of each sender key are
+//! decrypted in order with its sessions unpickled only once, and all changed olm sessions and new
+//! megolm sessions are stored in one transaction each. Everything, which touches the ui or creates
+//! new olm sessions, which changes the olm account, is handed to the ui thread afterwards. A
+//! message, which fails, doesn't stop the others and the sessions advanced so far are still stored.
+static void
+decrypt_olm_batch(const OlmBatch &batch)
+{
+    using namespace mtx::events;
+
+    std::vector<std::function<void()>> uiTasks;
+    std::map<std::string, std::vector<std::string>> receivedSessions;
+
+    std::map<std::string, std::vector<const OlmMessage *>> bySenderKey;
+    for (const auto &message : batch.messages) {
+        if (!batch.keys.count(message.sender))
+            continue;
+
+        if (message.sender_key == batch.ed25519) {
+            nhlog::crypto()->warn("Ignoring olm message from ourselves!");
+            continue;
+        }
+
+        bySenderKey[message.sender_key].push_back(&message);
+    }
+
+    std::set<std::string> senderKeys;
+    for (const auto &sender_key : bySenderKey | std::views::keys)
+        senderKeys.insert(sender_key);
+    // held until the changed sessions are stored
+    auto sessionLocks = lock_olm_sessions(senderKeys);
+
+    std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> changedSessions;
+    std::vector<
+      std::tuple<MegolmSessionIndex, mtx::crypto::InboundGroupSessionPtr, GroupSessionData>>
+      megolmSessions;
+
+    for (const auto &[sender_key, messages] : bySenderKey) {
+        // session, changed
+        std::vector<std::pair<mtx::crypto::OlmSessionPtr, bool>> sessions;
+
+        // once a message needs a new session, the following ones may use it
+        bool deferred = false;
+        try {
+            for (const auto &id : cache::getOlmSessions(sender_key))
+                if (auto session = cache::getOlmSession(sender_key, id))
+                    sessions.emplace_back(std::move(*session), false);
+        } catch (const lmdb::error &e) {
+            nhlog::crypto()->critical(
+              "failed to load olm sessions of {}: {}", sender_key, e.what());
+            deferred = true;
+        }
+
+        for (const auto *message : messages) {
+            const auto &keys = batch.keys.at(message->sender);
+
+            if (deferred) {
+                uiTasks.push_back(
+                  [message = *message, keys] { handle_olm_message(message, keys); });
+                continue;
+            }
+
+            try {
+                auto cipher = message->ciphertext.find(batch.curve25519);
+                if (cipher == message->ciphertext.end())
+                    continue;
+
+                mtx::crypto::BinaryBuf text;
+                for (auto &[session, changed] : sessions) {
+                    try {
+                        text = olm::client()->decrypt_message(
+                          session.get(), cipher->second.type, cipher->second.body);
+                        changed = true;
+                        break;
+                    } catch (const mtx::crypto::olm_exception &) {
+                        continue;
+                    }
+                }
+
+                if (text.empty()) {
+                    if (cipher->second.type == 0) {
+                        deferred = true;
+                        uiTasks.push_back([message = *message, keys] {
+                            handle_olm_message(message, keys);
+                        });
+                    } else {
+                        nhlog::crypto()->error("Undecryptable olm message!");
+                        uiTasks.push_back([message = *message, keys] {
+                            recover_olm_channel(message, keys);
+                        });
+                    }
+                    continue;
+                }
+
+                auto payload =
+                  nlohmann::json::parse(std::string_view((char *)text.data(), text.size()));
+
+                auto event = verify_olm_payload(*message, payload, keys, batch.ed25519);
+                if (!event)
+                    continue;
+
+                if (auto roomKey = std::get_if<DeviceEvent<msg::RoomKey>>(&event->second)) {
+                    if (auto session = prepare_inbound_megolm_session(
+                          *roomKey, message->sender_key, event->first)) {
+                        nhlog::crypto()->info("established inbound megolm session ({}, {})",
+                                              roomKey->content.room_id,
+                                              roomKey->sender);
+                        receivedSessions[roomKey->content.room_id].push_back(
+                          roomKey->content.session_id);
+                        megolmSessions.push_back(std::move(*session));
+                    }
+                } else {
+                    uiTasks.push_back([message        = *message,
+                                       sender_ed25519 = event->first,
+                                       ev             = event->second]() mutable {
+                        handle_decrypted_olm_event(message, sender_ed25519, ev);
+                    });
+                }
+            } catch (const nlohmann::json::exception &e) {
+                nhlog::crypto()->critical("failed to parse the decrypted session msg: {}",
+                                          e.what());
+            } catch (const std::exception &e) {
+                nhlog::crypto()->critical(
+                  "failed to decrypt olm message from {}: {}", message->sender, e.what());
+            }
+        }
+
+        for (auto &[session, changed] : sessions)
+            if (changed)
+                changedSessions.emplace_back(sender_key, std::move(session));
+    }
+
+    nhlog::crypto()->debug("Decrypted {} olm messages, updated {} olm sessions",
+                           batch.messages.size(),
+                           changedSessions.size());
+
+    try {
+        if (!changedSessions.empty())
+            cache::client()->saveOlmSessions(std::move(changedSessions),
+                                             QDateTime::currentMSecsSinceEpoch());
+    } catch (const lmdb::error &e) {
+        nhlog::crypto()->critical("failed to store olm sessions: {}", e.what());
+    } catch (const mtx::crypto::olm_exception &e) {
+        nhlog::crypto()->critical("failed to pickle olm sessions: {}", e.what());
+    }
+    sessionLocks.clear();
+
+    try {
+        if (!megolmSessions.empty())
+            cache::client()->saveInboundMegolmSessions(std::move(megolmSessions));
+    } catch (const std::exception &e) {
+        nhlog::crypto()->critical("failed to store megolm sessions of olm messages: {}",
+                                  e.what());
+        receivedSessions.clear();
+    }
+
+    QMetaObject::invokeMethod(
+      ChatPage::instance(),
+      [receivedSessions = std::move(receivedSessions),
+       uiTasks          = std::move(uiTasks),
+       done             = batch.done] {
+          for (const auto &[room_id, session_ids] : receivedSessions)
+              ChatPage::instance()->receivedSessionKeys(room_id, session_ids);
+          for (const auto &task : uiTasks) {
+              try {
+                  task();
+              } catch (const std::exception &e) {
+                  nhlog::crypto()->critical("failed to handle olm message: {}", e.what());
+              }
+          }
+          if (done)
+              done();
+
+          // The next batch may need the sessions created by these tasks.
+          olmBatchRunning = false;
+          run_next_olm_batch();
+      },
+      Qt::QueuedConnection);
+}
+
+static void
+run_next_olm_batch()
+{
+    if (olmBatchRunning || olmBatches.empty())
+        return;
+
+    olmBatchRunning = true;
+    auto batch      = std::make_shared<OlmBatch>(std::move(olmBatches.front()));
+    olmBatches.pop_front();
+
+    QThreadPool::globalInstance()->start([batch] { decrypt_olm_batch(*batch); });
+}
+
+//! Queries the keys of all senders and then decrypts the messages as one batch. done is called on
+//! the ui thread afterwards.
+static void
+handle_olm_messages(std::map<std::string, std::vector<OlmMessage>> bySender,
+                    std::function<void()> done)
+{
+    auto batch        = std::make_shared<OlmBatch>();
+    batch->waitingFor = bySender.size();
+    batch->done       = std::move(done);
+    batch->curve25519 = olm::client()->identity_keys().curve25519;
+    batch->ed25519    = olm::client()->identity_keys().ed25519;
+
+    for (auto &[sender, messages] : bySender)
+        for (auto &message : messages)
+            batch->messages.push_back(std::move(message));
+
+    for (const auto &sender : bySender | std::views::keys) {
+        // the query may finish on a network thread
+        auto received = [batch, sender](std::optional<UserKeyCache> userKeys) {
+            QMetaObject::invokeMethod(
+              ChatPage::instance(),
+              [batch, sender, userKeys = std::move(userKeys)] {
+                  if (userKeys)
+                      batch->keys[sender] = *userKeys;
+
+                  if (--batch->waitingFor == 0) {
+                      olmBatches.push_back(std::move(*batch));
+                      run_next_olm_batch();
+                  }
+              },
+              Qt::QueuedConnection);
+        };
+
+        try {
+            cache::client()->query_keys(
+              sender,
+              [received, sender](const UserKeyCache &userKeys, mtx::http::RequestErr e) {
+                  if (e) {
+                      nhlog::crypto()->error(
+                        "Failed to query user keys, dropping olm messages of {}: {}", sender, e);
+                      received(std::nullopt);
+                  } else {
+                      received(userKeys);
+                  }
+              });
+        } catch (const lmdb::error &e) {
+            nhlog::crypto()->error(
+              "Failed to look up user keys, dropping olm messages of {}: {}", sender, e.what());
+            received(std::nullopt);
+        }
+    }
+}
+
 void
-handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEvents> &msgs)
+handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEvents> &msgs,
+                          std::function<void()> done)
 {
-    if (msgs.empty())
+    if (msgs.empty()) {
+        if (done)
+            done();
         return;
+    }
     nhlog::crypto()->info("received {} to_device messages", msgs.size());
     nlohmann::json j_msg;
 
+    // olm messages by sender, handled together after the other messages
+    std::map<std::string, std::vector<olm::OlmMessage>> olmMessages;
+
     for (const auto &msg : msgs) {
         j_msg = std::visit([](auto &e) { return nlohmann::json(e); }, std::move(msg));
         if (j_msg.count("type") == 0) {
@@ -136,15 +699,7 @@ handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEven
         if (msg_type == to_string(mtx::events::EventType::RoomEncrypted)) {
             try {
                 olm::OlmMessage olm_msg = j_msg.get<olm::OlmMessage>();
-                cache::client()->query_keys(
-                  olm_msg.sender, [olm_msg](const UserKeyCache &userKeys, mtx::http::RequestErr e) {
-                      if (e) {
-                          nhlog::crypto()->error(
-                            "Failed to query user keys, dropping olm message: {}", e);
-                          return;
-                      }
-                      handle_olm_message(std::move(olm_msg), userKeys);
-                  });
+                olmMessages[olm_msg.sender].push_back(std::move(olm_msg));
             } catch (const nlohmann::json::exception &e) {
                 nhlog::crypto()->warn(
                   "parsing error for olm message: {} {}", e.what(), j_msg.dump(2));
@@ -207,6 +762,11 @@ handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEven
             nhlog::crypto()->warn("unhandled event: {}", j_msg.dump(2));
         }
     }
+
+    if (!olmMessages.empty())
+        handle_olm_messages(std::move(olmMessages), std::move(done));
+    else if (done)
+        done();
 }
 
 void
@@ -235,213 +795,36 @@ handle_olm_message(const OlmMessage &msg, const UserKeyCache &otherUserDeviceKey
         const auto type = cipher.second.type;
         nhlog::crypto()->info("type: {}", type == 0 ? "OLM_PRE_KEY" : "OLM_MESSAGE");
 
-        auto payload = try_olm_decryption(msg.sender_key, cipher.second);
+        nlohmann::json payload;
+        {
+            // released before handling the event, which may send olm messages to the sender
+            std::lock_guard sessionLock(olm_session_lock(msg.sender_key));
+            payload = try_olm_decryption(msg.sender_key, cipher.second);
 
-        if (payload.is_null()) {
             // Check for PRE_KEY message
-            if (cipher.second.type == 0) {
+            if (payload.is_null() && cipher.second.type == 0)
                 payload = handle_pre_key_olm_message(msg.sender, msg.sender_key, cipher.second);
-            } else {
-                nhlog::crypto()->error("Undecryptable olm message!");
-                failed_decryption = true;
-                continue;
-            }
         }
 
-        if (!payload.is_null()) {
-            mtx::events::collections::DeviceEvents device_event;
-
-            // Other properties are included in order to prevent an attacker from
-            // publishing someone else's curve25519 keys as their own and subsequently
-            // claiming to have sent messages which they didn't. sender must correspond
-            // to the user who sent the event, recipient to the local user, and
-            // recipient_keys to the local ed25519 key.
-            std::string receiver_ed25519 = payload["recipient_keys"]["ed25519"].get<std::string>();
-            if (receiver_ed25519.empty() ||
-                receiver_ed25519 != olm::client()->identity_keys().ed25519) {
-                nhlog::crypto()->warn("Decrypted event doesn't include our ed25519: {}",
-                                      payload.dump());
-                return;
-            }
-            std::string receiver = payload["recipient"].get<std::string>();
-            if (receiver.empty() || receiver != http::client()->user_id().to_string()) {
-                nhlog::crypto()->warn("Decrypted event doesn't include our user_id: {}",
-                                      payload.dump());
-                return;
-            }
-
-            // Clients must confirm that the sender_key and the ed25519 field value
-            // under the keys property match the keys returned by /keys/query for the
-            // given user, and must also verify the signature of the payload. Without
-            // this check, a client cannot be sure that the sender device owns the
-            // private part of the ed25519 key it claims to have in the Olm payload.
-            // This is crucial when the ed25519 key corresponds to a verified device.
-            std::string sender_ed25519 = payload["keys"]["ed25519"].get<std::string>();
-            if (sender_ed25519.empty()) {
-                nhlog::crypto()->warn("Decrypted event doesn't include sender ed25519: {}",
-                                      payload.dump());
-                return;
-            }
-
-            bool from_their_device = false;
-            for (const auto &[device_id, key] : otherUserDeviceKeys.device_keys) {
-                auto c_key = key.keys.find("curve25519:" + device_id);
-                auto e_key = key.keys.find("ed25519:" + device_id);
-
-                if (c_key == key.keys.end() || e_key == key.keys.end()) {
-                    nhlog::crypto()->warn("Skipping device {} as we have no keys for it.",
-                                          device_id);
-                } else if (c_key->second == msg.sender_key && e_key->second == sender_ed25519) {
-                    from_their_device = true;
-                    break;
-                }
-            }
-            if (!from_their_device) {
-                nhlog::crypto()->warn("Decrypted event isn't sent from a device "
-                                      "listed by that user! {}",
-                                      payload.dump());
-                return;
-            }
-
-            {
-                std::string msg_type       = payload["type"].get<std::string>();
-                nlohmann::json event_array = nlohmann::json::array();
-                event_array.push_back(payload);
-
-                std::vector<mtx::events::collections::DeviceEvents> temp_events;
-                mtx::responses::utils::parse_device_events(event_array, temp_events);
-                if (temp_events.empty()) {
-                    nhlog::crypto()->warn("Decrypted unknown event: {}", payload.dump());
-                    return;
-                }
-                device_event = temp_events.at(0);
-            }
-
-            using namespace mtx::events;
-            if (auto e1 = std::get_if<DeviceEvent<msg::KeyVerificationAccept>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationAccept(e1->content);
-            } else if (auto e2 =
-                         std::get_if<DeviceEvent<msg::KeyVerificationRequest>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationRequest(e2->content, e2->sender);
-            } else if (auto e3 =
-                         std::get_if<DeviceEvent<msg::KeyVerificationCancel>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationCancel(e3->content);
-            } else if (auto e4 = std::get_if<DeviceEvent<msg::KeyVerificationKey>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationKey(e4->content);
-            } else if (auto e5 = std::get_if<DeviceEvent<msg::KeyVerificationMac>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationMac(e5->content);
-            } else if (auto e6 =
-                         std::get_if<DeviceEvent<msg::KeyVerificationStart>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationStart(e6->content, e6->sender);
-            } else if (auto e7 =
-                         std::get_if<DeviceEvent<msg::KeyVerificationReady>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationReady(e7->content);
-            } else if (auto e8 =
-                         std::get_if<DeviceEvent<msg::KeyVerificationDone>>(&device_event)) {
-                ChatPage::instance()->receivedDeviceVerificationDone(e8->content);
-            } else if (auto roomKey = std::get_if<DeviceEvent<msg::RoomKey>>(&device_event)) {
-                create_inbound_megolm_session(*roomKey, msg.sender_key, sender_ed25519);
-            } else if (auto forwardedRoomKey =
-                         std::get_if<DeviceEvent<msg::ForwardedRoomKey>>(&device_event)) {
-                forwardedRoomKey->content.forwarding_curve25519_key_chain.push_back(msg.sender_key);
-                import_inbound_megolm_session(*forwardedRoomKey);
-            } else if (auto e = std::get_if<DeviceEvent<msg::SecretSend>>(&device_event)) {
-                auto local_user = http::client()->user_id();
-
-                if (msg.sender != local_user.to_string())
-                    return;
-
-                auto secret_name_it = request_id_to_secret_name.find(e->content.request_id);
-
-                if (secret_name_it != request_id_to_secret_name.end()) {
-                    auto secret_name = secret_name_it->second;
-                    request_id_to_secret_name.erase(secret_name_it);
-
-                    nhlog::crypto()->info("Received secret: {}", secret_name);
-
-                    mtx::events::msg::SecretRequest secretRequest{};
-                    secretRequest.action = mtx::events::msg::RequestAction::Cancellation;
-                    secretRequest.requesting_device_id = http::client()->device_id();
-                    secretRequest.request_id           = e->content.request_id;
-
-                    auto verificationStatus = cache::verificationStatus(local_user.to_string());
-
-                    if (!verificationStatus)
-                        return;
-
-                    auto deviceKeys = cache::userKeys(local_user.to_string());
-                    if (!deviceKeys)
-                        return;
-
-                    std::string sender_device_id;
-                    for (auto &[dev, key] : deviceKeys->device_keys) {
-                        if (key.keys["curve25519:" + dev] == msg.sender_key) {
-                            sender_device_id = dev;
-                            break;
-                        }
-                    }
-                    if (!verificationStatus->verified_devices.count(sender_device_id) ||
-                        !verificationStatus->verified_device_keys.count(msg.sender_key) ||
-                        verificationStatus->verified_device_keys.at(msg.sender_key) !=
-                          crypto::Trust::Verified) {
-                        nhlog::net()->critical(
-                          "Received secret from unverified device {}! Ignoring!", sender_device_id);
-                        return;
-                    }
-
-                    std::map<mtx::identifiers::User,
-                             std::map<std::string, mtx::events::msg::SecretRequest>>
-                      body;
-
-                    for (const auto &dev : verificationStatus->verified_devices) {
-                        if (dev != secretRequest.requesting_device_id && dev != sender_device_id)
-                            body[local_user][dev] = secretRequest;
-                    }
-
-                    if (!body.empty()) {
-                        http::client()->send_to_device<mtx::events::msg::SecretRequest>(
-                          http::client()->generate_txn_id(),
-                          body,
-                          [secret_name](mtx::http::RequestErr err) {
-                              if (err) {
-                                  nhlog::net()->error("Failed to send request cancellation "
-                                                      "for secrect "
-                                                      "'{}'",
-                                                      secret_name);
-                              }
-                          });
-                    }
-
-                    nhlog::crypto()->info("Storing secret {}", secret_name);
-                    cache::client()->storeSecret(secret_name, e->content.secret);
-                }
-
-            } else if (auto sec_req = std::get_if<DeviceEvent<msg::SecretRequest>>(&device_event)) {
-                handle_secret_request(sec_req, msg.sender);
-            }
+        if (payload.is_null() && cipher.second.type != 0) {
+            nhlog::crypto()->error("Undecryptable olm message!");
+            failed_decryption = true;
+            continue;
+        }
 
+        if (!payload.is_null()) {
+            auto event = verify_olm_payload(
+              msg, payload, otherUserDeviceKeys, olm::client()->identity_keys().ed25519);
+            if (event)
+                handle_decrypted_olm_event(msg, event->first, event->second);
             return;
         } else {
             failed_decryption = true;
         }
     }
 
-    if (failed_decryption) {
-        try {
-            std::map<std::string, std::vector<std::string>> targets;
-            for (const auto &[device_id, key] : otherUserDeviceKeys.device_keys) {
-                if (key.keys.at("curve25519:" + device_id) == msg.sender_key)
-                    targets[msg.sender].push_back(device_id);
-            }
-
-            send_encrypted_to_device_messages(
-              targets, mtx::events::DeviceEvent<mtx::events::msg::Dummy>{}, true);
-            nhlog::crypto()->info(
-              "Recovering from broken olm channel with {}:{}", msg.sender, msg.sender_key);
-        } catch (std::exception &e) {
-            nhlog::crypto()->error("Failed to recover from broken olm sessions: {}", e.what());
-        }
-    }
+    if (failed_decryption)
+        recover_olm_channel(msg, otherUserDeviceKeys);
 }
 
 nlohmann::json
@@ -516,8 +899,34 @@ encrypt_group_message_with_session(mtx::crypto::OutboundGroupSessionPtr &session
     return data;
 }
 
-mtx::events::msg::Encrypted
-encrypt_group_message(const std::string &room_id, const std::string &device_id, nlohmann::json body)
+//! Returns the lock, which serializes rotating and sharing the outbound session of a room, so that
+//! a background share and a send don't both create a new session for it. Each room has its own
+//! lock, so that sharing in one room doesn't block sending in another. Locks are dropped, once
+//! nobody uses them anymore.
+static std::shared_ptr<std::mutex>
+outbound_session_lock(const std::string &room_id)
+{
+    static std::mutex locksMtx;
+    static std::map<std::string, std::weak_ptr<std::mutex>> locks;
+
+    std::lock_guard lock(locksMtx);
+    std::erase_if(locks, [](const auto &entry) { return entry.second.expired(); });
+
+    auto &entry = locks[room_id];
+    auto mtx    = entry.lock();
+    if (!mtx) {
+        mtx   = std::make_shared<std::mutex>();
+        entry = mtx;
+    }
+    return mtx;
+}
+
+//! Rotates the outbound session of the room if necessary and shares it with all members, which
+//! don't have it yet. Returns the session ready to encrypt with.
+static mtx::crypto::OutboundGroupSessionPtr
+prepare_group_session(const std::string &room_id,
+                      const std::string &device_id,
+                      GroupSessionData &group_session_data)
 {
     using namespace mtx::events;
     using namespace mtx::identifiers;
@@ -529,7 +938,6 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
 
     std::map<std::string, std::vector<std::string>> sendSessionTo;
     mtx::crypto::OutboundGroupSessionPtr session = nullptr;
-    GroupSessionData group_session_data;
 
     if (cache::outboundMegolmSessionExists(room_id)) {
         auto res                = cache::getOutboundMegolmSession(room_id);
@@ -675,13 +1083,12 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
     megolm_payload.content.session_key = mtx::crypto::session_key(session.get());
     megolm_payload.type                = mtx::events::EventType::RoomKey;
 
-    if (!sendSessionTo.empty())
-        olm::send_encrypted_to_device_messages(sendSessionTo, megolm_payload);
+    if (sendSessionTo.empty())
+        return session;
 
-    auto data = encrypt_group_message_with_session(session, device_id, body);
+    olm::send_encrypted_to_device_messages(sendSessionTo, megolm_payload);
 
     group_session_data.message_index = olm_outbound_group_session_message_index(session.get());
-    nhlog::crypto()->debug("next message_index {}", group_session_data.message_index);
 
     // update current set of members for the session with the new members and that message_index
     for (const auto &[user, devices] : sendSessionTo) {
@@ -695,14 +1102,55 @@ encrypt_group_message(const std::string &room_id, const std::string &device_id,
         }
     }
 
-    // We need to re-pickle the session after we send a message to save the new message_index.
     cache::updateOutboundMegolmSession(room_id, group_session_data, session);
 
-    return data;
+    return session;
 }
 
-nlohmann::json
-try_olm_decryption(const std::string &sender_key, const mtx::events::msg::OlmCipherContent &msg)
+mtx::events::msg::Encrypted
+encrypt_group_message(const std::string &room_id, const std::string &device_id, nlohmann::json body)
+{
+    auto sessionMtx = outbound_session_lock(room_id);
+    std::lock_guard lock(*sessionMtx);
+
+    GroupSessionData group_session_data;
+    auto session = prepare_group_session(room_id, device_id, group_session_data);
+
+    auto data = encrypt_group_message_with_session(session, device_id, body);
+
+    group_session_data.message_index = olm_outbound_group_session_message_index(session.get());
+    nhlog::crypto()->debug("next message_index {}", group_session_data.message_index);
+
+    // We need to re-pickle the session after we send a message to save the new message_index.
+    cache::updateOutboundMegolmSession(room_id, group_session_data, session);
+
+    return data;
+}
+
+void
+share_group_session_ahead(const std::string &room_id)
+{
+    QThreadPool::globalInstance()->start([room_id, device_id = http::client()->device_id()] {
+        auto sessionMtx = outbound_session_lock(room_id);
+        std::unique_lock lock(*sessionMtx, std::try_to_lock);
+        // a send or another share is already taking care of it
+        if (!lock.owns_lock())
+            return;
+
+        try {
+            GroupSessionData group_session_data;
+            prepare_group_session(room_id, device_id, group_session_data);
+        } catch (const lmdb::error &e) {
+            nhlog::db()->warn("failed to share megolm session of {} ahead: {}", room_id, e.what());
+        } catch (const mtx::crypto::olm_exception &e) {
+            nhlog::crypto()->warn(
+              "failed to share megolm session of {} ahead: {}", room_id, e.what());
+        }
+    });
+}
+
+nlohmann::json
+try_olm_decryption(const std::string &sender_key, const mtx::events::msg::OlmCipherContent &msg)
 {
     auto session_ids = cache::getOlmSessions(sender_key);
 
@@ -754,29 +1202,16 @@ create_inbound_megolm_session(const mtx::events::DeviceEvent<mtx::events::msg::R
                               const std::string &sender_key,
                               const std::string &sender_ed25519)
 {
-    MegolmSessionIndex index;
-    index.room_id    = roomKey.content.room_id;
-    index.session_id = roomKey.content.session_id;
+    auto session = prepare_inbound_megolm_session(roomKey, sender_key, sender_ed25519);
+    if (!session)
+        return;
 
+    auto &[index, megolm_session, data] = *session;
     try {
-        auto megolm_session =
-          olm::client()->init_inbound_group_session(roomKey.content.session_key);
-
-        GroupSessionData data{};
-        data.forwarding_curve25519_key_chain = {sender_key};
-        data.sender_claimed_ed25519_key      = sender_ed25519;
-        data.sender_key                      = sender_key;
-
-        data.trusted = olm_inbound_group_session_is_verified(megolm_session.get());
-
-        backup_session_key(index, data, megolm_session);
         cache::saveInboundMegolmSession(index, std::move(megolm_session), data);
     } catch (const lmdb::error &e) {
         nhlog::crypto()->critical("failed to save inbound megolm session: {}", e.what());
         return;
-    } catch (const mtx::crypto::olm_exception &e) {
-        nhlog::crypto()->critical("failed to create inbound megolm session: {}", e.what());
-        return;
     }
 
     nhlog::crypto()->info(
@@ -893,171 +1328,354 @@ mark_keys_as_published()
     cache::saveOlmAccount(olm::client()->save(cache::client()->pickleSecret()));
 }
 
-void
-download_full_keybackup()
+//! The version of the online key backup and the key to decrypt its sessions, if it is enabled
+//! and usable.
+static std::optional<std::pair<std::string, mtx::crypto::BinaryBuf>>
+usable_keybackup()
 {
     if (!UserSettings::instance()->useOnlineKeyBackup()) {
         // Online key backup disabled
-        nhlog::crypto()->debug("Not downloading full online key backup, because it is disabled.");
-        return;
+        return std::nullopt;
     }
 
     auto backupVersion = cache::client()->backupVersion();
     if (!backupVersion) {
         // no trusted OKB
-        nhlog::crypto()->debug(
-          "Not downloading full online key backup, because we don't have a version for it.");
-        return;
+        return std::nullopt;
     }
 
-    using namespace mtx::crypto;
-
     auto decryptedSecret = cache::secret(mtx::secret_storage::secrets::megolm_backup_v1);
     if (!decryptedSecret) {
         // no backup key available
-        nhlog::crypto()->debug(
-          "Not downloading full online key backup, because we don't have a key for it.");
-        return;
+        return std::nullopt;
     }
-    auto sessionDecryptionKey = to_binary_buf(base642bin(*decryptedSecret));
 
-    nhlog::crypto()->debug("Downloading full online key backup.");
+    return std::pair(backupVersion->version,
+                     mtx::crypto::to_binary_buf(mtx::crypto::base642bin(*decryptedSecret)));
+}
 
-    http::client()->room_keys(
-      backupVersion->version,
-      [sessionDecryptionKey](const mtx::responses::backup::KeysBackup &bk,
-                             mtx::http::RequestErr err) {
-          if (err) {
-              if (err->status_code != 404)
-                  nhlog::crypto()->error("Failed to dowload backup: {} - {}",
-                                         mtx::errors::to_string(err->matrix_error.errcode),
-                                         err->matrix_error.error);
-              return;
-          }
-          nhlog::crypto()->debug("Storing full online key backup.");
+//! Decrypts the backed up sessions of a room. Decrypting is the expensive part of restoring a
+//! backup, so big rooms spread it over several threads.
+static mtx::crypto::ExportedSessionKeys
+decrypt_backup_sessions(const std::string &room,
+                        const mtx::responses::backup::RoomKeysBackup &backup,
+                        const mtx::crypto::BinaryBuf &key)
+{
+    using namespace mtx::crypto;
 
-          mtx::crypto::ExportedSessionKeys allKeys;
-          for (const auto &[room, roomKey] : bk.rooms) {
-              for (const auto &[session_id, encSession] : roomKey.sessions) {
-                  try {
-                      auto session = decrypt_session(encSession.session_data, sessionDecryptionKey);
+    std::vector<std::pair<std::string, const mtx::responses::backup::SessionBackup *>> input;
+    input.reserve(backup.sessions.size());
+    for (const auto &[session_id, encSession] : backup.sessions)
+        input.emplace_back(session_id, &encSession);
 
-                      if (session.algorithm != mtx::crypto::MEGOLM_ALGO)
-                          // don't know this algorithm
-                          return;
+    std::vector<std::optional<ExportedSession>> results(input.size());
+    auto decrypt = [&](std::size_t i) {
+        try {
+            auto session = decrypt_session(input[i].second->session_data, key);
 
-                      ExportedSession sess{};
-                      sess.session_id = session_id;
-                      sess.room_id    = room;
-                      sess.algorithm  = mtx::crypto::MEGOLM_ALGO;
-                      sess.forwarding_curve25519_key_chain =
-                        std::move(session.forwarding_curve25519_key_chain);
-                      sess.sender_claimed_keys = std::move(session.sender_claimed_keys);
-                      sess.sender_key          = std::move(session.sender_key);
-                      sess.session_key         = std::move(session.session_key);
-                      allKeys.sessions.push_back(std::move(sess));
-                  } catch (const olm_exception &e) {
-                      nhlog::crypto()->critical("failed to decrypt inbound megolm session: {}",
-                                                e.what());
-                  }
-              }
-          }
+            if (session.algorithm != mtx::crypto::MEGOLM_ALGO)
+                // don't know this algorithm
+                return;
 
-          // call on UI thread
-          QTimer::singleShot(0, ChatPage::instance(), [keys = std::move(allKeys)] {
-              try {
-                  cache::importSessionKeys(keys);
-                  nhlog::crypto()->debug("Storing full online key backup completed.");
-              } catch (const lmdb::error &e) {
-                  nhlog::crypto()->critical("failed to save inbound megolm session: {}", e.what());
-              }
-          });
+            ExportedSession sess{};
+            sess.session_id = input[i].first;
+            sess.room_id    = room;
+            sess.algorithm  = mtx::crypto::MEGOLM_ALGO;
+            sess.forwarding_curve25519_key_chain =
+              std::move(session.forwarding_curve25519_key_chain);
+            sess.sender_claimed_keys = std::move(session.sender_claimed_keys);
+            sess.sender_key          = std::move(session.sender_key);
+            sess.session_key         = std::move(session.session_key);
+            results[i]               = std::move(sess);
+        } catch (const olm_exception &e) {
+            nhlog::crypto()->critical("failed to decrypt inbound megolm session: {}", e.what());
+        }
+    };
+
+    utils::parallelChunks(
+      input.size(), BACKUP_SESSIONS_PER_THREAD, [&decrypt](std::size_t begin, std::size_t end) {
+          for (std::size_t i = begin; i < end; i++)
+              decrypt(i);
       });
+
+    ExportedSessionKeys keys;
+    for (auto &result : results)
+        if (result)
+            keys.sessions.push_back(std::move(*result));
+    return keys;
 }
-void
-lookup_keybackup(const std::string &room, const std::string &session_id)
+
+//! Decrypts and stores the backed up sessions of a room on the thread pool. The timelines of the
+//! room are notified once about all of them. done is called on the ui thread afterwards.
+static void
+restore_backup_sessions(const std::string &room,
+                        const mtx::responses::backup::RoomKeysBackup &backup,
+                        const mtx::crypto::BinaryBuf &key,
+                        std::function<void()> done = {})
 {
-    if (!UserSettings::instance()->useOnlineKeyBackup()) {
-        // Online key backup disabled
+    QThreadPool::globalInstance()->start([room, backup, key, done] {
+        try {
+            auto keys  = decrypt_backup_sessions(room, backup, key);
+            auto count = cache::importSessionKeys(keys);
+            nhlog::crypto()->debug(
+              "Restored {} sessions of {} from online key backup", count, room);
+        } catch (const lmdb::error &e) {
+            nhlog::crypto()->critical("failed to save inbound megolm session: {}", e.what());
+        }
+
+        if (done)
+            QMetaObject::invokeMethod(ChatPage::instance(), done, Qt::QueuedConnection);
+    });
+}
+
+//! Guards reading and updating the stored progress of restoring the online key backup.
+static std::mutex backupRestoreProgressMtx;
+
+//! Remember, that all sessions of a room were restored from the backup version. Full restores and
+//! lookups of missing sessions both mark rooms, so the stored progress is read for every update.
+static void
+mark_backup_room_restored(const std::string &version, const std::string &room)
+{
+    std::lock_guard lock(backupRestoreProgressMtx);
+    auto progress = cache::client()->backupRestoreProgress();
+    if (!progress || progress->version != version)
+        progress = BackupRestoreProgress{.version = version};
+    progress->restored_rooms.insert(room);
+    cache::client()->saveBackupRestoreProgress(*progress);
+}
+
+static bool
+backup_room_restored(const std::string &version, const std::string &room)
+{
+    auto progress = cache::client()->backupRestoreProgress();
+    return progress && progress->version == version && progress->restored_rooms.count(room);
+}
+
+namespace {
+//! State of a full restore of the online key backup, which goes through it one room at a time.
+struct BackupRestore
+{
+    std::string version;
+    mtx::crypto::BinaryBuf key;
+    //! rooms left to fetch
+    std::vector<std::string> rooms;
+    std::size_t next = 0;
+    bool fetching    = false;
+    //! rooms fetched, but not stored yet
+    std::size_t storing = 0;
+    BackupRestoreProgress progress;
+};
+}
+
+//! Fetches the backed up sessions of the next room, while the previous ones are decrypted and
+//! stored. Called on the ui thread.
+static void
+restore_next_backup_room(std::shared_ptr<BackupRestore> restore)
+{
+    if (restore->fetching || restore->storing >= BACKUP_ROOMS_STORED_AT_ONCE)
         return;
-    }
 
-    auto backupVersion = cache::client()->backupVersion();
-    if (!backupVersion) {
-        // no trusted OKB
+    if (restore->next >= restore->rooms.size()) {
+        if (restore->storing == 0 && !restore->progress.finished) {
+            restore->progress.finished = true;
+            std::lock_guard lock(backupRestoreProgressMtx);
+            if (auto progress = cache::client()->backupRestoreProgress();
+                progress && progress->version == restore->version) {
+                progress->finished = true;
+                cache::client()->saveBackupRestoreProgress(*progress);
+            }
+            nhlog::crypto()->debug("Storing full online key backup completed.");
+        }
         return;
     }
 
-    using namespace mtx::crypto;
+    auto room         = restore->rooms[restore->next++];
+    restore->fetching = true;
 
-    auto decryptedSecret = cache::secret(mtx::secret_storage::secrets::megolm_backup_v1);
-    if (!decryptedSecret) {
-        // no backup key available
+    http::client()->room_keys(
+      restore->version,
+      room,
+      [restore, room](const mtx::responses::backup::RoomKeysBackup &bk,
+                      mtx::http::RequestErr err) {
+          QMetaObject::invokeMethod(
+            ChatPage::instance(),
+            [restore, room, bk, err] {
+                restore->fetching = false;
+
+                auto markRestored = [restore, room] {
+                    restore->progress.restored_rooms.insert(room);
+                    mark_backup_room_restored(restore->version, room);
+                };
+
+                if (err) {
+                    if (err->status_code != 404) {
+                        // stop here, the restore continues on the next start
+                        nhlog::crypto()->error("Failed to dowload backup of {}: {} - {}",
+                                               room,
+                                               mtx::errors::to_string(err->matrix_error.errcode),
+                                               err->matrix_error.error);
+                        return;
+                    }
+
+                    // nothing backed up for this room
+                    markRestored();
+                } else {
+                    restore->storing++;
+                    restore_backup_sessions(room, bk, restore->key, [restore, markRestored] {
+                        restore->storing--;
+                        markRestored();
+                        restore_next_backup_room(restore);
+                    });
+                }
+
+                restore_next_backup_room(restore);
+            },
+            Qt::QueuedConnection);
+      });
+}
+
+void
+download_full_keybackup()
+{
+    auto backup = usable_keybackup();
+    if (!backup) {
+        nhlog::crypto()->debug("Not downloading full online key backup, because it is disabled "
+                               "or we don't have a version or key for it.");
         return;
     }
-    auto sessionDecryptionKey = to_binary_buf(base642bin(*decryptedSecret));
 
-    http::client()->room_keys(
-      backupVersion->version,
-      room,
-      session_id,
-      [room, session_id, sessionDecryptionKey](const mtx::responses::backup::SessionBackup &bk,
-                                               mtx::http::RequestErr err) {
-          if (err) {
-              if (err->status_code != 404)
-                  nhlog::crypto()->error("Failed to dowload key {}:{}: {} - {}",
-                                         room,
-                                         session_id,
-                                         mtx::errors::to_string(err->matrix_error.errcode),
-                                         err->matrix_error.error);
-              return;
-          }
-          try {
-              auto session = decrypt_session(bk.session_data, sessionDecryptionKey);
+    auto restore     = std::make_shared<BackupRestore>();
+    restore->version = backup->first;
+    restore->key     = backup->second;
 
-              if (session.algorithm != mtx::crypto::MEGOLM_ALGO)
-                  // don't know this algorithm
-                  return;
+    std::lock_guard lock(backupRestoreProgressMtx);
+    // continue an interrupted restore of the same backup
+    if (auto progress = cache::client()->backupRestoreProgress();
+        progress && progress->version == restore->version && !progress->finished)
+        restore->progress = std::move(*progress);
+    restore->progress.version = restore->version;
 
-              MegolmSessionIndex index;
-              index.room_id    = room;
-              index.session_id = session_id;
+    for (auto &room : cache::joinedRooms())
+        if (!restore->progress.restored_rooms.count(room))
+            restore->rooms.push_back(std::move(room));
 
-              GroupSessionData data{};
-              data.forwarding_curve25519_key_chain = session.forwarding_curve25519_key_chain;
-              data.sender_claimed_ed25519_key      = session.sender_claimed_keys["ed25519"];
-              data.sender_key                      = session.sender_key;
+    nhlog::crypto()->debug("Downloading full online key backup, {} rooms left, {} done.",
+                           restore->rooms.size(),
+                           restore->progress.restored_rooms.size());
 
-              // online key backup can't be trusted, because anyone can upload to it.
-              data.trusted = false;
+    cache::client()->saveBackupRestoreProgress(restore->progress);
+    lock.unlock();
+    restore_next_backup_room(restore);
+}
 
-              auto megolm_session =
-                olm::client()->import_inbound_group_session(session.session_key);
+//! Missing sessions per room, which are looked up in the online key backup shortly. Only used on
+//! the ui thread.
+static std::map<std::string, std::set<std::string>> pendingBackupLookups;
 
-              if (!cache::inboundMegolmSessionExists(index) ||
-                  olm_inbound_group_session_first_known_index(megolm_session.get()) <
-                    olm_inbound_group_session_first_known_index(
-                      cache::getInboundMegolmSession(index).get())) {
-                  cache::saveInboundMegolmSession(index, std::move(megolm_session), data);
+static void
+lookup_pending_keybackup(const std::string &room)
+{
+    auto sessions = std::move(pendingBackupLookups[room]);
+    pendingBackupLookups.erase(room);
 
-                  nhlog::crypto()->info("imported inbound megolm session "
-                                        "from key backup ({}, {})",
-                                        room,
-                                        session_id);
+    auto backup = usable_keybackup();
+    if (!backup || sessions.empty())
+        return;
 
-                  // call on UI thread
-                  QTimer::singleShot(0, ChatPage::instance(), [index] {
-                      ChatPage::instance()->receivedSessionKey(index.room_id, index.session_id);
-                  });
+    const auto &version = backup->first;
+    const auto &key     = backup->second;
+
+    // Scrolling through an old room runs into many missing sessions, which are cheaper to
+    // restore all at once. Once a room was restored from this backup, the sessions still missing
+    // are mostly not backed up at all, so they are looked up a few at a time and the rest stays
+    // queued for the next lookup.
+    if (sessions.size() > KEY_BACKUP_SINGLE_LOOKUPS) {
+        if (backup_room_restored(version, room)) {
+            nhlog::crypto()->debug("Looking up {} of {} missing sessions of the restored room {}",
+                                   KEY_BACKUP_SINGLE_LOOKUPS,
+                                   sessions.size(),
+                                   room);
+            auto &queued = pendingBackupLookups[room];
+            while (sessions.size() > KEY_BACKUP_SINGLE_LOOKUPS)
+                queued.insert(sessions.extract(std::prev(sessions.end())));
+            QTimer::singleShot(KEY_BACKUP_LOOKUP_DELAY_MS, ChatPage::instance(), [room] {
+                lookup_pending_keybackup(room);
+            });
+        } else {
+            nhlog::crypto()->debug(
+              "Restoring all sessions of {} from online key backup for {} missing sessions",
+              room,
+              sessions.size());
+
+            http::client()->room_keys(
+              version,
+              room,
+              [room, version, key](const mtx::responses::backup::RoomKeysBackup &bk,
+                                   mtx::http::RequestErr err) {
+                  if (err) {
+                      if (err->status_code != 404) {
+                          nhlog::crypto()->error(
+                            "Failed to dowload backup of {}: {} - {}",
+                            room,
+                            mtx::errors::to_string(err->matrix_error.errcode),
+                            err->matrix_error.error);
+                          return;
+                      }
+
+                      // nothing backed up for this room
+                      QMetaObject::invokeMethod(
+                        ChatPage::instance(),
+                        [room, version] { mark_backup_room_restored(version, room); },
+                        Qt::QueuedConnection);
+                      return;
+                  }
+
+                  restore_backup_sessions(
+                    room, bk, key, [room, version] { mark_backup_room_restored(version, room); });
+              });
+            return;
+        }
+    }
+
+    for (const auto &session_id : sessions) {
+        http::client()->room_keys(
+          version,
+          room,
+          session_id,
+          [room, session_id, key](const mtx::responses::backup::SessionBackup &bk,
+                                  mtx::http::RequestErr err) {
+              if (err) {
+                  if (err->status_code != 404)
+                      nhlog::crypto()->error("Failed to dowload key {}:{}: {} - {}",
+                                             room,
+                                             session_id,
+                                             mtx::errors::to_string(err->matrix_error.errcode),
+                                             err->matrix_error.error);
+                  return;
               }
-          } catch (const lmdb::error &e) {
-              nhlog::crypto()->critical("failed to save inbound megolm session: {}", e.what());
-              return;
-          } catch (const mtx::crypto::olm_exception &e) {
-              nhlog::crypto()->critical("failed to import inbound megolm session: {}", e.what());
-              return;
-          }
-      });
+
+              mtx::responses::backup::RoomKeysBackup roomBackup;
+              roomBackup.sessions[session_id] = bk;
+              restore_backup_sessions(room, roomBackup, key);
+          });
+    }
+}
+
+void
+lookup_keybackup(const std::string &room, const std::string &session_id)
+{
+    if (!UserSettings::instance()->useOnlineKeyBackup()) {
+        // Online key backup disabled
+        return;
+    }
+
+    auto &sessions = pendingBackupLookups[room];
+    // the first missing session of a room schedules the lookup of all of them
+    if (sessions.empty())
+        QTimer::singleShot(KEY_BACKUP_LOOKUP_DELAY_MS, ChatPage::instance(), [room] {
+            lookup_pending_keybackup(room);
+        });
+    sessions.insert(session_id);
 }
 
 void
@@ -1225,50 +1843,10 @@ send_megolm_key_to_device(const std::string &user_id,
     nhlog::crypto()->debug("Forwarded key to {}:{}", user_id, device_id);
 }
 
-DecryptionResult
-decryptEvent(const MegolmSessionIndex &index,
-             const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event,
-             bool dont_write_db)
+static DecryptionResult
+parseDecryptedEvent(const std::string &msg_str,
+                    const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event)
 {
-    try {
-        if (!cache::client()->inboundMegolmSessionExists(index)) {
-            return {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
-        }
-    } catch (const lmdb::error &e) {
-        return {DecryptionErrorCode::DbError, e.what(), std::nullopt};
-    }
-
-    std::string msg_str;
-    try {
-        auto session = cache::client()->getInboundMegolmSession(index);
-        if (!session) {
-            return {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
-        }
-
-        auto sessionData =
-          cache::client()->getMegolmSessionData(index).value_or(GroupSessionData{});
-
-        auto res = olm::client()->decrypt_group_message(session.get(), event.content.ciphertext);
-        msg_str  = std::string((char *)res.data.data(), res.data.size());
-
-        if (!event.event_id.empty() && event.event_id[0] == '$') {
-            auto oldIdx = sessionData.indices.find(res.message_index);
-            if (oldIdx != sessionData.indices.end()) {
-                if (oldIdx->second != event.event_id)
-                    return {DecryptionErrorCode::ReplayAttack, std::nullopt, std::nullopt};
-            } else if (!dont_write_db) {
-                sessionData.indices[res.message_index] = event.event_id;
-                cache::client()->saveInboundMegolmSession(index, std::move(session), sessionData);
-            }
-        }
-    } catch (const lmdb::error &e) {
-        return {DecryptionErrorCode::DbError, e.what(), std::nullopt};
-    } catch (const mtx::crypto::olm_exception &e) {
-        if (e.error_code() == mtx::crypto::OlmErrorCode::OLM_UNKNOWN_MESSAGE_INDEX)
-            return {DecryptionErrorCode::MissingSessionIndex, e.what(), std::nullopt};
-        return {DecryptionErrorCode::DecryptionFailed, e.what(), std::nullopt};
-    }
-
     try {
         // Add missing fields for the event.
         nlohmann::json body      = nlohmann::json::parse(msg_str);
@@ -1281,7 +1859,7 @@ decryptEvent(const MegolmSessionIndex &index,
           body.get<mtx::events::collections::TimelineEvents>();
 
         // relations are unencrypted in content...
-        mtx::accessors::set_relations(te, std::move(event.content.relations));
+        mtx::accessors::set_relations(te, event.content.relations);
 
         return {DecryptionErrorCode::NoError, std::nullopt, std::move(te)};
     } catch (std::exception &e) {
@@ -1289,6 +1867,149 @@ decryptEvent(const MegolmSessionIndex &index,
     }
 }
 
+//! Logs the average time spent per decrypted event every few hundred events.
+static void
+recordDecryptionLatency(std::size_t events, qint64 nsecs)
+{
+    static std::atomic<uint64_t> eventCount = 0, totalNsecs = 0, lastReport = 0;
+
+    auto count = eventCount += events;
+    auto total = totalNsecs += static_cast<uint64_t>(nsecs);
+
+    auto reported = lastReport.load();
+    if (count - reported >= 500 && lastReport.compare_exchange_strong(reported, count))
+        nhlog::crypto()->debug("Decrypted {} megolm events, average latency {}us per event",
+                               count,
+                               total / count / 1000);
+}
+
+DecryptionResult
+decryptEvent(const MegolmSessionIndex &index,
+             const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event,
+             bool dont_write_db)
+{
+    std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> events{event};
+    return std::move(decryptEvents(index.room_id, events, dont_write_db).front());
+}
+
+std::vector<DecryptionResult>
+decryptEvents(const std::string &room_id,
+              const std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> &events,
+              bool dont_write_db)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<DecryptionResult> results(
+      events.size(), DecryptionResult{DecryptionErrorCode::NoError, std::nullopt, std::nullopt});
+
+    // group by session, so that every session is only looked up and unpickled once
+    std::map<std::string, std::vector<std::size_t>> eventsBySession;
+    for (std::size_t i = 0; i < events.size(); i++)
+        eventsBySession[events[i].content.session_id].push_back(i);
+
+    for (const auto &[session_id, eventIndices] : eventsBySession) {
+        MegolmSessionIndex index;
+        index.room_id    = room_id;
+        index.session_id = session_id;
+
+        // plaintext and message index of each event
+        std::vector<std::optional<std::pair<std::string, uint32_t>>> plaintexts(
+          eventIndices.size());
+
+        try {
+            bool found = cache::client()->withInboundMegolmSession(
+              index, [&](const mtx::crypto::InboundGroupSessionPtr &session) {
+                  for (std::size_t j = 0; j < eventIndices.size(); j++) {
+                      const auto &event = events[eventIndices[j]];
+                      try {
+                          auto res = olm::client()->decrypt_group_message(
+                            session.get(), event.content.ciphertext);
+                          plaintexts[j] = {
+                            std::string((char *)res.data.data(), res.data.size()),
+                            res.message_index};
+                      } catch (const mtx::crypto::olm_exception &e) {
+                          if (e.error_code() ==
+                              mtx::crypto::OlmErrorCode::OLM_UNKNOWN_MESSAGE_INDEX)
+                              results[eventIndices[j]] = {
+                                DecryptionErrorCode::MissingSessionIndex, e.what(), std::nullopt};
+                          else
+                              results[eventIndices[j]] = {
+                                DecryptionErrorCode::DecryptionFailed, e.what(), std::nullopt};
+                      }
+                  }
+              });
+
+            if (!found) {
+                for (auto i : eventIndices)
+                    results[i] = {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
+                continue;
+            }
+        } catch (const mtx::crypto::olm_exception &e) {
+            // the pickled session could not be restored
+            for (auto i : eventIndices)
+                results[i] = {DecryptionErrorCode::DecryptionFailed, e.what(), std::nullopt};
+            continue;
+        } catch (const lmdb::error &e) {
+            for (auto i : eventIndices)
+                results[i] = {DecryptionErrorCode::DbError, e.what(), std::nullopt};
+            continue;
+        }
+
+        // Message index -> event id, that used it first. Indices seen for the first time are
+        // claimed in one write transaction, so that concurrent decryptions of the same session
+        // can't both accept different events with the same index.
+        auto sessionData =
+          cache::client()->getMegolmSessionData(index).value_or(GroupSessionData{});
+        auto &claimed = sessionData.indices;
+        std::map<uint32_t, std::string> newIndices;
+        for (std::size_t j = 0; j < eventIndices.size(); j++) {
+            const auto &event = events[eventIndices[j]];
+            if (plaintexts[j] && !event.event_id.empty() && event.event_id[0] == '$' &&
+                !claimed.count(plaintexts[j]->second))
+                newIndices.try_emplace(plaintexts[j]->second, event.event_id);
+        }
+
+        if (!newIndices.empty() && !dont_write_db) {
+            try {
+                for (auto &[messageIndex, eventId] :
+                     cache::client()->saveMegolmSessionIndices(index, newIndices))
+                    claimed[messageIndex] = std::move(eventId);
+            } catch (const lmdb::error &e) {
+                for (auto i : eventIndices)
+                    if (!results[i].error)
+                        results[i] = {DecryptionErrorCode::DbError, e.what(), std::nullopt};
+                continue;
+            }
+        } else {
+            claimed.merge(newIndices);
+        }
+
+        for (std::size_t j = 0; j < eventIndices.size(); j++) {
+            if (!plaintexts[j])
+                continue;
+
+            const auto &event                  = events[eventIndices[j]];
+            const auto &[msg_str, messageIndex] = *plaintexts[j];
+
+            if (!event.event_id.empty() && event.event_id[0] == '$') {
+                auto owner = claimed.find(messageIndex);
+                if (owner != claimed.end() && owner->second != event.event_id) {
+                    results[eventIndices[j]] = {
+                      DecryptionErrorCode::ReplayAttack, std::nullopt, std::nullopt};
+                    continue;
+                }
+            }
+
+            results[eventIndices[j]] = parseDecryptedEvent(msg_str, event);
+        }
+    }
+
+    recordDecryptionLatency(events.size(), timer.nsecsElapsed());
+
+    return results;
+}
+
 crypto::Trust
 calculate_trust(const std::string &user_id,
                 const std::string &room_id,
@@ -1299,12 +2020,13 @@ calculate_trust(const std::string &user_id,
     crypto::Trust trustlevel = crypto::Trust::MessageUnverified;
 
     try {
-        auto session = cache::client()->getInboundMegolmSession(index);
-        if (!session) {
+        bool found = cache::client()->withInboundMegolmSession(
+          index, [&event](const mtx::crypto::InboundGroupSessionPtr &session) {
+              olm::client()->decrypt_group_message(session.get(), event.ciphertext);
+          });
+        if (!found) {
             return trustlevel;
         }
-
-        olm::client()->decrypt_group_message(session.get(), event.ciphertext);
     } catch (const lmdb::error &e) {
         return trustlevel;
     } catch (const mtx::crypto::olm_exception &e) {
@@ -1321,6 +2043,105 @@ calculate_trust(const std::string &user_id,
     return trustlevel;
 }
 
+namespace {
+//! A device to encrypt a to device message for.
+struct OlmTarget
+{
+    std::string user_id;
+    std::string device_id;
+    DevicePublicKeys keys;
+    //! One time key to create a new session with. If empty, the latest session is used.
+    std::string otk;
+
+    mtx::crypto::OlmSessionPtr session = nullptr;
+    std::optional<mtx::events::msg::OlmEncrypted> message;
+};
+
+using OlmMessages =
+  std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>;
+}
+
+//! Encrypts ev_json for each target, which has a session or a one time key. Every device has its
+//! own session, so big rooms spread the encryption over several threads.
+static void
+encrypt_olm_messages(std::vector<OlmTarget> &targets, const nlohmann::json &ev_json)
+{
+    auto encrypt = [&ev_json](OlmTarget &target) {
+        if (!target.otk.empty()) {
+            target.session =
+              olm::client()->create_outbound_session(target.keys.curve25519, target.otk);
+        } else if (auto session = cache::getLatestOlmSession(target.keys.curve25519)) {
+            target.session = std::move(*session);
+        } else {
+            return;
+        }
+
+        target.message = olm::client()
+                           ->create_olm_encrypted_content(target.session.get(),
+                                                          ev_json,
+                                                          UserId(target.user_id),
+                                                          target.keys.ed25519,
+                                                          target.keys.curve25519)
+                           .get<mtx::events::msg::OlmEncrypted>();
+    };
+
+    utils::parallelChunks(
+      targets.size(), OLM_ENCRYPTIONS_PER_THREAD, [&](std::size_t begin, std::size_t end) {
+          for (std::size_t i = begin; i < end; i++)
+              encrypt(targets[i]);
+      });
+}
+
+//! Moves the encrypted messages of the targets into messages and their sessions into sessions.
+static void
+collect_olm_messages(std::vector<OlmTarget> &targets,
+                     OlmMessages &messages,
+                     std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> &sessions)
+{
+    for (auto &target : targets) {
+        if (!target.message)
+            continue;
+
+        messages[mtx::identifiers::parse<mtx::identifiers::User>(target.user_id)]
+                [target.device_id] = std::move(*target.message);
+        sessions.emplace_back(target.keys.curve25519, std::move(target.session));
+    }
+}
+
+//! Sends the messages in requests of at most TO_DEVICE_MESSAGES_PER_REQUEST messages each, so
+//! that sharing a key with thousands of devices doesn't hit request size limits.
+static void
+send_olm_messages(OlmMessages messages)
+{
+    auto send = [](const OlmMessages &chunk) {
+        http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
+          http::client()->generate_txn_id(), chunk, [](mtx::http::RequestErr err) {
+              if (err) {
+                  nhlog::net()->warn("failed to send "
+                                     "send_to_device "
+                                     "message: {}",
+                                     err->matrix_error.error);
+              }
+          });
+    };
+
+    OlmMessages chunk;
+    std::size_t count = 0;
+    for (auto &[user, devices] : messages) {
+        for (auto &[device, message] : devices) {
+            chunk[user][device] = std::move(message);
+            if (++count >= TO_DEVICE_MESSAGES_PER_REQUEST) {
+                send(chunk);
+                chunk.clear();
+                count = 0;
+            }
+        }
+    }
+
+    if (!chunk.empty())
+        send(chunk);
+}
+
 //! Send encrypted to device messages, targets is a map from userid to device ids or {} for all
 //! devices
 void
@@ -1329,13 +2150,14 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                                   bool force_new_session)
 {
     static QMap<std::pair<std::string, std::string>, qint64> rateLimit;
+    // sessions may also be shared ahead from a worker thread
+    static std::mutex rateLimitMtx;
 
     nlohmann::json ev_json = std::visit([](const auto &e) { return nlohmann::json(e); }, event);
 
     std::map<std::string, std::vector<std::string>> keysToQuery;
     mtx::requests::ClaimKeys claims;
-    std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-      messages;
+    OlmMessages messages;
     std::map<std::string, std::map<std::string, DevicePublicKeys>> pks;
 
     auto our_curve = olm::client()->identity_keys().curve25519;
@@ -1343,6 +2165,8 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
     {
         auto currentTime = QDateTime::currentSecsSinceEpoch();
         std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessionsToPersist;
+        std::vector<OlmTarget> encryptTo;
+        std::vector<OlmTarget> withoutSession;
 
         for (const auto &[user, devices] : targets) {
             auto deviceKeys = cache::client()->userKeys(user);
@@ -1383,35 +2207,49 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                     continue;
                 }
 
-                auto session = cache::getLatestOlmSession(device_curve);
-                if (!session || force_new_session) {
-                    if (rateLimit.value(std::pair(user, device)) + 60 * 60 * 10 < currentTime) {
-                        claims.one_time_keys[user][device] = mtx::crypto::SIGNED_CURVE25519;
-                        pks[user][device].ed25519          = d.keys.at("ed25519:" + device);
-                        pks[user][device].curve25519       = d.keys.at("curve25519:" + device);
-
-                        rateLimit.insert(std::pair(user, device), currentTime);
-                    } else {
-                        nhlog::crypto()->warn("Not creating new session with {}:{} "
-                                              "because of rate limit",
-                                              user,
-                                              device);
-                    }
-                    continue;
-                }
+                OlmTarget target{
+                  .user_id   = user,
+                  .device_id = device,
+                  .keys      = DevicePublicKeys{d.keys.at("ed25519:" + device), device_curve},
+                };
+                if (force_new_session)
+                    withoutSession.push_back(std::move(target));
+                else
+                    encryptTo.push_back(std::move(target));
+            }
+        }
 
-                messages[mtx::identifiers::parse<mtx::identifiers::User>(user)][device] =
-                  olm::client()
-                    ->create_olm_encrypted_content(session->get(),
-                                                   ev_json,
-                                                   UserId(user),
-                                                   d.keys.at("ed25519:" + device),
-                                                   device_curve)
-                    .get<mtx::events::msg::OlmEncrypted>();
-                sessionsToPersist.emplace_back(d.keys.at("curve25519:" + device),
-                                               std::move(*session));
+        std::set<std::string> targetKeys;
+        for (const auto &target : encryptTo)
+            targetKeys.insert(target.keys.curve25519);
+        // held until the advanced sessions are stored
+        auto sessionLocks = lock_olm_sessions(targetKeys);
+
+        // looking up and unpickling the sessions is part of the work spread over the threads
+        encrypt_olm_messages(encryptTo, ev_json);
+        collect_olm_messages(encryptTo, messages, sessionsToPersist);
+
+        for (auto &target : encryptTo)
+            if (!target.message)
+                withoutSession.push_back(std::move(target));
+
+        std::unique_lock rateLimitLock(rateLimitMtx);
+        for (const auto &target : withoutSession) {
+            const auto &user   = target.user_id;
+            const auto &device = target.device_id;
+            if (rateLimit.value(std::pair(user, device)) + 60 * 60 * 10 < currentTime) {
+                claims.one_time_keys[user][device] = mtx::crypto::SIGNED_CURVE25519;
+                pks[user][device]                  = target.keys;
+
+                rateLimit.insert(std::pair(user, device), currentTime);
+            } else {
+                nhlog::crypto()->warn("Not creating new session with {}:{} "
+                                      "because of rate limit",
+                                      user,
+                                      device);
             }
         }
+        rateLimitLock.unlock();
 
         if (!sessionsToPersist.empty()) {
             try {
@@ -1423,26 +2261,19 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                 nhlog::crypto()->critical("failed to pickle outbound olm session: {}", e.what());
             }
         }
+        sessionLocks.clear();
     }
 
     if (!messages.empty())
-        http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-          http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-              if (err) {
-                  nhlog::net()->warn("failed to send "
-                                     "send_to_device "
-                                     "message: {}",
-                                     err->matrix_error.error);
-              }
-          });
+        send_olm_messages(std::move(messages));
 
     auto BindPks = [ev_json](decltype(pks) pks_temp) {
         return [pks = pks_temp, ev_json](const mtx::responses::ClaimKeys &res,
                                          mtx::http::RequestErr) {
-            std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-              messages;
+            OlmMessages messages;
             auto currentTime = QDateTime::currentSecsSinceEpoch();
             std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessionsToPersist;
+            std::vector<OlmTarget> newSessions;
 
             for (const auto &[user_id, retrieved_devices] : res.one_time_keys) {
                 nhlog::net()->debug("claimed keys for {}", user_id);
@@ -1463,8 +2294,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
 
                     auto otk = rd.second.begin()->at("key").get<std::string>();
 
-                    auto sign_key = pks.at(user_id).at(device_id).ed25519;
-                    auto id_key   = pks.at(user_id).at(device_id).curve25519;
+                    const auto &sign_key = pks.at(user_id).at(device_id).ed25519;
 
                     // Verify signature
                     {
@@ -1481,19 +2311,19 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                         }
                     }
 
-                    auto session = olm::client()->create_outbound_session(id_key, otk);
-
-                    messages[mtx::identifiers::parse<mtx::identifiers::User>(user_id)][device_id] =
-                      olm::client()
-                        ->create_olm_encrypted_content(
-                          session.get(), ev_json, UserId(user_id), sign_key, id_key)
-                        .get<mtx::events::msg::OlmEncrypted>();
-
-                    sessionsToPersist.emplace_back(id_key, std::move(session));
+                    newSessions.push_back(OlmTarget{
+                      .user_id   = user_id,
+                      .device_id = device_id,
+                      .keys      = pks.at(user_id).at(device_id),
+                      .otk       = std::move(otk),
+                    });
                 }
                 nhlog::net()->info("send_to_device: {}", user_id);
             }
 
+            encrypt_olm_messages(newSessions, ev_json);
+            collect_olm_messages(newSessions, messages, sessionsToPersist);
+
             if (!sessionsToPersist.empty()) {
                 try {
                     nhlog::crypto()->debug("Updated (new) olm sessions: {}",
@@ -1508,15 +2338,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
             }
 
             if (!messages.empty())
-                http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-                  http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-                      if (err) {
-                          nhlog::net()->warn("failed to send "
-                                             "send_to_device "
-                                             "message: {}",
-                                             err->matrix_error.error);
-                      }
-                  });
+                send_olm_messages(std::move(messages));
         };
     };
 
@@ -1591,6 +2413,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                       }
 
                       auto currentTime = QDateTime::currentSecsSinceEpoch();
+                      std::lock_guard lock(rateLimitMtx);
                       if (rateLimit.value(std::pair(user.first, device_id.get())) + 60 * 60 * 10 <
                           currentTime) {
                           deviceKeys[user_id].emplace(device_id, pks);
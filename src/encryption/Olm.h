@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <functional>
+
 #include <mtx/events.hpp>
 #include <mtx/events/encrypted.hpp>
 #include <mtxclient/crypto/client.hpp>
@@ -52,8 +54,11 @@ from_json(const nlohmann::json &obj, OlmMessage &msg);
 mtx::crypto::OlmClient *
 client();
 
+//! Handles the to device messages of a sync. done is called on the ui thread, once the room keys
+//! sent in them are stored, so that the timelines don't request them for the events of the sync.
 void
-handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEvents> &msgs);
+handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEvents> &msgs,
+                          std::function<void()> done = {});
 
 nlohmann::json
 try_olm_decryption(const std::string &sender_key,
@@ -89,12 +94,23 @@ mtx::events::msg::Encrypted
 encrypt_group_message(const std::string &room_id,
                       const std::string &device_id,
                       nlohmann::json body);
+//! Rotate the outbound session of an encrypted room if necessary and share it with new members
+//! and devices on a worker thread, so that sending the next message only needs to encrypt it.
+void
+share_group_session_ahead(const std::string &room_id);
 
 //! Decrypt an event. Use dont_write_db to prevent db writes when already in a write transaction.
 DecryptionResult
 decryptEvent(const MegolmSessionIndex &index,
              const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event,
              bool dont_write_db = false);
+//! Decrypt a batch of events from the same room. Events are grouped by session, so that each
+//! session is only loaded once. Results are returned in the same order as the events. This does
+//! not touch any UI state and can be called from worker threads.
+std::vector<DecryptionResult>
+decryptEvents(const std::string &room_id,
+              const std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> &events,
+              bool dont_write_db = false);
 crypto::Trust
 calculate_trust(const std::string &user_id,
                 const std::string &room_id,
@@ -4,7 +4,10 @@
 
 #include "EventStore.h"
 
+#include <QElapsedTimer>
+#include <QPointer>
 #include <QThread>
+#include <QThreadPool>
 #include <QTimer>
 
 #include <nlohmann/json.hpp>
@@ -28,6 +31,7 @@ QCache<EventStore::Index, mtx::events::collections::TimelineEvents> EventStore::
 
 EventStore::EventStore(std::string room_id, QObject *)
   : room_id_(std::move(room_id))
+  , room_(room_id_)
 {
     auto range = cache::client()->getTimelineRange(room_id_);
 
@@ -62,12 +66,17 @@ EventStore::EventStore(std::string room_id, QObject *)
       &EventStore::oldMessagesRetrieved,
       this,
       [this](const mtx::responses::Messages &res) {
+          // the older events are stored in front of the first one, which is still in the cache
+          historyTrimmed();
+
           if (res.end.empty() || cache::client()->previousBatchToken(room_id_) == res.end) {
               noMoreMessages = true;
               emit fetchedMore();
               return;
           }
 
+          decryptInBackground(res.chunk);
+
           uint64_t newFirst = cache::client()->saveOldMessages(room_id_, res);
           if (newFirst == first) {
               fetchMore();
@@ -141,7 +150,7 @@ EventStore::EventStore(std::string room_id, QObject *)
                         emit messageSent(txn_id, event_id.event_id.to_string());
                         if constexpr (std::is_same_v<decltype(e.content),
                                                      mtx::events::msg::Encrypted>) {
-                            auto event = decryptEvent({room_id_, e.event_id}, e);
+                            auto event = decryptEvent({room_, e.event_id}, e);
                             if (event->event) {
                                 if (auto dec = std::get_if<mtx::events::RoomEvent<
                                       mtx::events::msg::KeyVerificationRequest>>(
@@ -193,7 +202,7 @@ EventStore::EventStore(std::string room_id, QObject *)
                   if (auto encrypted =
                         std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(
                           &pending_event.value())) {
-                      auto d_event = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
+                      auto d_event = decryptEvent({room_, encrypted->event_id}, *encrypted);
                       if (d_event->event) {
                           was_encrypted      = true;
                           original_encrypted = std::move(*encrypted);
@@ -260,9 +269,9 @@ EventStore::EventStore(std::string room_id, QObject *)
 
                   auto idx = idToIndex(pending_event_id);
 
-                  events_by_id_.remove({room_id_, pending_event_id});
+                  events_by_id_.remove({room_, pending_event_id});
                   if (idx)
-                      events_.remove({room_id_, toInternalIdx(*idx)});
+                      events_.remove({room_, toInternalIdx(*idx)});
               }
           }
 
@@ -328,6 +337,32 @@ EventStore::clearTimeline()
     emit endResetModel();
 }
 
+void
+EventStore::historyTrimmed()
+{
+    auto range = cache::client()->getTimelineRange(room_id_);
+    if (!range || this->last == std::numeric_limits<uint64_t>::max() || range->first <= this->first)
+        return;
+
+    // the indexes of the deleted events are used again for older events
+    for (const auto &index : events_.keys())
+        if (index.room == room_ && index.idx < range->first)
+            events_.remove(index);
+    noMoreMessages = false;
+
+    if (range->first > this->last) {
+        emit beginResetModel();
+        this->first = range->first;
+        this->last  = range->last;
+        emit endResetModel();
+        return;
+    }
+
+    emit beginRemoveRows(0, toExternalIdx(range->first - 1));
+    this->first = range->first;
+    emit endRemoveRows();
+}
+
 void
 EventStore::receivedSessionKey(const std::string &session_id)
 {
@@ -345,18 +380,18 @@ EventStore::receivedSessionKey(const std::string &session_id)
     for (const auto &e : request.events) {
         auto idx = idToIndex(e.event_id);
         if (idx) {
-            decryptedEvents_.remove({room_id_, e.event_id});
-            events_by_id_.remove({room_id_, e.event_id});
-            events_.remove({room_id_, toInternalIdx(*idx)});
+            decryptedEvents_.remove({room_, e.event_id});
+            events_by_id_.remove({room_, e.event_id});
+            events_.remove({room_, toInternalIdx(*idx)});
             emit dataChanged(*idx, *idx);
         }
 
         if (auto edit = e.content.relations.replaces()) {
             auto edit_idx = idToIndex(edit.value());
             if (edit_idx) {
-                decryptedEvents_.remove({room_id_, e.event_id});
-                events_by_id_.remove({room_id_, e.event_id});
-                events_.remove({room_id_, toInternalIdx(*edit_idx)});
+                decryptedEvents_.remove({room_, e.event_id});
+                events_by_id_.remove({room_, e.event_id});
+                events_.remove({room_, toInternalIdx(*edit_idx)});
                 emit dataChanged(*edit_idx, *edit_idx);
             }
         }
@@ -449,20 +484,22 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         emit endInsertRows();
     }
 
+    decryptInBackground(events.events);
+
     for (const auto &event : events.events) {
         std::set<std::string> relates_to;
         std::string edited_event;
         if (auto redaction =
               std::get_if<mtx::events::RedactionEvent<mtx::events::msg::Redaction>>(&event)) {
             // fixup reactions
-            auto redacted = events_by_id_.object({room_id_, redaction->redacts});
+            auto redacted = events_by_id_.object({room_, redaction->redacts});
             if (redacted) {
                 auto id = mtx::accessors::relations(*redacted);
                 if (id.annotates()) {
                     auto idx = idToIndex(id.annotates()->event_id);
                     if (idx) {
-                        events_by_id_.remove({room_id_, redaction->redacts});
-                        events_.remove({room_id_, toInternalIdx(*idx)});
+                        events_by_id_.remove({room_, redaction->redacts});
+                        events_.remove({room_, toInternalIdx(*idx)});
                         emit dataChanged(*idx, *idx);
                     }
                 }
@@ -481,9 +518,9 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         for (const auto &relates_to_id : relates_to) {
             auto idx = cache::client()->getTimelineIndex(room_id_, relates_to_id);
             if (idx) {
-                events_by_id_.remove({room_id_, relates_to_id});
-                decryptedEvents_.remove({room_id_, relates_to_id});
-                events_.remove({room_id_, *idx});
+                events_by_id_.remove({room_, relates_to_id});
+                decryptedEvents_.remove({room_, relates_to_id});
+                events_.remove({room_, *idx});
                 emit dataChanged(toExternalIdx(*idx), toExternalIdx(*idx));
             }
         }
@@ -491,7 +528,7 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         if (auto txn_id = mtx::accessors::transaction_id(event); !txn_id.empty()) {
             auto idx = cache::client()->getTimelineIndex(room_id_, mtx::accessors::event_id(event));
             if (idx) {
-                Index index{room_id_, *idx};
+                Index index{room_, *idx};
                 events_.remove(index);
                 emit dataChanged(toExternalIdx(*idx), toExternalIdx(*idx));
             }
@@ -510,7 +547,7 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         // decrypting and checking some encrypted messages
         if (auto encrypted =
               std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event)) {
-            auto d_event = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
+            auto d_event = decryptEvent({room_, encrypted->event_id}, *encrypted);
             if (d_event->event &&
                 mtx::accessors::sender(*d_event->event) != utils::localUser().toStdString()) {
                 handle_room_verification(this, *d_event->event);
@@ -640,7 +677,7 @@ EventStore::get(int idx, bool decrypt)
     if (this->thread() != QThread::currentThread())
         nhlog::db()->warn("{} called from a different thread!", __func__);
 
-    Index index{room_id_, toInternalIdx(idx)};
+    Index index{room_, toInternalIdx(idx)};
     if (index.idx > last || index.idx < first)
         return nullptr;
 
@@ -667,7 +704,7 @@ EventStore::get(int idx, bool decrypt)
     if (decrypt) {
         if (auto encrypted =
               std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(event_ptr)) {
-            auto decrypted = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
+            auto decrypted = decryptEvent({room_, encrypted->event_id}, *encrypted);
             if (decrypted->event)
                 return &*decrypted->event;
         }
@@ -764,6 +801,76 @@ EventStore::decryptEvent(const IdIndex &idx,
     return asCacheEntry(std::move(decryptionResult));
 }
 
+void
+EventStore::decryptInBackground(const std::vector<mtx::events::collections::TimelineEvents> &events)
+{
+    // group by session, so that every worker only loads the session it needs once
+    std::map<std::string, std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>>
+      bySession;
+    for (const auto &event : events) {
+        auto encrypted =
+          std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event);
+        if (!encrypted || encrypted->event_id.empty() ||
+            decryptedEvents_.contains({room_, encrypted->event_id}))
+            continue;
+
+        bySession[encrypted->content.session_id].push_back(*encrypted);
+    }
+
+    for (auto &[session_id, sessionEvents] : bySession) {
+        (void)session_id;
+        QThreadPool::globalInstance()->start(
+          [self    = QPointer<EventStore>(this),
+           room_id = room_id_,
+           evs     = std::move(sessionEvents)]() mutable {
+              QElapsedTimer timer;
+              timer.start();
+
+              auto results = olm::decryptEvents(room_id, evs);
+
+              auto elapsed = timer.nsecsElapsed();
+              nhlog::crypto()->debug("Decrypted {} events in {} in {}us ({:.0f} events/s)",
+                                     evs.size(),
+                                     room_id,
+                                     elapsed / 1000,
+                                     elapsed ? evs.size() * 1e9 / elapsed : 0.);
+
+              QMetaObject::invokeMethod(
+                ChatPage::instance(),
+                [self, evs = std::move(evs), results = std::move(results)]() mutable {
+                    if (self)
+                        self->publishDecrypted(evs, std::move(results));
+                },
+                Qt::QueuedConnection);
+          });
+    }
+}
+
+void
+EventStore::publishDecrypted(
+  const std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> &events,
+  std::vector<olm::DecryptionResult> results)
+{
+    for (std::size_t i = 0; i < events.size() && i < results.size(); i++) {
+        // Failed decryptions go through decryptEvent on demand, so that keys get requested.
+        if (results[i].error || !results[i].event)
+            continue;
+
+        IdIndex idx{room_, events[i].event_id};
+        if (decryptedEvents_.contains(idx))
+            continue;
+
+        auto encInfo = mtx::accessors::file(results[i].event.value());
+        if (encInfo)
+            emit newEncryptedImage(encInfo.value());
+        encInfo = mtx::accessors::thumbnail_file(results[i].event.value());
+        if (encInfo)
+            emit newEncryptedImage(encInfo.value());
+
+        decryptedEvents_.insert(idx, new olm::DecryptionResult(std::move(results[i])));
+    }
+}
+
 void
 EventStore::refetchOnlineKeyBackupKeys()
 {
@@ -811,7 +918,7 @@ EventStore::enableKeyRequests(bool suppressKeyRequests_)
     if (!suppressKeyRequests_) {
         auto keys = decryptedEvents_.keys();
         for (const auto &key : std::as_const(keys))
-            if (key.room == this->room_id_)
+            if (key.room == this->room_)
                 decryptedEvents_.remove(key);
         suppressKeyRequests = false;
     } else
@@ -830,7 +937,7 @@ EventStore::get(const std::string &id,
     if (id.empty())
         return nullptr;
 
-    IdIndex index{room_id_, id};
+    IdIndex index{room_, id};
     if (resolve_edits) {
         auto edits_ = edits(index.id);
         if (!edits_.empty()) {
@@ -886,7 +993,7 @@ EventStore::decryptionError(std::string id)
     if (id.empty())
         return olm::DecryptionErrorCode::NoError;
 
-    IdIndex index{room_id_, std::move(id)};
+    IdIndex index{room_, std::move(id)};
     auto edits_ = edits(index.id);
     if (!edits_.empty()) {
         index.id       = mtx::accessors::event_id(edits_.back());
@@ -16,6 +16,7 @@
 #include <mtx/responses/messages.hpp>
 #include <mtx/responses/sync.hpp>
 
+#include "InternedId.h"
 #include "encryption/Olm.h"
 
 class EventStore final : public QObject
@@ -34,12 +35,12 @@ public:
     };
     struct Index
     {
-        std::string room;
+        InternedId room;
         uint64_t idx;
 
         friend size_t qHash(const Index &i, size_t seed = 0) noexcept
         {
-            seed = hashCombine(qHashBits(i.room.data(), i.room.size(), seed), seed);
+            seed = hashCombine(qHash(i.room, seed), seed);
             seed = hashCombine(qHash(i.idx, seed), seed);
             return seed;
         }
@@ -51,11 +52,12 @@ public:
     };
     struct IdIndex
     {
-        std::string room, id;
+        InternedId room;
+        std::string id;
 
         friend size_t qHash(const IdIndex &i, size_t seed = 0) noexcept
         {
-            seed = hashCombine(qHashBits(i.room.data(), i.room.size(), seed), seed);
+            seed = hashCombine(qHash(i.room, seed), seed);
             seed = hashCombine(qHashBits(i.id.data(), i.id.size(), seed), seed);
             return seed;
         }
@@ -99,6 +101,8 @@ public:
 signals:
     void beginInsertRows(int from, int to);
     void endInsertRows();
+    void beginRemoveRows(int from, int to);
+    void endRemoveRows();
     void beginResetModel();
     void endResetModel();
     void dataChanged(int from, int to);
@@ -121,14 +125,24 @@ public slots:
     void addPending(const mtx::events::collections::TimelineEvents &event);
     void receivedSessionKey(const std::string &session_id);
     void clearTimeline();
+    //! Drop the oldest events, which the retention policies deleted from the cache.
+    void historyTrimmed();
     void enableKeyRequests(bool suppressKeyRequests_);
 
 private:
     olm::DecryptionResult const *
     decryptEvent(const IdIndex &idx,
                  const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e);
+    //! Decrypt the encrypted events in a freshly received page on the thread pool and publish
+    //! the successfully decrypted ones into decryptedEvents_ before the delegates request them.
+    void decryptInBackground(const std::vector<mtx::events::collections::TimelineEvents> &events);
+    void publishDecrypted(
+      const std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> &events,
+      std::vector<olm::DecryptionResult> results);
 
     std::string room_id_;
+    //! room_id_ as used in the keys of the shared caches
+    InternedId room_;
 
     uint64_t first = std::numeric_limits<uint64_t>::max(),
              last  = std::numeric_limits<uint64_t>::max();
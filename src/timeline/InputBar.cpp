@@ -38,6 +38,7 @@
 #include "TimelineViewManager.h"
 #include "UserSettingsPage.h"
 #include "Utils.h"
+#include "encryption/Olm.h"
 #include "ui/UserProfile.h"
 
 #include "blurhash.hpp"
@@ -268,6 +269,7 @@ InputBar::updateTextContentProperties(const QString &t, bool charDeleted)
                                              QStringLiteral("clear-timeline"),
                                              QStringLiteral("reset-state"),
                                              QStringLiteral("rotate-megolm-session"),
+                                             QStringLiteral("retention"),
                                              QStringLiteral("md"),
                                              QStringLiteral("cmark"),
                                              QStringLiteral("plain"),
@@ -975,6 +977,26 @@ InputBar::command(const QString &command, QString args)
         room->resetState();
     } else if (command == QLatin1String("rotate-megolm-session")) {
         cache::dropOutboundMegolmSession(room->roomId().toStdString());
+    } else if (command == QLatin1String("retention")) {
+        auto limits    = args.split(' ', Qt::SkipEmptyParts);
+        bool isDefault = !limits.isEmpty() && limits.front() == QLatin1String("default");
+        if (isDefault)
+            limits.removeFirst();
+
+        // no limits remove the policy
+        std::optional<RetentionPolicy> policy;
+        if (!limits.isEmpty()) {
+            policy = RetentionPolicy{
+              .max_events = limits.value(0).toULongLong(),
+              .max_age_ms = limits.value(1).toULongLong() * 24 * 60 * 60 * 1000,
+              .max_bytes  = limits.value(2).toULongLong() * 1024 * 1024,
+            };
+        }
+
+        if (isDefault)
+            cache::client()->setDefaultRetentionPolicy(policy);
+        else
+            cache::client()->setRetentionPolicy(room->roomId().toStdString(), policy);
     } else if (command == QLatin1String("md")) {
         message(args, MarkdownOverride::ON);
     } else if (command == QLatin1String("cmark")) {
@@ -1515,6 +1537,11 @@ InputBar::startTyping()
     if (!typingRefresh_.isActive()) {
         typingRefresh_.start();
 
+        // Typing usually ends in a message, so get the key share out of the way before it is sent.
+        // This repeats with the refresh, so member and device changes are picked up meanwhile.
+        if (cache::isRoomEncrypted(room->roomId().toStdString()))
+            olm::share_group_session_ahead(room->roomId().toStdString());
+
         if (ChatPage::instance()->userSettings()->typingNotifications()) {
             http::client()->start_typing(
               room->roomId().toStdString(), 10'000, [](mtx::http::RequestErr err) {
@@ -108,12 +108,12 @@ RoomlistModel::data(const QModelIndex &index, int role) const
         } else if (role == Roles::IsDirect) {
             return directChatToUser.count(roomid) > 0;
         } else if (role == Roles::DirectChatOtherUserId) {
-            return directChatToUser.count(roomid) ? directChatToUser.at(roomid).front()
-                                                  : QLatin1String("");
+            auto direct = directChatToUser.find(roomid);
+            return direct != directChatToUser.end() ? direct->second.front() : QLatin1String("");
         }
 
-        if (models.contains(roomid)) {
-            auto room = models.value(roomid);
+        if (auto model = models.constFind(roomid); model != models.cend()) {
+            const auto &room = *model;
             switch (role) {
             case Roles::AvatarUrl:
                 return room->roomAvatarUrl();
@@ -125,8 +125,10 @@ RoomlistModel::data(const QModelIndex &index, int role) const
                 return room->lastMessage().descriptiveTime;
             case Roles::Timestamp:
                 return QVariant{static_cast<quint64>(room->lastMessageTimestamp())};
-            case Roles::HasUnreadMessages:
-                return this->roomReadStatus.count(roomid) && this->roomReadStatus.at(roomid);
+            case Roles::HasUnreadMessages: {
+                auto status = roomReadStatus.find(roomid);
+                return status != roomReadStatus.end() && status->second;
+            }
             case Roles::HasLoudNotification:
                 return room->hasMentions();
             case Roles::NotificationCount:
@@ -249,10 +251,11 @@ void
 RoomlistModel::updateReadStatus(const std::map<QString, bool> &roomReadStatus_)
 {
     std::vector<int> roomsToUpdate;
-    roomsToUpdate.resize(roomReadStatus_.size());
+    roomsToUpdate.reserve(roomReadStatus_.size());
     for (const auto &[roomid, roomUnread] : roomReadStatus_) {
         if (roomUnread != roomReadStatus[roomid]) {
-            roomsToUpdate.push_back(this->roomidToIndex(roomid));
+            if (auto idx = this->roomidToIndex(roomid); idx >= 0)
+                roomsToUpdate.push_back(idx);
         }
 
         this->roomReadStatus[roomid] = roomUnread;
@@ -629,8 +632,11 @@ RoomlistModel::initializeRooms()
         roomids.push_back(*id);
     }
 
-    for (const auto &id : cache::client()->roomIds())
-        addRoom(id, true);
+    {
+        cache::ReadSnapshot snapshot;
+        for (const auto &id : cache::client()->roomIds())
+            addRoom(id, true);
+    }
 
     nhlog::db()->info("Restored {} rooms from cache", rowCount());
 
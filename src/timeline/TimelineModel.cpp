@@ -474,6 +474,12 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
         beginInsertRows(QModelIndex(), first, last);
     });
     connect(&events, &EventStore::endInsertRows, this, [this]() { endInsertRows(); });
+    connect(&events, &EventStore::beginRemoveRows, this, [this](int from, int to) {
+        nhlog::ui()->debug(
+          "begin remove from {} to {}", events.size() - to - 1, events.size() - from - 1);
+        beginRemoveRows(QModelIndex(), events.size() - to - 1, events.size() - from - 1);
+    });
+    connect(&events, &EventStore::endRemoveRows, this, [this]() { endRemoveRows(); });
     connect(&events, &EventStore::beginResetModel, this, [this]() { beginResetModel(); });
     connect(&events, &EventStore::endResetModel, this, [this]() { endResetModel(); });
     connect(&events, &EventStore::newEncryptedImage, this, &TimelineModel::newEncryptedImage);
@@ -620,22 +626,8 @@ TimelineModel::data(const mtx::events::collections::TimelineEvents &event, int r
         return {toRoomEventType(event)};
     case TypeString:
         return QVariant(toRoomEventTypeString(event));
-    case IsOnlyEmoji: {
-        QString qBody = QString::fromStdString(body(event));
-
-        QVector<uint> utf32_string = qBody.toUcs4();
-        int emojiCount             = 0;
-
-        for (auto &code : utf32_string) {
-            if (utils::codepointIsEmoji(code)) {
-                emojiCount++;
-            } else {
-                return {0};
-            }
-        }
-
-        return {emojiCount};
-    }
+    case IsOnlyEmoji:
+        return {utils::emojiOnlyCount(body(event))};
     case Body:
         return QVariant(utils::replaceEmoji(QString::fromStdString(body(event)).toHtmlEscaped()));
     case FormattedBody: {
@@ -1015,7 +1007,10 @@ TimelineModel::multiData(const QModelIndex &index, QModelRoleDataSpan roleDataSp
             roleData.clearData();
         return;
     }
+    decryptRelatedEvents(*event, roleDataSpan);
 
+    // all roles of the delegate are read from the same snapshot
+    cache::ReadSnapshot snapshot;
     for (QModelRoleData &roleData : roleDataSpan) {
         roleData.setData(data(*event, roleData.role()));
     }
@@ -1041,7 +1036,9 @@ TimelineModel::multiData(const QString &id,
             roleData.clearData();
         return;
     }
+    decryptRelatedEvents(*event, roleDataSpan);
 
+    cache::ReadSnapshot snapshot;
     for (QModelRoleData &roleData : roleDataSpan) {
         int role = roleData.role();
 
@@ -1049,6 +1046,27 @@ TimelineModel::multiData(const QString &id,
     }
 }
 
+void
+TimelineModel::decryptRelatedEvents(const mtx::events::collections::TimelineEvents &event,
+                                    QModelRoleDataSpan roleDataSpan) const
+{
+    // Decrypting stores the message index, which shouldn't happen inside a read snapshot. The
+    // decrypted events are cached, so the roles can then read them without decrypting again.
+    auto requested = [&roleDataSpan](int role) {
+        return std::any_of(roleDataSpan.begin(), roleDataSpan.end(), [role](const auto &roleData) {
+            return roleData.role() == role;
+        });
+    };
+
+    const auto &id = mtx::accessors::event_id(event);
+    if (requested(Notificationlevel))
+        for (const auto &r : mtx::accessors::relations(event).relations)
+            events.get(r.event_id, id);
+    // decrypts the latest edit of the event
+    if (requested(EncryptionError))
+        events.decryptionError(id);
+}
+
 QVariant
 TimelineModel::dataById(const QString &id, int role, const QString &relatedTo)
 {
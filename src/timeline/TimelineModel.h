@@ -444,6 +444,7 @@ public slots:
     {
         events.receivedSessionKey(session_key);
     }
+    void historyTrimmed() { events.historyTrimmed(); }
 
     QString roomName() const;
     QString plainRoomName() const;
@@ -521,6 +522,9 @@ private:
     void
     sendEncryptedMessage(const mtx::events::RoomEvent<T> &msg, mtx::events::EventType eventType);
     void readEvent(const std::string &id);
+    //! Decrypt the events, that the roles in roleDataSpan read for event.
+    void decryptRelatedEvents(const mtx::events::collections::TimelineEvents &event,
+                              QModelRoleDataSpan roleDataSpan) const;
 
     void setPaginationInProgress(const bool paginationInProgress);
 
@@ -418,6 +418,14 @@ TimelineViewManager::updateReadReceipts(const QString &room_id,
     }
 }
 
+void
+TimelineViewManager::historyTrimmed(const QString &room_id)
+{
+    if (auto room = rooms_->getRoomById(room_id)) {
+        room->historyTrimmed();
+    }
+}
+
 void
 TimelineViewManager::receivedSessionKey(const std::string &room_id, const std::string &session_id)
 {
@@ -426,6 +434,16 @@ TimelineViewManager::receivedSessionKey(const std::string &room_id, const std::s
     }
 }
 
+void
+TimelineViewManager::receivedSessionKeys(const std::string &room_id,
+                                         const std::vector<std::string> &session_ids)
+{
+    if (auto room = rooms_->getRoomById(QString::fromStdString(room_id))) {
+        for (const auto &session_id : session_ids)
+            room->receivedSessionKey(session_id);
+    }
+}
+
 void
 TimelineViewManager::initializeRoomlist()
 {
@@ -509,7 +527,13 @@ TimelineViewManager::completerFor(const QString &completerName, const QString &r
 {
     if (completerName == QLatin1String("user")) {
         auto userModel = new UsersModel(roomId.toStdString());
-        auto proxy     = new CompletionProxyModel(userModel);
+        auto proxy =
+          userModel->hasMemberIndex()
+            ? new CompletionProxyModel(userModel,
+                                       [userModel](const QString &term, size_t limit, size_t d) {
+                                           return userModel->search(term, limit, d);
+                                       })
+            : new CompletionProxyModel(userModel);
         userModel->setParent(proxy);
         return proxy;
     } else if (completerName == QLatin1String("emoji")) {
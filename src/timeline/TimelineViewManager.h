@@ -122,7 +122,10 @@ signals:
 
 public slots:
     void updateReadReceipts(const QString &room_id, const std::vector<QString> &event_ids);
+    void historyTrimmed(const QString &room_id);
     void receivedSessionKey(const std::string &room_id, const std::string &session_id);
+    void receivedSessionKeys(const std::string &room_id,
+                             const std::vector<std::string> &session_ids);
     void initializeRoomlist();
 
     void showEvent(const QString &room_id, const QString &event_id);